@@ -0,0 +1,53 @@
+// Generated from library.lisp by tools/romlibrary.py - do not edit
+
+#define ROMCELLS 40
+#define ROMENV ((object *)&LispRom[38])
+#define ROMFORMS ((object *)&LispRom[39])
+#define ROMSYMBOLS 0
+#define ROMBUILTINS 286
+#define ROMHASH 0xBE8506AC
+
+const char LispRomSymbols[] PROGMEM = "";
+
+const object LispRom[ROMCELLS] = {
+  { { { (object *)NUMBER, (object *)(uintptr_t)1 } } },
+  { { { (object *)&LispRom[0], NULL } } },
+  { { { (object *)NUMBER, (object *)(uintptr_t)7 } } },
+  { { { (object *)&LispRom[2], (object *)&LispRom[1] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)188 } } },
+  { { { (object *)&LispRom[4], (object *)&LispRom[3] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)12 } } },
+  { { { (object *)NUMBER, (object *)(uintptr_t)7 } } },
+  { { { (object *)&LispRom[7], NULL } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)189 } } },
+  { { { (object *)&LispRom[9], (object *)&LispRom[8] } } },
+  { { { (object *)&LispRom[10], NULL } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)58 } } },
+  { { { (object *)&LispRom[12], (object *)&LispRom[11] } } },
+  { { { (object *)&LispRom[13], NULL } } },
+  { { { (object *)NUMBER, (object *)(uintptr_t)7 } } },
+  { { { (object *)&LispRom[15], (object *)&LispRom[14] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)190 } } },
+  { { { (object *)&LispRom[17], (object *)&LispRom[16] } } },
+  { { { (object *)&LispRom[18], NULL } } },
+  { { { NULL, (object *)&LispRom[19] } } },
+  { { { (object *)&LispRom[6], (object *)&LispRom[20] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)2086859685 } } },
+  { { { (object *)&LispRom[22], (object *)&LispRom[21] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)413441600 } } },
+  { { { (object *)&LispRom[24], NULL } } },
+  { { { (object *)STRING_, (object *)&LispRom[27] } } },
+  { { { NULL, (object *)(uintptr_t)1818850160 } } },
+  { { { (object *)&LispRom[26], (object *)&LispRom[25] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)276 } } },
+  { { { (object *)&LispRom[29], (object *)&LispRom[28] } } },
+  { { { (object *)&LispRom[30], NULL } } },
+  { { { (object *)&LispRom[24], NULL } } },
+  { { { (object *)&LispRom[32], (object *)&LispRom[31] } } },
+  { { { (object *)&LispRom[6], (object *)&LispRom[33] } } },
+  { { { (object *)SYMBOL, (object *)(uintptr_t)338913760 } } },
+  { { { (object *)&LispRom[35], (object *)&LispRom[34] } } },
+  { { { (object *)&LispRom[23], NULL } } },
+  { { { (object *)&LispRom[36], (object *)&LispRom[37] } } },
+  { { { (object *)&LispRom[5], NULL } } },
+};
@@ -12,6 +12,15 @@ const char LispLibrary[] PROGMEM = STRINGIFY(
 #include "../library.lisp"
 ;
 
+// Precompiled library cells, generated from library.lisp by tools/romlibrary.py
+#if defined(romlibrary)
+#include "ulisp-rom-library.h"
+static_assert(ROMBUILTINS == ENDFUNCTIONS, "regenerate ulisp-rom-library.h with tools/romlibrary.py");
+#define romcell(x) ((object *)(x) >= (object *)LispRom && (object *)(x) < (object *)LispRom + ROMCELLS)
+#else
+#define ROMHASH 0
+#endif
+
 // #include "LispLibrary.h"
 #include <setjmp.h>
 #include <SPI.h>
@@ -34,6 +43,10 @@ const char LispLibrary[] PROGMEM = STRINGIFY(
 Adafruit_ST7735 tft = Adafruit_ST7735(TFT_CS, TFT_DC, TFT_MOSI, TFT_SCLK, TFT_RST);
 #endif
 
+#if defined(serialflash) && !defined(SERIALFLASHFILE)
+#include "spi_flash.h"
+#endif
+
 #if defined(sdcardsupport)
 #include <SD.h>
 #define SDSIZE 172
@@ -49,6 +62,10 @@ Adafruit_ST7735 tft = Adafruit_ST7735(TFT_CS, TFT_DC, TFT_MOSI, TFT_SCLK, TFT_RS
 
 #define WORKSPACESIZE 3000              /* Cells (8*bytes) */
 #define SYMBOLTABLESIZE 512             /* Bytes - must be even*/
+#define RINGSIZE 1024                   /* Words for ring buffers */
+#define TASKMAX 4                       /* Tasks besides the REPL */
+#define TASKSTACKSIZE 4096              /* Bytes - multiple of 16 */
+#define TASKGUARD 1024                  /* Bytes at the bottom of a task stack that eval doesn't enter */
 #define EEPROMSIZE (184*4096)
 extern uint8_t _end;
 
@@ -57,6 +74,7 @@ char SymbolTable[SYMBOLTABLESIZE];
 #if defined(CODESIZE)
 RAMFUNC uint8_t MyCode[CODESIZE] WORDALIGNED;
 #endif
+uint32_t RingStore[RINGSIZE] __attribute__((aligned (8)));
 
 // Global variables
 
@@ -72,6 +90,7 @@ unsigned int TraceDepth[TRACEMAX];
 object *tee;
 object *GlobalEnv;
 object *GCStack = NULL;
+object *Roots[ROOTS];
 object *GlobalString;
 int GlobalStringIndex = 0;
 uint8_t PrintCount = 0;
@@ -80,12 +99,30 @@ char LastChar = 0;
 char LastPrint = 0;
 
 // Flags
-enum flag { PRINTREADABLY, RETURNFLAG, ESCAPE, EXITEDITOR, LIBRARYLOADED, NOESC, MUFFLEERRORS };
+enum flag { PRINTREADABLY, RETURNFLAG, ESCAPE, EXITEDITOR, LIBRARYLOADED, NOESC, MUFFLEERRORS, HEAPSTACK };
 volatile char Flags_ = 0b00001; // PRINTREADABLY set by default
 
+// Evaluation limits - Fuel is the number of eval steps left, Deadline a millis() time
+enum limit { FUELLIMIT = 1, DEADLINELIMIT = 2 };
+uint8_t Limits = 0;
+uint32_t Fuel = 0;
+uint32_t Deadline = 0;
+
 // Forward references
+void checklimits ();
+bool listp (object *x);
+void marktasks ();
+void movetasks (object *from, object *to);
+void resettasks ();
+void stalehashtables (unsigned int n);
+bool flushweak ();
+inline bool stackdeep (int guard);
+bool stackguard ();
 object *tf_progn (object *form, object *env);
+object *fn_memoize (object *args, object *env);
+object *internsymbol (char *buffer);
 object *eval (object *form, object *env);
+object *heval (object *form, object *env);
 object *read (gfun_t gfun);
 void repl (object *env);
 void printobject (object *form, pfun_t pfun);
@@ -96,6 +133,7 @@ int builtin (char* n);
 // Error handling
 
 void errorsub (symbol_t fname, PGM_P string) {
+  serialflush();
   pfl(pserial); pfstring(PSTR("Error: "), pserial);
   if (fname) {
     pserial('\'');
@@ -126,6 +164,7 @@ void error2 (symbol_t fname, PGM_P string) {
 
 // Save space as these are used multiple times
 const char notanumber[] PROGMEM = "argument is not a number";
+const char fixedfloat[] PROGMEM = "can't mix fixed-point and float";
 const char notaninteger[] PROGMEM = "argument is not an integer";
 const char notastring[] PROGMEM = "argument is not a string";
 const char notalist[] PROGMEM = "argument is not a list";
@@ -141,10 +180,100 @@ const char invalidpin[] PROGMEM = "invalid pin";
 const char resultproper[] PROGMEM = "result is not a proper list";
 const char oddargs[] PROGMEM = "odd number of arguments";
 
+// Ring buffer storage
+
+// The elements of a ring buffer are kept in RingStore, outside the workspace, in a block that starts with
+// a ring_t. The ring object is a RING cell holding the offset of its block, and the block holds the cell
+// number of its owner, so that compactrings() can tell which blocks are still in use after a collection.
+// The first words of the store hold the offset of the free space
+
+#define RingTop RingStore[0]
+#define RINGBASE 2 // Keeps the blocks 8-byte aligned
+
+enum ringkind { RINGINTEGER, RINGFIXED, RINGFLOAT };
+enum ringflag { RINGINEXACT=1 }; // The integer sum of squares overflowed
+
+typedef union { int64_t i; double f; } ringsum_t;
+typedef struct { uint32_t first, count; } deque_t;
+
+// Followed by capacity element slots, then the slots of the max and min deques
+typedef struct {
+  uint32_t owner, capacity, kind, flags;
+  uint32_t first, count;    // Slot of the oldest element, and number of elements
+  deque_t max, min;
+  ringsum_t sum, sumsq;
+} ring_t;
+
+inline ring_t *ringblock (object *ring) {
+  return (ring_t *)&RingStore[ring->integer];
+}
+
+inline uint32_t *ringdata (ring_t *r) {
+  return (uint32_t *)(r + 1);
+}
+
+int ringwords (int capacity) {
+  return (sizeof(ring_t)/4 + 3*capacity + 1) & ~1;
+}
+
+// Slides the blocks still owned by a ring down over the free ones; call after gc()
+void compactrings () {
+  uint32_t from = RINGBASE, to = RINGBASE;
+  while (from < RingTop) {
+    ring_t *r = (ring_t *)&RingStore[from];
+    int words = ringwords(r->capacity);
+    object *owner = &Workspace[r->owner];
+    if (r->owner < WORKSPACESIZE && owner->type == RING && (uint32_t)owner->integer == from) {
+      if (to != from) memmove(&RingStore[to], r, words*4);
+      owner->integer = to;
+      to = to + words;
+    }
+    from = from + words;
+  }
+  RingTop = to;
+}
+
+// Case table storage
+
+// A case or ecase form whose keys are all integers, or all characters, gets a table of its clauses the
+// first time it runs: a jump table indexed by the key minus the smallest key, or the keys in order for a
+// binary search if that would take more than twice as many slots. Tables are found by the address of the
+// form, which gc() keeps, so a form that is redefined gets a new table. All the tables are dropped when
+// they are full, when cells move, and when the workspace is short of space
+
+#define CASETABLES 8  // Forms with a table
+#define CASEKEYS 256  // Slots in all the tables
+#define CASEMIN 6     // Fewest keys worth a table
+
+enum casekind { CASELINEAR, CASEDENSE, CASESORTED };
+
+typedef struct {
+  int32_t key;
+  object *clause;     // NULL for an unused slot in a jump table
+} casekey_t;
+
+typedef struct {
+  object *args;       // The form after case, which identifies it
+  object *otherwise;  // The t clause, or NULL
+  int32_t min;        // Smallest key
+  uint16_t start, size;
+  uint8_t kind, chars;
+} casetable_t;
+
+casetable_t CaseTables[CASETABLES];
+casekey_t CaseKeys[CASEKEYS];
+int CaseCount = 0, CaseTop = 0;
+
+void clearcases () {
+  CaseCount = 0;
+  CaseTop = 0;
+}
+
 // Set up workspace
 
 void initworkspace () {
   Freelist = NULL;
+  RingTop = RINGBASE;
   for (int i=WORKSPACESIZE-1; i>=0; i--) {
     object *obj = &Workspace[i];
     car(obj) = NULL;
@@ -185,6 +314,13 @@ object *makefloat (float f) {
   return ptr;
 }
 
+object *makefixed (int32_t q) {
+  object *ptr = myalloc();
+  ptr->type = FIXED;
+  ptr->integer = q;
+  return ptr;
+}
+
 object *character (char c) {
   object *ptr = myalloc();
   ptr->type = CHARACTER;
@@ -233,6 +369,9 @@ object *stream (unsigned char streamtype, unsigned char address) {
 void markobject (object *obj) {
   MARK:
   if (obj == NULL) return;
+  #if defined(romlibrary)
+  if (romcell(obj)) return; // Read only, and only refers to other ROM cells
+  #endif
   if (marked(obj)) return;
 
   object* arg = car(obj);
@@ -245,7 +384,7 @@ void markobject (object *obj) {
     goto MARK;
   }
 
-  if (type == ARRAY) {
+  if (type == ARRAY || type == HASHTABLE || type == STRUCT || type == GENERATOR) {
     obj = cdr(obj);
     goto MARK;
   }
@@ -273,12 +412,20 @@ void gc (object *form, object *env) {
   #if defined(printgcs)
   int start = Freespace;
   #endif
-  markobject(tee);
-  markobject(GlobalEnv);
-  markobject(GCStack);
-  markobject(form);
-  markobject(env);
-  sweep();
+  while (true) {
+    markobject(tee);
+    markobject(GlobalEnv);
+    markobject(GCStack);
+    for (int i=0; i<ROOTS; i++) markobject(Roots[i]);
+    for (int i=0; i<CaseCount; i++) markobject(CaseTables[i].args);
+    marktasks();
+    markobject(form);
+    markobject(env);
+    sweep();
+    // Short of space: drop memoized results and collect again
+    if (Freespace >= WORKSPACESIZE>>3 || !flushweak()) break;
+  }
+  if (!stackguard()) error2(0, PSTR("Stack overflow"));
   #if defined(printgcs)
   pfl(pserial); pserial('{'); pint(Freespace - start, pserial); pserial('}');
   #endif
@@ -310,26 +457,35 @@ void movepointer (object *from, object *to) {
 }
 
 uintptr_t compactimage (object **arg) {
+  clearcases();
   markobject(tee);
   markobject(GlobalEnv);
   markobject(GCStack);
+  for (int i=0; i<ROOTS; i++) markobject(Roots[i]);
+  marktasks();
   object *firstfree = Workspace;
   while (marked(firstfree)) firstfree++;
   object *obj = &Workspace[WORKSPACESIZE-1];
+  bool moved = false;
   while (firstfree < obj) {
     if (marked(obj)) {
+      moved = true;
       car(firstfree) = car(obj);
       cdr(firstfree) = cdr(obj);
+      if ((firstfree->type & ~MARKBIT) == RING) ringblock(firstfree)->owner = firstfree - Workspace;
       unmark(obj);
       movepointer(obj, firstfree);
       if (GlobalEnv == obj) GlobalEnv = firstfree;
       if (GCStack == obj) GCStack = firstfree;
+      for (int i=0; i<ROOTS; i++) if (Roots[i] == obj) Roots[i] = firstfree;
+      movetasks(obj, firstfree);
       if (*arg == obj) *arg = firstfree;
       while (marked(firstfree)) firstfree++;
     }
     obj--;
   }
   sweep();
+  if (moved) stalehashtables(firstfree - Workspace);
   return firstfree - Workspace;
 }
 
@@ -348,6 +504,14 @@ char *MakeFilename (object *arg) {
   return buffer;
 }
 
+// CRC-32, used for images and uploads
+
+uint32_t crc32byte (uint32_t crc, uint8_t b) {
+  crc = crc ^ b;
+  for (int i=0; i<8; i++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  return crc;
+}
+
 // Save-image and load-image
 const unsigned int Eeprom = 0x801D800;
 
@@ -461,6 +625,394 @@ void FlashWriteInt (uint32_t *addr, int data) {
   FlashWriteByte(addr, data & 0xFF); FlashWriteByte(addr, data>>8 & 0xFF);
   FlashWriteByte(addr, data>>16 & 0xFF); FlashWriteByte(addr, data>>24 & 0xFF);
 }
+#elif defined(serialflash)
+// Image in the free user area of the Duo's serial flash; page 0 holds the header, which
+// is written last so an interrupted save leaves no valid image. Define SERIALFLASHFILE as
+// a file name to build against a file instead of the flash, for testing on a host
+#define SERIALFLASHBASE 0x140000
+#define SERIALFLASHSIZE 0xC0000
+#define FLASHPAGE 256
+#define FLASHSECTOR 4096
+#define IMAGEMAGIC 0x70734C75 // "uLsp"
+#define IMAGEVERSION 7
+
+// All fields are 32 bits so tools/imagetool.py can read images saved on any build
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t builtins;        // Saved symbol numbers depend on the builtin table
+  uint32_t length;          // Bytes after the header page
+  uint32_t crc;             // CRC-32 of those bytes
+  uint32_t imagesize;       // Cells
+  uint32_t symboltablesize;
+  uint32_t codesize;
+  uint32_t ringsize;        // Bytes of RingStore
+  uint32_t autorun;         // Saved pointers, see imageptr()
+  uint32_t globalenv;
+  uint32_t gcstack;
+  uint32_t symboltop;       // Offset into the symbol table
+  uint32_t romhash;         // Identifies the ROM library saved pointers can refer to
+  uint32_t generation;      // Identifies the checkpoint log records that belong to this image
+  uint32_t logoffset;       // Start of the checkpoint log, from the header
+} imageheader_t;
+
+// Checkpoints append the pages of the image that changed since the last save to a log after
+// the image area. Each record is a header page, written last, followed by its data pages
+#if defined(CODESIZE)
+#define IMAGECODE CODESIZE
+#else
+#define IMAGECODE 0
+#endif
+#define IMAGEBYTES (SYMBOLTABLESIZE + IMAGECODE + RINGSIZE*4 + WORKSPACESIZE*8)
+#define IMAGEPAGES ((IMAGEBYTES + FLASHPAGE - 1)/FLASHPAGE)
+#define LOGBASE (SERIALFLASHBASE + (FLASHPAGE + IMAGEBYTES + FLASHSECTOR - 1)/FLASHSECTOR*FLASHSECTOR)
+#define LOGEND KVBASE
+#define LOGMAGIC 0x676F4C75 // "uLog"
+#define KVSECTORS 16        // Sectors at the end of the area used by the key-value store
+#define KVBASE (SERIALFLASHBASE + SERIALFLASHSIZE - KVSECTORS*FLASHSECTOR)
+#define LOGPAGES 96
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t crc;             // CRC-32 of the data pages, then of this header with crc zero
+  uint32_t pages;
+  uint32_t imagesize;       // The rest as in imageheader_t
+  uint32_t autorun;
+  uint32_t globalenv;
+  uint32_t gcstack;
+  uint32_t symboltop;
+  uint16_t page[LOGPAGES];  // Image page number of each data page
+} logheader_t;
+
+uint8_t FlashPage[FLASHPAGE];
+uint32_t FlashAddr;
+int FlashFill;
+uint32_t FlashCRC;
+
+uint32_t PageCRC[IMAGEPAGES]; // CRC of each image page as it is on the flash
+int SavedPages = 0;           // Zero until the workspace matches a saved or loaded image
+uint32_t LogBase, LogAddr;
+uint32_t Generation;
+uint32_t Checkpoints;         // Log records since the last full save
+uint32_t FlashWrites = 0, FlashErases = 0;
+
+#if defined(SERIALFLASHFILE)
+#include <stdio.h>
+FILE *flashfile () {
+  static FILE *file = NULL;
+  if (file != NULL) return file;
+  file = fopen(SERIALFLASHFILE, "r+b");
+  if (file == NULL) {
+    file = fopen(SERIALFLASHFILE, "w+b");
+    for (int i=0; i<SERIALFLASHSIZE; i++) fputc(0xFF, file);
+  }
+  return file;
+}
+
+void SerialFlashRead (uint32_t addr, uint8_t *buffer, int n) {
+  FILE *file = flashfile();
+  fseek(file, addr - SERIALFLASHBASE, SEEK_SET);
+  if (fread(buffer, 1, n, file) != (size_t)n) memset(buffer, 0xFF, n);
+}
+
+void SerialFlashWrite (uint32_t addr, const uint8_t *buffer, int n) {
+  FILE *file = flashfile();
+  uint8_t old[FLASHPAGE];
+  SerialFlashRead(addr, old, n);
+  for (int i=0; i<n; i++) old[i] = old[i] & buffer[i]; // Programming only clears bits
+  fseek(file, addr - SERIALFLASHBASE, SEEK_SET);
+  fwrite(old, 1, n, file);
+  fflush(file);
+  FlashWrites++;
+}
+
+void SerialFlashErase (uint32_t addr) {
+  uint8_t blank[FLASHPAGE];
+  memset(blank, 0xFF, FLASHPAGE);
+  FILE *file = flashfile();
+  fseek(file, addr - SERIALFLASHBASE, SEEK_SET);
+  for (int i=0; i<FLASHSECTOR/FLASHPAGE; i++) fwrite(blank, 1, FLASHPAGE, file);
+  fflush(file);
+  FlashErases++;
+}
+#else
+void SerialFlashRead (uint32_t addr, uint8_t *buffer, int n) {
+  sFLASH_ReadBuffer(buffer, addr, n);
+}
+
+void SerialFlashWrite (uint32_t addr, const uint8_t *buffer, int n) {
+  sFLASH_WriteBuffer(buffer, addr, n);
+  FlashWrites++;
+}
+
+void SerialFlashErase (uint32_t addr) {
+  sFLASH_EraseSector(addr);
+  FlashErases++;
+}
+#endif
+
+void FlashBeginWrite (uint32_t bytes) {
+  for (uint32_t a=0; a<FLASHPAGE+bytes; a=a+FLASHSECTOR) SerialFlashErase(SERIALFLASHBASE + a);
+  FlashAddr = SERIALFLASHBASE + FLASHPAGE; FlashFill = 0; FlashCRC = 0xFFFFFFFF;
+}
+
+void FlashWriteByte (uint8_t data) {
+  FlashCRC = crc32byte(FlashCRC, data);
+  FlashPage[FlashFill++] = data;
+  if (FlashFill == FLASHPAGE) {
+    SerialFlashWrite(FlashAddr, FlashPage, FLASHPAGE);
+    FlashAddr = FlashAddr + FLASHPAGE; FlashFill = 0;
+  }
+}
+
+void FlashEndWrite (imageheader_t *header) {
+  if (FlashFill) SerialFlashWrite(FlashAddr, FlashPage, FlashFill);
+  header->magic = IMAGEMAGIC;
+  header->crc = ~FlashCRC;
+  SerialFlashWrite(SERIALFLASHBASE, (uint8_t *)header, sizeof(imageheader_t));
+}
+
+bool FlashReadHeader (imageheader_t *header) {
+  SerialFlashRead(SERIALFLASHBASE, (uint8_t *)header, sizeof(imageheader_t));
+  return header->magic == IMAGEMAGIC && header->length <= SERIALFLASHSIZE - FLASHPAGE;
+}
+
+void FlashBeginRead () {
+  FlashAddr = SERIALFLASHBASE + FLASHPAGE; FlashFill = FLASHPAGE; FlashCRC = 0xFFFFFFFF;
+}
+
+uint8_t FlashReadByte () {
+  if (FlashFill == FLASHPAGE) {
+    SerialFlashRead(FlashAddr, FlashPage, FLASHPAGE);
+    FlashAddr = FlashAddr + FLASHPAGE; FlashFill = 0;
+  }
+  uint8_t data = FlashPage[FlashFill++];
+  FlashCRC = crc32byte(FlashCRC, data);
+  return data;
+}
+
+// Checks the CRC before anything in the workspace is overwritten
+bool FlashCheckImage (imageheader_t *header) {
+  if (!FlashReadHeader(header)) return false;
+  FlashBeginRead();
+  for (uint32_t i=0; i<header->length; i++) FlashReadByte();
+  return ~FlashCRC == header->crc;
+}
+
+// Saved cells are two 32-bit words, with pointers saved as cell numbers so an image can be loaded
+// into a workspace at another address or of another size. Bit 0 of a saved car is set when the
+// car is a pointer, and bit 1 then marks a string chain cell, whose cdr holds characters
+#define IMAGEROM 0x80000000 // Saved pointer to a ROM library cell
+
+uint32_t imageptr (object *obj) {
+  if (obj == NULL) return 0;
+  #if defined(romlibrary)
+  if (romcell(obj)) return IMAGEROM | (obj - (object *)LispRom + 1)<<2;
+  #endif
+  return (obj - Workspace + 1)<<2;
+}
+
+object *loadptr (uint32_t word) {
+  if (word == 0) return NULL;
+  #if defined(romlibrary)
+  if (word & IMAGEROM) return (object *)LispRom + ((word & ~IMAGEROM)>>2) - 1;
+  #endif
+  return Workspace + (word>>2) - 1;
+}
+
+// Marks or unmarks the string chain cells among the first n cells, as they look like conses
+void markchains (unsigned int n, bool set) {
+  for (unsigned int i=0; i<n; i++) {
+    if (car(&Workspace[i]) != (object *)STRING_) continue;
+    object *chain = cdr(&Workspace[i]);
+    while (chain != NULL) {
+      #if defined(romlibrary)
+      if (romcell(chain)) break;
+      #endif
+      object *next = (object *)((uintptr_t)car(chain) & ~MARKBIT);
+      if (set) mark(chain); else unmark(chain);
+      chain = next;
+    }
+  }
+}
+
+// Saved words of a cell; needs markchains()
+uint32_t imagecar (object *obj) {
+  uintptr_t word = (uintptr_t)car(obj);
+  if (marked(obj)) return imageptr((object *)(word & ~MARKBIT)) | 3;
+  if (word != ZZERO && word < PAIR) return word; // Type of an atom
+  return imageptr((object *)word) | 1;
+}
+
+uint32_t imagecdr (object *obj) {
+  uintptr_t word = (uintptr_t)car(obj);
+  if (marked(obj) || (word != ZZERO && word < PAIR && word != ARRAY && word != HASHTABLE && word != STRUCT && word != GENERATOR && word != STRING_)) return (uintptr_t)cdr(obj);
+  return imageptr(cdr(obj));
+}
+
+// Turns the saved words loaded into a cell back into a cell
+void relocate (object *obj) {
+  uint32_t a = (uintptr_t)car(obj), d = (uintptr_t)cdr(obj);
+  if (a & 1) {
+    car(obj) = loadptr(a & ~3);
+    if (!(a & 2)) cdr(obj) = loadptr(d);
+  } else if (a == ARRAY || a == HASHTABLE || a == STRUCT || a == GENERATOR || a == STRING_) cdr(obj) = loadptr(d);
+}
+
+// The image as a byte stream: symbol table, code, ring buffer store, then the saved words of each cell
+uint32_t imagelength (unsigned int imagesize) {
+  return SYMBOLTABLESIZE + IMAGECODE + RINGSIZE*4 + imagesize*8;
+}
+
+uint8_t imagebyte (uint32_t i, uint32_t length) {
+  if (i >= length) return 0;
+  if (i < SYMBOLTABLESIZE) return SymbolTable[i];
+  i = i - SYMBOLTABLESIZE;
+  #if defined(CODESIZE)
+  if (i < CODESIZE) return MyCode[i];
+  i = i - CODESIZE;
+  #endif
+  if (i < RINGSIZE*4) return RingStore[i/4] >> (i%4*8);
+  i = i - RINGSIZE*4;
+  object *obj = &Workspace[i/8];
+  uint32_t word = (i & 4) ? imagecdr(obj) : imagecar(obj);
+  return word >> (i%4*8);
+}
+
+// Loads saved words into the cells, for relocate()
+void setimagebyte (uint32_t i, uint8_t data) {
+  if (i >= IMAGEBYTES) return;
+  if (i < SYMBOLTABLESIZE) { SymbolTable[i] = data; return; }
+  i = i - SYMBOLTABLESIZE;
+  #if defined(CODESIZE)
+  if (i < CODESIZE) { MyCode[i] = data; return; }
+  i = i - CODESIZE;
+  #endif
+  if (i < RINGSIZE*4) {
+    int shift = i%4*8;
+    if (shift == 0) RingStore[i/4] = 0;
+    RingStore[i/4] = RingStore[i/4] | (uint32_t)data<<shift;
+    return;
+  }
+  i = i - RINGSIZE*4;
+  uintptr_t *word = &((uintptr_t *)Workspace)[i/4];
+  int shift = i%4*8;
+  if (shift == 0) *word = 0;
+  *word = *word | (uintptr_t)data<<shift;
+}
+
+uint32_t imagepagecrc (int page, uint32_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (int i=0; i<FLASHPAGE; i++) crc = crc32byte(crc, imagebyte(page*FLASHPAGE + i, length));
+  return ~crc;
+}
+
+// Records the image just saved or loaded as the base for the next checkpoint; needs markchains()
+void checkpointbase (unsigned int imagesize, imageheader_t *header, uint32_t logaddr, uint32_t records) {
+  uint32_t length = imagelength(imagesize);
+  SavedPages = (length + FLASHPAGE - 1)/FLASHPAGE;
+  for (int p=0; p<SavedPages; p++) PageCRC[p] = imagepagecrc(p, length);
+  Generation = header->generation; LogBase = SERIALFLASHBASE + header->logoffset;
+  LogAddr = logaddr; Checkpoints = records;
+}
+
+// Reads the log record at addr into header and returns the address after it, or 0 if there is no valid record
+uint32_t logrecord (uint32_t addr, logheader_t *header, uint32_t generation) {
+  SerialFlashRead(addr, (uint8_t *)header, sizeof(logheader_t));
+  if (header->magic != LOGMAGIC || header->generation != generation || header->pages > LOGPAGES) return 0;
+  uint32_t end = addr + (header->pages + 1)*FLASHPAGE;
+  if (end > LOGEND) return 0;
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t p=0; p<header->pages; p++) {
+    SerialFlashRead(addr + (p + 1)*FLASHPAGE, FlashPage, FLASHPAGE);
+    for (int i=0; i<FLASHPAGE; i++) crc = crc32byte(crc, FlashPage[i]);
+  }
+  uint32_t saved = header->crc;
+  header->crc = 0;
+  for (unsigned int i=0; i<sizeof(logheader_t); i++) crc = crc32byte(crc, ((uint8_t *)header)[i]);
+  header->crc = saved;
+  return (~crc == saved) ? end : 0;
+}
+
+// Tests whether the flash from addr to the end of its sector is erased
+bool logblank (uint32_t addr) {
+  uint32_t end = (addr/FLASHSECTOR + 1)*FLASHSECTOR;
+  for (; addr < end && addr < LOGEND; addr = addr + FLASHPAGE) {
+    SerialFlashRead(addr, FlashPage, FLASHPAGE);
+    for (int i=0; i<FLASHPAGE; i++) if (FlashPage[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+// Replays the checkpoint log on top of the loaded base image, or just reads it if apply is false,
+// updating header to the last record; returns the number of records
+uint32_t replaylog (imageheader_t *header, uint32_t *logaddr, bool apply) {
+  uint32_t base = SERIALFLASHBASE + header->logoffset, addr = base, records = 0;
+  logheader_t record;
+  for (;;) {
+    uint32_t next = logrecord(addr, &record, header->generation);
+    if (next == 0) {
+      // Writing resumes in a fresh sector after a load, see below
+      uint32_t sector = base + (addr - base + FLASHSECTOR - 1)/FLASHSECTOR*FLASHSECTOR;
+      if (sector == addr || sector >= LOGEND) break;
+      next = logrecord(sector, &record, header->generation);
+      if (next == 0) break;
+      addr = sector;
+    }
+    for (uint32_t p=0; apply && p<record.pages; p++) {
+      SerialFlashRead(addr + (p + 1)*FLASHPAGE, FlashPage, FLASHPAGE);
+      for (int i=0; i<FLASHPAGE; i++) setimagebyte(record.page[p]*FLASHPAGE + i, FlashPage[i]);
+    }
+    header->imagesize = record.imagesize; header->autorun = record.autorun;
+    header->globalenv = record.globalenv; header->gcstack = record.gcstack;
+    header->symboltop = record.symboltop;
+    addr = next; records++;
+  }
+  // A record interrupted by a reset may have left pages programmed, so continue in a fresh sector
+  // unless the rest of this one is still erased
+  if (addr < LOGEND && logblank(addr)) *logaddr = addr;
+  else *logaddr = base + (addr - base + FLASHSECTOR - 1)/FLASHSECTOR*FLASHSECTOR;
+  return records;
+}
+
+// Appends the changed pages to the log; returns the number written, or -1 if a full save is needed.
+// Needs markchains()
+int checkpointlog (unsigned int imagesize, object *arg) {
+  uint32_t length = imagelength(imagesize);
+  int pages = (length + FLASHPAGE - 1)/FLASHPAGE;
+  if (SavedPages == 0) return -1;
+  logheader_t record;
+  memset(&record, 0xFF, sizeof(logheader_t));
+  record.pages = 0;
+  for (int p=0; p<pages; p++) {
+    if (p < SavedPages && imagepagecrc(p, length) == PageCRC[p]) continue;
+    if (record.pages == LOGPAGES) return -1;
+    record.page[record.pages++] = p;
+  }
+  uint32_t end = LogAddr + (record.pages + 1)*FLASHPAGE;
+  if (end > LOGEND) return -1;
+  for (uint32_t a=LogAddr; a<end; a=a+FLASHPAGE) if (a % FLASHSECTOR == 0) SerialFlashErase(a);
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t n=0; n<record.pages; n++) {
+    int p = record.page[n];
+    for (int i=0; i<FLASHPAGE; i++) {
+      FlashPage[i] = imagebyte(p*FLASHPAGE + i, length);
+      crc = crc32byte(crc, FlashPage[i]);
+    }
+    SerialFlashWrite(LogAddr + (n + 1)*FLASHPAGE, FlashPage, FLASHPAGE);
+    PageCRC[p] = imagepagecrc(p, length);
+  }
+  record.magic = LOGMAGIC; record.generation = Generation; record.imagesize = imagesize;
+  record.autorun = imageptr(arg); record.globalenv = imageptr(GlobalEnv);
+  record.gcstack = imageptr(GCStack); record.symboltop = SymbolTop - SymbolTable;
+  record.crc = 0;
+  for (unsigned int i=0; i<sizeof(logheader_t); i++) crc = crc32byte(crc, ((uint8_t *)&record)[i]);
+  record.crc = ~crc;
+  SerialFlashWrite(LogAddr, (uint8_t *)&record, sizeof(logheader_t));
+  SavedPages = pages; LogAddr = end; Checkpoints++;
+  return record.pages;
+}
 #endif
 
 int saveimage (object *arg) {
@@ -483,6 +1035,7 @@ int saveimage (object *arg) {
   for (int i=0; i<SYMBOLTABLESIZE; i++) file.write(SymbolTable[i]);
   #endif
   for (int i=0; i<CODESIZE; i++) file.write(MyCode[i]);
+  for (int i=0; i<RINGSIZE; i++) SDWriteInt(file, RingStore[i]);
   for (unsigned int i=0; i<imagesize; i++) {
     object *obj = &Workspace[i];
     SDWriteInt(file, (uintptr_t)car(obj));
@@ -495,7 +1048,7 @@ int saveimage (object *arg) {
   if (!(arg == NULL || listp(arg))) error(SAVEIMAGE, invalidarg, arg);
   if (!FlashSetup()) error2(SAVEIMAGE, PSTR("no DataFlash found."));
   // Save to DataFlash
-  int bytesneeded = 20 + SYMBOLTABLESIZE + CODESIZE + imagesize*8;
+  int bytesneeded = 20 + SYMBOLTABLESIZE + CODESIZE + RINGSIZE*4 + imagesize*8;
   if (bytesneeded > DATAFLASHSIZE) error(SAVEIMAGE, PSTR("image size too large"), number(imagesize));
   uint32_t addr = 0;
   FlashBeginWrite((bytesneeded+65535)/65536);
@@ -508,6 +1061,7 @@ int saveimage (object *arg) {
   for (int i=0; i<SYMBOLTABLESIZE; i++) FlashWriteByte(&addr, SymbolTable[i]);
   #endif
   for (int i=0; i<CODESIZE; i++) FlashWriteByte(&addr, MyCode[i]);
+  for (int i=0; i<RINGSIZE; i++) FlashWriteInt(&addr, RingStore[i]);
   for (unsigned int i=0; i<imagesize; i++) {
     object *obj = &Workspace[i];
     FlashWriteInt(&addr, (uintptr_t)car(obj));
@@ -515,6 +1069,34 @@ int saveimage (object *arg) {
   }
   FlashEndWrite();
   return imagesize;
+#elif defined(serialflash)
+  unsigned int imagesize = compactimage(&arg);
+  if (!(arg == NULL || listp(arg))) error(SAVEIMAGE, invalidarg, arg);
+  imageheader_t header, old;
+  header.version = IMAGEVERSION;
+  header.builtins = ENDFUNCTIONS;
+  header.length = imagelength(imagesize);
+  if (header.length > SERIALFLASHSIZE - FLASHPAGE) error(SAVEIMAGE, PSTR("image size too large"), number(imagesize));
+  header.imagesize = imagesize;
+  header.symboltablesize = SYMBOLTABLESIZE;
+  header.codesize = IMAGECODE;
+  header.ringsize = RINGSIZE*4;
+  header.autorun = imageptr(arg);
+  header.globalenv = imageptr(GlobalEnv);
+  header.gcstack = imageptr(GCStack);
+  header.symboltop = SymbolTop - SymbolTable;
+  header.romhash = ROMHASH;
+  // A fresh number when there is no image keeps stale log records from being replayed. It's kept
+  // below 2^31 so that checkpoint-stats returns it as a positive integer
+  header.generation = (FlashReadHeader(&old) ? old.generation + 1 : micros()) & 0x7FFFFFFF;
+  header.logoffset = LOGBASE - SERIALFLASHBASE;
+  FlashBeginWrite(header.length);
+  markchains(imagesize, true);
+  for (uint32_t i=0; i<header.length; i++) FlashWriteByte(imagebyte(i, header.length));
+  checkpointbase(imagesize, &header, LOGBASE, 0);
+  markchains(imagesize, false);
+  FlashEndWrite(&header);
+  return imagesize;
 #else
   (void) arg;
   error2(SAVEIMAGE, PSTR("not available"));
@@ -553,12 +1135,16 @@ int loadimage (object *arg) {
   for (int i=0; i<SYMBOLTABLESIZE; i++) SymbolTable[i] = file.read();
   #endif
   for (int i=0; i<CODESIZE; i++) MyCode[i] = file.read();
+  for (int i=0; i<RINGSIZE; i++) RingStore[i] = SDReadInt(file);
   for (int i=0; i<imagesize; i++) {
     object *obj = &Workspace[i];
     car(obj) = (object *)SDReadInt(file);
     cdr(obj) = (object *)SDReadInt(file);
   }
   file.close();
+  for (int i=0; i<ROOTS; i++) Roots[i] = NULL;
+  resettasks();
+  clearcases();
   gc(NULL, NULL);
   return imagesize;
 #elif defined(DATAFLASHSIZE)
@@ -574,14 +1160,50 @@ int loadimage (object *arg) {
   for (int i=0; i<SYMBOLTABLESIZE; i++) SymbolTable[i] = FlashReadByte();
   #endif
   for (int i=0; i<CODESIZE; i++) MyCode[i] = FlashReadByte();
+  for (int i=0; i<RINGSIZE; i++) RingStore[i] = FlashReadInt();
   for (int i=0; i<imagesize; i++) {
     object *obj = &Workspace[i];
     car(obj) = (object *)FlashReadInt();
     cdr(obj) = (object *)FlashReadInt();
   }
+  for (int i=0; i<ROOTS; i++) Roots[i] = NULL;
+  resettasks();
+  clearcases();
   gc(NULL, NULL);
   FlashEndRead();
   return imagesize;
+#elif defined(serialflash)
+  (void) arg;
+  imageheader_t header;
+  if (!FlashReadHeader(&header)) error2(LOADIMAGE, PSTR("no saved image"));
+  if (header.version != IMAGEVERSION) error2(LOADIMAGE, PSTR("image format not supported"));
+  if (header.builtins != ENDFUNCTIONS || header.romhash != ROMHASH) error2(LOADIMAGE, PSTR("image saved with different builtins or library"));
+  if (header.symboltablesize != SYMBOLTABLESIZE || header.codesize != IMAGECODE || header.ringsize != RINGSIZE*4)
+    error2(LOADIMAGE, PSTR("image symbol table, code or ring store size differs"));
+  if (!FlashCheckImage(&header)) error2(LOADIMAGE, PSTR("image checksum error"));
+  imageheader_t latest = header;
+  uint32_t logaddr;
+  replaylog(&latest, &logaddr, false);
+  if (header.imagesize > WORKSPACESIZE || latest.imagesize > WORKSPACESIZE) error2(LOADIMAGE, PSTR("image too large for workspace"));
+  SavedPages = 0;
+  FlashBeginRead();
+  for (uint32_t i=0; i<header.length; i++) setimagebyte(i, FlashReadByte());
+  uint32_t records = replaylog(&header, &logaddr, true);
+  unsigned int imagesize = header.imagesize;
+  for (unsigned int i=0; i<imagesize; i++) relocate(&Workspace[i]);
+  GlobalEnv = loadptr(header.globalenv);
+  GCStack = loadptr(header.gcstack);
+  SymbolTop = SymbolTable + header.symboltop;
+  markchains(imagesize, true);
+  checkpointbase(imagesize, &header, logaddr, records);
+  markchains(imagesize, false);
+  for (int i=0; i<ROOTS; i++) Roots[i] = NULL;
+  resettasks();
+  clearcases();
+  setflag(LIBRARYLOADED); // The image already holds the library definitions
+  gc(NULL, NULL);
+  stalehashtables(imagesize);
+  return imagesize;
 #else
   (void) arg;
   error2(LOADIMAGE, PSTR("not available"));
@@ -589,6 +1211,24 @@ int loadimage (object *arg) {
 #endif
 }
 
+// Saves only the pages changed since the last save or load, falling back to a full save
+int checkpoint (object *arg) {
+#if defined(serialflash)
+  unsigned int imagesize = compactimage(&arg);
+  if (!(arg == NULL || listp(arg))) error(CHECKPOINT, invalidarg, arg);
+  markchains(imagesize, true);
+  int pages = checkpointlog(imagesize, arg);
+  markchains(imagesize, false);
+  if (pages >= 0) return pages;
+  saveimage(arg);
+  return SavedPages + 1;
+#else
+  (void) arg;
+  error2(CHECKPOINT, PSTR("not available"));
+  return 0;
+#endif
+}
+
 void autorunimage () {
 #if defined(sdcardsupport)
   SD.begin(SDCARD_SS_PIN);
@@ -609,6 +1249,14 @@ void autorunimage () {
     loadimage(nil);
     apply(0, autorun, NULL, NULL);
   }
+#elif defined(serialflash)
+  imageheader_t header;
+  uint32_t logaddr;
+  if (!FlashReadHeader(&header)) return; // Normal boot
+  replaylog(&header, &logaddr, false);
+  if (header.autorun == 0) return;
+  loadimage(nil);
+  apply(0, loadptr(header.autorun), NULL, NULL);
 #else
   error2(0, PSTR("autorun not available"));
 #endif
@@ -717,6 +1365,12 @@ char *symbolname (symbol_t x) {
   return buffer;
 }
 
+// Symbols whose names start with a colon evaluate to themselves, like the builtin keywords
+bool keywordp (symbol_t name) {
+  char *s = (name >= MAXSYMBOL) ? lookupsymbol(name) : NULL;
+  return s != NULL && s[0] == ':';
+}
+
 int digitvalue (char d) {
   if (d>='0' && d<='9') return d-'0';
   d = d | 0x20;
@@ -738,10 +1392,114 @@ int checkbitvalue (symbol_t name, object *obj) {
 
 float checkintfloat (symbol_t name, object *obj){
   if (integerp(obj)) return obj->integer;
+  if (fixedp(obj)) error(name, fixedfloat, obj);
   if (!floatp(obj)) error(name, notanumber, obj);
   return obj->single_float;
 }
 
+// Fixed-point utilities
+
+// Fixed-point numbers are Q16.16 in the integer field. Results out of range saturate.
+// Integers mix with them freely, but floats only through an explicit float or fixed
+
+#define FIXEDONE 65536
+
+int32_t fixedsat (int64_t q) {
+  return (q > INT_MAX) ? INT_MAX : (q < INT_MIN) ? INT_MIN : q;
+}
+
+// Integer or fixed-point argument as Q16.16 without saturating, for comparisons and rounding
+int64_t fixedvalue (symbol_t name, object *obj) {
+  if (fixedp(obj)) return obj->integer;
+  if (integerp(obj)) return (int64_t)obj->integer * FIXEDONE;
+  if (floatp(obj)) error(name, fixedfloat, obj);
+  error(name, notanumber, obj);
+  return 0;
+}
+
+int32_t checkfixed (symbol_t name, object *obj) {
+  return fixedsat(fixedvalue(name, obj));
+}
+
+int32_t fixedmultiply (symbol_t name, int32_t q, object *arg) {
+  if (integerp(arg)) return fixedsat((int64_t)q * arg->integer);
+  return fixedsat(((int64_t)q * checkfixed(name, arg) + FIXEDONE/2) >> 16);
+}
+
+// Rounds to the nearest, moving the dividend away from zero by half the divisor before truncating
+int32_t fixeddivide (symbol_t name, int32_t q, object *arg) {
+  int64_t n = q, d;
+  if (integerp(arg)) d = arg->integer;
+  else { d = checkfixed(name, arg); n = n * FIXEDONE; }
+  if (d == 0) error2(name, PSTR("division by zero"));
+  int64_t half = ((d < 0) ? -d : d) / 2;
+  return fixedsat((n + ((n < 0) ? -half : half)) / d);
+}
+
+bool fixedargs (object *args) {
+  while (args != NULL) { if (fixedp(car(args))) return true; args = cdr(args); }
+  return false;
+}
+
+// Compares two numbers, at least one of them fixed-point, giving -1, 0, or 1
+int fixedcompare (symbol_t name, object *arg1, object *arg2) {
+  int64_t a = fixedvalue(name, arg1), b = fixedvalue(name, arg2);
+  return (a < b) ? -1 : (a > b) ? 1 : 0;
+}
+
+// The integer result of ceiling, floor, truncate, or round of a/b, where b defaults to 1
+object *fixedround (symbol_t name, object *args) {
+  int64_t a = fixedvalue(name, first(args));
+  int64_t b = (cdr(args) != NULL) ? fixedvalue(name, second(args)) : FIXEDONE;
+  if (b == 0) error2(name, PSTR("division by zero"));
+  int64_t q = a / b, r = a % b;
+  if (name == FLOOR && r != 0 && (r < 0) != (b < 0)) q--;
+  else if (name == CEILING && r != 0 && (r < 0) == (b < 0)) q++;
+  else if (name == ROUND && 2*(r < 0 ? -r : r) >= (b < 0 ? -b : b)) q = q + (((a < 0) == (b < 0)) ? 1 : -1);
+  return number(q);
+}
+
+// Reads the number after #q, such as -1.25
+object *readfixed (gfun_t gfun) {
+  int ch = gfun(), sign = 1, digits = 0;
+  int64_t whole = 0, frac = 0, scale = 1;
+  if (ch == '-' || ch == '+') { if (ch == '-') sign = -1; ch = gfun(); }
+  while (ch >= '0' && ch <= '9') {
+    whole = whole * 10 + ch - '0'; digits++;
+    if (whole > 32768) error2(0, PSTR("fixed-point number out of range"));
+    ch = gfun();
+  }
+  if (ch == '.') {
+    ch = gfun();
+    while (ch >= '0' && ch <= '9') {
+      if (scale < 1000000000) { frac = frac * 10 + ch - '0'; scale = scale * 10; }
+      digits++;
+      ch = gfun();
+    }
+  }
+  if (!(issp(ch) || ch == ')' || ch == '(' || ch == -1) || digits == 0) error2(0, PSTR("illegal fixed-point number"));
+  if (ch == ')' || ch == '(') LastChar = ch;
+  int64_t q = sign * ((whole<<16) + (frac * FIXEDONE + scale/2) / scale);
+  if (q > INT_MAX || q < INT_MIN) error2(0, PSTR("fixed-point number out of range"));
+  return makefixed(q);
+}
+
+// Prints the fewest decimals, up to five, that read back as the same number
+void pfixed (int32_t q, pfun_t pfun) {
+  if (tstflag(PRINTREADABLY)) { pfun('#'); pfun('q'); }
+  uint32_t u = q;
+  if (q < 0) { pfun('-'); u = -u; }
+  uint32_t whole = u>>16, frac = u & 0xFFFF, digits = 0, scale = 1;
+  do {
+    scale = scale * 10;
+    digits = ((uint64_t)frac * scale + FIXEDONE/2) >> 16;
+  } while (scale < 100000 && (((uint64_t)digits<<16) + scale/2) / scale != frac);
+  pint(whole, pfun);
+  pfun('.');
+  for (scale = scale/10; scale > 1 && digits % 10 == 0; scale = scale/10) digits = digits/10;
+  for (uint32_t d = scale; d > 0; d = d/10) pfun('0' + digits/d % 10);
+}
+
 int checkchar (symbol_t name, object *obj) {
   if (!characterp(obj)) error(name, PSTR("argument is not a character"), obj);
   return obj->chars;
@@ -769,10 +1527,30 @@ int eq (object *arg1, object *arg2) {
   if (symbolp(arg1) && symbolp(arg2)) return true;  // Same symbol
   if (integerp(arg1) && integerp(arg2)) return true;  // Same integer
   if (floatp(arg1) && floatp(arg2)) return true; // Same float
+  if (fixedp(arg1) && fixedp(arg2)) return true; // Same fixed-point number
   if (characterp(arg1) && characterp(arg2)) return true;  // Same character
   return false;
 }
 
+int equal (object *arg1, object *arg2) {
+  while (consp(arg1) && consp(arg2)) {
+    if (arg1 == arg2) return true;
+    if (!equal(car(arg1), car(arg2))) return false;
+    arg1 = cdr(arg1);
+    arg2 = cdr(arg2);
+  }
+  if (stringp(arg1) && stringp(arg2)) {
+    arg1 = cdr(arg1);
+    arg2 = cdr(arg2);
+    while (arg1 != NULL && arg2 != NULL && arg1->chars == arg2->chars) {
+      arg1 = car(arg1);
+      arg2 = car(arg2);
+    }
+    return arg1 == arg2;
+  }
+  return eq(arg1, arg2);
+}
+
 int listlength (symbol_t name, object *list) {
   int length = 0;
   while (list != NULL) {
@@ -974,126 +1752,1465 @@ void printarray (object *array, pfun_t pfun) {
   }
 }
 
-// String utilities
+// A cursor visits the elements of an array in order. Moving it only redescends the tree below the
+// highest bit of the index that changed, so a walk costs about one step per element, not log n
 
-void indent (uint8_t spaces, char ch, pfun_t pfun) {
-  for (uint8_t i=0; i<spaces; i++) pfun(ch);
+typedef struct {
+  object **path[33];
+  int levels, index;
+} cursor_t;
+
+void cursorset (cursor_t *c, int index) {
+  uint32_t changed = (c->index < 0) ? 0xFFFFFFFF : (uint32_t)(c->index ^ index);
+  if (changed == 0) return;
+  int level = c->levels - 32 + __builtin_clz(changed);
+  if (level < 0) level = 0;
+  for (; level < c->levels; level++) {
+    object *node = *c->path[level];
+    c->path[level+1] = (index>>(c->levels - 1 - level) & 1) ? &cdr(node) : &car(node);
+  }
+  c->index = index;
 }
 
-object *startstring (symbol_t name) {
-  object *string = myalloc();
-  string->type = STRING_;
-  GlobalString = NULL;
-  GlobalStringIndex = 0;
-  return string;
+void cursorinit (cursor_t *c, object *array, int size) {
+  c->levels = __builtin_ctz(nextpower2(size));
+  c->path[0] = &car(cdr(array));
+  c->index = -1;
+  if (size > 0) cursorset(c, 0);
 }
 
-void buildstring (char ch, int *chars, object **head) {
-  static object* tail;
-  static uint8_t shift;
-  if (*chars == 0) {
-    shift = (sizeof(int)-1)*8;
-    *chars = ch<<shift;
-    object *cell = myalloc();
-    if (*head == NULL) *head = cell; else tail->car = cell;
-    cell->car = NULL;
-    cell->chars = *chars;
-    tail = cell;
-  } else {
-    shift = shift - 8;
-    *chars = *chars | ch<<shift;
-    tail->chars = *chars;
-    if (shift == 0) *chars = 0;
+#define cursorelement(c) (*(c)->path[(c)->levels])
+
+// Number of elements in an array that isn't a bit array
+int arraysize (symbol_t name, object *array) {
+  if (!arrayp(array)) error(name, PSTR("argument is not an array"), array);
+  int size = 1;
+  for (object *dims = cddr(array); dims != NULL; dims = cdr(dims)) {
+    int d = car(dims)->integer;
+    if (d < 0) error(name, PSTR("not supported for a bit array"), array);
+    size = size * d;
   }
+  return size;
 }
 
-object *readstring (char delim, gfun_t gfun) {
-  object *obj = myalloc();
-  obj->type = STRING_;
-  int ch = gfun();
-  if (ch == -1) return nil;
-  object *head = NULL;
-  int chars = 0;
-  while ((ch != delim) && (ch != -1)) {
-    if (ch == '\\') ch = gfun();
-    buildstring(ch, &chars, &head);
-    ch = gfun();
+// Size of two arrays with the same dimensions
+int samearrays (symbol_t name, object *array1, object *array2) {
+  int size = arraysize(name, array1);
+  arraysize(name, array2);
+  object *dims1 = cddr(array1), *dims2 = cddr(array2);
+  while (dims1 != NULL && dims2 != NULL && car(dims1)->integer == car(dims2)->integer) {
+    dims1 = cdr(dims1); dims2 = cdr(dims2);
   }
-  obj->cdr = head;
-  return obj;
+  if (dims1 != NULL || dims2 != NULL) error(name, PSTR("array dimensions don't match"), array2);
+  return size;
 }
 
-int stringlength (object *form) {
-  int length = 0;
-  form = cdr(form);
-  while (form != NULL) {
-    int chars = form->chars;
-    for (int i=(sizeof(int)-1)*8; i>=0; i=i-8) {
-      if (chars>>i & 0xFF) length++;
-    }
-    form = car(form);
-  }
-  return length;
+// Sums of numbers and products kept in C, so only the result is boxed. Integers, floats, and
+// fixed-point numbers have separate totals; an integer total that overflows moves to the float one
+typedef struct {
+  int64_t i, q;
+  float f;
+  bool floats, fixeds;
+} total_t;
+
+void totalint (total_t *t, int64_t n) {
+  if (__builtin_add_overflow(t->i, n, &t->i)) { t->f = t->f + (float)t->i + (float)n; t->i = 0; t->floats = true; }
 }
 
-char nthchar (object *string, int n) {
-  object *arg = cdr(string);
-  int top;
-  if (sizeof(int) == 4) { top = n>>2; n = 3 - (n&3); }
-  else { top = n>>1; n = 1 - (n&1); }
-  for (int i=0; i<top; i++) {
-    if (arg == NULL) return 0;
-    arg = car(arg);
-  }
-  if (arg == NULL) return 0;
-  return (arg->chars)>>(n*8) & 0xFF;
+void totaladd (symbol_t name, total_t *t, object *arg) {
+  if (integerp(arg)) totalint(t, arg->integer);
+  else if (fixedp(arg)) { t->q = t->q + arg->integer; t->fixeds = true; }
+  else if (floatp(arg)) { t->f = t->f + arg->single_float; t->floats = true; }
+  else error(name, notanumber, arg);
 }
 
-int gstr () {
-  if (LastChar) {
-    char temp = LastChar;
-    LastChar = 0;
-    return temp;
-  }
-  char c = nthchar(GlobalString, GlobalStringIndex++);
-  if (c != 0) return c;
-  return '\n'; // -1?
+void totalmultiply (symbol_t name, total_t *t, object *arg1, object *arg2) {
+  if (integerp(arg1) && integerp(arg2)) totalint(t, (int64_t)arg1->integer * arg2->integer);
+  else if (fixedp(arg1)) { t->q = t->q + fixedmultiply(name, arg1->integer, arg2); t->fixeds = true; }
+  else if (fixedp(arg2)) { t->q = t->q + fixedmultiply(name, arg2->integer, arg1); t->fixeds = true; }
+  else { t->f = t->f + checkintfloat(name, arg1) * checkintfloat(name, arg2); t->floats = true; }
 }
 
-void pstr (char c) {
-  buildstring(c, &GlobalStringIndex, &GlobalString);
+object *totalresult (symbol_t name, total_t *t) {
+  if (t->floats && t->fixeds) error2(name, fixedfloat);
+  if (t->fixeds) return makefixed(fixedsat(t->q + (int64_t)fixedsat(t->i) * FIXEDONE));
+  if (t->floats) return makefloat(t->f + (float)t->i);
+  if (t->i < INT_MIN || t->i > INT_MAX) return makefloat((float)t->i);
+  return number(t->i);
 }
 
-// Lookup variable in environment
+// Generators
 
-object *value (symbol_t n, object *env) {
-  while (env != NULL) {
-    object *pair = car(env);
-    if (pair != NULL && car(pair)->name == n) return pair;
-    env = cdr(env);
-  }
-  return nil;
-}
+// A generator is a GENERATOR cell whose cdr is the list (kind function source count). kind is
+// make-generator for one that calls function with no arguments for each value, or gen-map, gen-filter,
+// or gen-take for one that pulls values from the generator source; count is a private cell holding the
+// values gen-take has left. nil ends a generator, and kind becomes nil so that it keeps returning nil
 
-bool boundp (object *var, object *env) {
-  symbol_t varname = var->name;
-  if (value(varname, env) != NULL) return true;
-  if (value(varname, GlobalEnv) != NULL) return true;
-  return false;
+enum genfield { GENKIND=1, GENFUNCTION, GENSOURCE, GENCOUNT };
+
+object *genfield (object *gen, int field) {
+  while (field-- > 0) gen = cdr(gen);
+  return car(gen);
 }
 
-object *findvalue (object *var, object *env) {
-  symbol_t varname = var->name;
-  object *pair = value(varname, env);
-  if (pair == NULL) pair = value(varname, GlobalEnv);
-  if (pair == NULL) error(0, PSTR("unknown variable"), var);
-  return pair;
+object *makegenerator (symbol_t kind, object *function, object *source, object *count) {
+  object *fields = cons(symbol(kind), cons(function, cons(source, cons(count, NULL))));
+  object *gen = myalloc();
+  gen->type = GENERATOR;
+  cdr(gen) = fields;
+  return gen;
 }
 
-// Handling closures
+object *checkgenerator (symbol_t name, object *gen) {
+  if (!generatorp(gen)) error(name, PSTR("argument is not a generator"), gen);
+  return gen;
+}
 
-object *closure (int tc, symbol_t name, object *state, object *function, object *args, object **env) {
-  int trace = 0;
+object *gennext (symbol_t name, object *gen, object *env) {
+  object *kind = genfield(gen, GENKIND), *value;
+  if (kind == NULL) return nil;
+  object *function = genfield(gen, GENFUNCTION), *source = genfield(gen, GENSOURCE);
+  if (kind->name == MAKEGENERATOR) value = apply(name, function, NULL, env);
+  else if (kind->name == GENTAKE) {
+    object *count = genfield(gen, GENCOUNT);
+    value = nil;
+    if (count->integer > 0) { count->integer--; value = gennext(name, source, env); }
+  } else {
+    while (true) {
+      value = gennext(name, source, env);
+      if (value == nil) break;
+      if (kind->name == GENMAP) { value = apply(name, function, cons(value, NULL), env); break; }
+      if (apply(name, function, cons(value, NULL), env) != nil) break;
+    }
+  }
+  if (value == nil) car(cdr(gen)) = nil;
+  return value;
+}
+
+// A sequence is a list, a one-dimensional array, or a generator, walked in order by seqnext
+
+typedef struct {
+  object *list, *env;
+  cursor_t cursor;
+  int index, size; // size is -1 for a list, and -2 for a generator
+} seq_t;
+
+void seqinit (symbol_t name, seq_t *s, object *seq, object *env) {
+  s->list = seq; s->env = env; s->size = -1;
+  if (generatorp(seq)) { s->size = -2; return; }
+  if (listp(seq)) return;
+  if (!arrayp(seq) || cdr(cddr(seq)) != NULL) error(name, PSTR("argument is not a list or vector"), seq);
+  s->size = arraysize(name, seq); s->index = 0;
+  cursorinit(&s->cursor, seq, s->size);
+}
+
+bool seqnext (symbol_t name, seq_t *s, object **item) {
+  if (s->size == -2) {
+    *item = gennext(name, s->list, s->env);
+    return *item != nil;
+  }
+  if (s->size < 0) {
+    if (s->list == NULL) return false;
+    if (improperp(s->list)) error(name, notproper, s->list);
+    *item = car(s->list);
+    s->list = cdr(s->list);
+    return true;
+  }
+  if (s->index >= s->size) return false;
+  cursorset(&s->cursor, s->index++);
+  *item = cursorelement(&s->cursor);
+  return true;
+}
+
+// Ring buffer utilities
+
+// Elements are stored as 32-bit words: integers, Q16.16 fixed-point values, or float bits. The sums are
+// kept as each element is added or removed, exactly in 64 bits for integers and fixed-point numbers and
+// as doubles for floats; a float ring adds up its elements again each time the slots wrap around, so
+// rounding errors don't build up. The max and min deques hold the slots of the elements that are still
+// candidates, with the values decreasing and increasing respectively from the front
+
+object *checkring (symbol_t name, object *ring) {
+  if (!ringp(ring)) error(name, PSTR("argument is not a ring"), ring);
+  return ring;
+}
+
+inline uint32_t ringindex (ring_t *r, uint32_t i) {
+  return (i >= r->capacity) ? i - r->capacity : i;
+}
+
+uint32_t ringword (symbol_t name, ring_t *r, object *obj) {
+  if (r->kind == RINGINTEGER) return checkinteger(name, obj);
+  if (r->kind == RINGFIXED) return checkfixed(name, obj);
+  float f = checkintfloat(name, obj);
+  uint32_t w;
+  memcpy(&w, &f, 4);
+  return w;
+}
+
+float ringfloat (uint32_t w) {
+  float f;
+  memcpy(&f, &w, 4);
+  return f;
+}
+
+object *ringobject (ring_t *r, uint32_t w) {
+  if (r->kind == RINGINTEGER) return number(w);
+  if (r->kind == RINGFIXED) return makefixed(w);
+  return makefloat(ringfloat(w));
+}
+
+bool ringless (ring_t *r, uint32_t a, uint32_t b) {
+  if (r->kind == RINGFLOAT) return ringfloat(a) < ringfloat(b);
+  return (int32_t)a < (int32_t)b;
+}
+
+// Adds an element to the sums, or with sign -1 removes it
+void ringtotal (ring_t *r, uint32_t w, int sign) {
+  if (r->kind == RINGFLOAT) {
+    double x = ringfloat(w);
+    r->sum.f = r->sum.f + sign*x;
+    r->sumsq.f = r->sumsq.f + sign*x*x;
+    return;
+  }
+  int64_t x = (int32_t)w;
+  r->sum.i = r->sum.i + sign*x;
+  if (__builtin_add_overflow(r->sumsq.i, sign*x*x, &r->sumsq.i)) r->flags |= RINGINEXACT;
+}
+
+void ringresum (ring_t *r) {
+  uint32_t *data = ringdata(r);
+  r->sum.i = 0; r->sumsq.i = 0; r->flags = 0; // Also 0.0 as doubles
+  for (uint32_t i=0; i<r->count; i++) ringtotal(r, data[ringindex(r, r->first + i)], 1);
+}
+
+// Drops the elements at the back of a deque that the element in slot can never be outlasted by
+void ringdeque (ring_t *r, deque_t *d, uint32_t *slots, uint32_t slot, bool max) {
+  uint32_t *data = ringdata(r), w = data[slot];
+  while (d->count > 0) {
+    uint32_t back = data[slots[ringindex(r, d->first + d->count - 1)]];
+    if (max ? ringless(r, w, back) : ringless(r, back, w)) break;
+    d->count--;
+  }
+  slots[ringindex(r, d->first + d->count)] = slot;
+  d->count++;
+}
+
+// Removes and returns the oldest element; the ring mustn't be empty
+uint32_t ringpop (ring_t *r) {
+  uint32_t *data = ringdata(r), *maxslots = data + r->capacity, *minslots = maxslots + r->capacity;
+  uint32_t slot = r->first, w = data[slot];
+  if (r->max.count > 0 && maxslots[r->max.first] == slot) { r->max.first = ringindex(r, r->max.first + 1); r->max.count--; }
+  if (r->min.count > 0 && minslots[r->min.first] == slot) { r->min.first = ringindex(r, r->min.first + 1); r->min.count--; }
+  r->first = ringindex(r, slot + 1);
+  r->count--;
+  if (r->count == 0) ringresum(r); else ringtotal(r, w, -1);
+  return w;
+}
+
+// Adds an element after the newest; the ring mustn't be full
+void ringpush (ring_t *r, uint32_t w) {
+  uint32_t *data = ringdata(r), *maxslots = data + r->capacity, *minslots = maxslots + r->capacity;
+  uint32_t slot = ringindex(r, r->first + r->count);
+  data[slot] = w;
+  r->count++;
+  ringdeque(r, &r->max, maxslots, slot, true);
+  ringdeque(r, &r->min, minslots, slot, false);
+  if (slot == r->capacity - 1 && (r->kind == RINGFLOAT || (r->flags & RINGINEXACT))) ringresum(r);
+  else ringtotal(r, w, 1);
+}
+
+// Population variance, as a double in the units of the elements squared
+double ringvariance (ring_t *r) {
+  double n = r->count;
+  if (r->kind == RINGFLOAT) return (r->sumsq.f - r->sum.f*r->sum.f/n)/n;
+  if (!(r->flags & RINGINEXACT)) return ((double)r->sumsq.i - (double)r->sum.i*(double)r->sum.i/n)/n;
+  uint32_t *data = ringdata(r);
+  double mean = r->sum.i/n, total = 0;
+  for (uint32_t i=0; i<r->count; i++) {
+    double d = (int32_t)data[ringindex(r, r->first + i)] - mean;
+    total = total + d*d;
+  }
+  return total/n;
+}
+
+object *makering (symbol_t name, int capacity, int kind, object *args, object *env) {
+  if (capacity < 1) error(name, invalidarg, number(capacity));
+  uint32_t words = ringwords(capacity);
+  if (RingTop + words > RINGSIZE) { gc(args, env); compactrings(); }
+  if (RingTop + words > RINGSIZE) error(name, PSTR("no room for ring of size"), number(capacity));
+  object *ring = myalloc();
+  ring->type = RING;
+  ring->integer = RingTop;
+  ring_t *r = ringblock(ring);
+  memset(r, 0, words*4);
+  r->owner = ring - Workspace;
+  r->capacity = capacity;
+  r->kind = kind;
+  RingTop = RingTop + words;
+  return ring;
+}
+
+// Hash table utilities
+
+#define HASHSIZE 8 // Smallest number of slots
+#define HASHDEPTH 4 // Levels of a list key used by the equal hash
+
+// The slots array holds (key . value) pairs, nil for a slot never used, or a symbol for a removed pair.
+// count, used (pairs plus removed slots) and flags are number cells private to the table, updated in place
+
+object *hashfield (object *table, int field) {
+  object *list = cdr(table);
+  while (field-- > 0) list = cdr(list);
+  return car(list);
+}
+
+int hashcapacity (object *slots) {
+  return first(cddr(slots))->integer;
+}
+
+uint32_t hashmix (uint32_t h) {
+  h = (h ^ h>>16) * 0x45D9F3B;
+  return h ^ h>>16;
+}
+
+// Hash code consistent with equal that never depends on addresses, so it is the same after cells move.
+// Arrays, hash tables and structures are only equal when eq, so they hash by type and dimensions
+uint32_t sxhash (object *key, int depth) {
+  if (key == NULL) return 0;
+  unsigned int type = key->type;
+  if (type != ZZERO && type < ARRAY) return hashmix((uintptr_t)cdr(key) + type);
+  if (type == STRING_) {
+    uint32_t h = STRING_;
+    for (object *chain = cdr(key); chain != NULL; chain = car(chain)) h = hashmix(h ^ chain->chars);
+    return h;
+  }
+  if (type == ARRAY) return hashmix(ARRAY ^ sxhash(cddr(key), 1));
+  if (type == HASHTABLE || type == STRUCT || type == GENERATOR) return hashmix(type);
+  uint32_t h = PAIR;
+  if (depth == 0) return h;
+  for (int n=0; consp(key) && n<HASHDEPTH*2; n++) {
+    h = hashmix(h ^ sxhash(car(key), depth-1));
+    key = cdr(key);
+  }
+  return consp(key) ? h : hashmix(h ^ sxhash(key, depth-1));
+}
+
+// Hash code consistent with eq; conses, strings and arrays hash by address
+uint32_t eqhash (object *key) {
+  if (key == NULL || (key->type != ZZERO && key->type < ARRAY)) return sxhash(key, 0);
+  return hashmix((uintptr_t)key);
+}
+
+// The test of a table is eq, equal, or memoize for the argument lists of a memoized function,
+// which match when their arguments are eq
+uint32_t hashcode (object *key, symbol_t test) {
+  if (test == EQUAL) return sxhash(key, HASHDEPTH);
+  if (test != MEMOIZE) return eqhash(key);
+  uint32_t h = PAIR;
+  for (; key != NULL; key = cdr(key)) h = hashmix(h ^ eqhash(car(key)));
+  return h;
+}
+
+bool hashmatch (object *key1, object *key2, symbol_t test) {
+  if (test == EQUAL) return equal(key1, key2);
+  if (test != MEMOIZE) return eq(key1, key2);
+  while (key1 != NULL && key2 != NULL) {
+    if (!eq(car(key1), car(key2))) return false;
+    key1 = cdr(key1);
+    key2 = cdr(key2);
+  }
+  return key1 == key2;
+}
+
+object *makehashtable (int size, object *test) {
+  int capacity = HASHSIZE;
+  while (capacity < size*2) capacity = capacity<<1;
+  object *slots = makearray(MAKEHASHTABLE, cons(number(capacity), NULL), nil, false);
+  object *table = myalloc();
+  table->type = HASHTABLE;
+  cdr(table) = cons(slots, cons(test, cons(number(0), cons(number(0), cons(number(0), NULL)))));
+  return table;
+}
+
+// Moves the pairs to a new slots array with room for size pairs, dropping the removed slots
+void rehash (object *table, int size) {
+  object *old = hashfield(table, HASHSLOTS);
+  int oldcapacity = hashcapacity(old), capacity = HASHSIZE;
+  while (capacity < size*2) capacity = capacity<<1;
+  object *slots = makearray(MAKEHASHTABLE, cons(number(capacity), NULL), nil, false);
+  symbol_t test = hashfield(table, HASHTEST)->name;
+  for (int i=0; i<oldcapacity; i++) {
+    object *pair = *arrayref(old, i, oldcapacity);
+    if (!consp(pair)) continue;
+    int j = hashcode(car(pair), test) & (capacity-1);
+    while (*arrayref(slots, j, capacity) != NULL) j = (j+1) & (capacity-1);
+    *arrayref(slots, j, capacity) = pair;
+  }
+  car(cdr(table)) = slots;
+  hashfield(table, HASHUSED)->integer = hashfield(table, HASHCOUNT)->integer;
+  hashfield(table, HASHFLAGS)->integer &= ~HASHSTALE;
+}
+
+void stalehashtables (unsigned int n) {
+  for (unsigned int i=0; i<n; i++) {
+    object *table = &Workspace[i];
+    if (car(table) == (object *)HASHTABLE && !issymbol(hashfield(table, HASHTEST), EQUAL))
+      hashfield(table, HASHFLAGS)->integer |= HASHSTALE;
+  }
+}
+
+object *checkhashtable (symbol_t name, object *table) {
+  if (!hashtablep(table)) error(name, PSTR("argument is not a hash table"), table);
+  if (hashfield(table, HASHFLAGS)->integer & HASHSTALE) rehash(table, hashfield(table, HASHCOUNT)->integer);
+  return table;
+}
+
+// Returns the slot holding the pair for key, or else the slot where it would be added, and sets found
+object **hashslot (object *table, object *key, bool *found) {
+  object *slots = hashfield(table, HASHSLOTS);
+  int capacity = hashcapacity(slots);
+  symbol_t test = hashfield(table, HASHTEST)->name;
+  int i = hashcode(key, test) & (capacity-1);
+  object **removed = NULL;
+  while (true) {
+    object **p = arrayref(slots, i, capacity);
+    object *pair = *p;
+    if (pair == NULL) { *found = false; return (removed != NULL) ? removed : p; }
+    if (!consp(pair)) { if (removed == NULL) removed = p; }
+    else if (hashmatch(key, car(pair), test)) { *found = true; return p; }
+    i = (i+1) & (capacity-1);
+  }
+}
+
+object *gethash (object *key, object *table, object *def) {
+  bool found;
+  object **p = hashslot(table, key, &found);
+  return found ? cdr(*p) : def;
+}
+
+// Returns the place holding the value for key, adding key with the value def if it is missing
+object **hashplace (object *key, object *table, object *def) {
+  bool found;
+  object **p = hashslot(table, key, &found);
+  if (found) return &cdr(*p);
+  object *used = hashfield(table, HASHUSED), *count = hashfield(table, HASHCOUNT);
+  if (*p == NULL) {
+    int capacity = hashcapacity(hashfield(table, HASHSLOTS));
+    if ((used->integer + 1)*4 > capacity*3) {
+      rehash(table, count->integer + 1);
+      p = hashslot(table, key, &found);
+    }
+    used->integer++;
+  }
+  *p = cons(key, def);
+  count->integer++;
+  return &cdr(*p);
+}
+
+bool remhash (object *key, object *table) {
+  bool found;
+  object **p = hashslot(table, key, &found);
+  if (!found) return false;
+  *p = symbol(NOTHING);
+  hashfield(table, HASHCOUNT)->integer--;
+  return true;
+}
+
+// Empties a table in place, without allocating, so it can be used during garbage collection
+void clrhash (object *table) {
+  object *slots = hashfield(table, HASHSLOTS);
+  int capacity = hashcapacity(slots);
+  for (int i=0; i<capacity; i++) *arrayref(slots, i, capacity) = NULL;
+  hashfield(table, HASHCOUNT)->integer = 0;
+  hashfield(table, HASHUSED)->integer = 0;
+}
+
+// Reads the :size and :test options of make-hash-table and memoize
+void hashoptions (symbol_t name, object *args, int *size, object **test) {
+  while (args != NULL) {
+    object *var = first(args);
+    if (cdr(args) == NULL) error(name, PSTR("keyword has no value"), var);
+    if (issymbol(var, TEST)) {
+      *test = second(args);
+      if (!(issymbol(*test, EQ) || issymbol(*test, EQUAL))) error(name, PSTR("test must be eq or equal"), *test);
+    } else if (issymbol(var, SIZE)) {
+      *size = checkinteger(name, second(args));
+      if (*size < 0) error(name, PSTR("size can't be negative"), second(args));
+    } else error(name, PSTR("argument not recognised"), var);
+    args = cddr(args);
+  }
+}
+
+// Memoized functions
+
+#define MEMOSIZE 16 // Default number of results kept
+
+// A memoized function is the list (memoize function table size hits misses evictions clock), where
+// the numbers are private cells updated in place. The table maps a copy of each argument list to
+// (stamp . result), and the result with the oldest stamp is evicted when the table is full
+
+object *memofield (object *memo, int field) {
+  while (field-- > 0) memo = cdr(memo);
+  return car(memo);
+}
+
+enum memofields { MEMOFUNCTION=1, MEMOTABLE, MEMOSIZE_, MEMOHITS, MEMOMISSES, MEMOEVICTIONS, MEMOCLOCK };
+
+// Checks the whole list, so that a quoted list such as '(memoize) isn't called as one
+bool memop (object *obj) {
+  if (!consp(obj) || !issymbol(car(obj), MEMOIZE)) return false;
+  for (int field=MEMOFUNCTION; field<=MEMOCLOCK; field++) {
+    obj = cdr(obj);
+    if (!consp(obj)) return false;
+    if (field == MEMOTABLE && !hashtablep(car(obj))) return false;
+    if (field >= MEMOSIZE_ && !integerp(car(obj))) return false;
+  }
+  return cdr(obj) == NULL;
+}
+
+object *makememo (object *function, int size, object *test) {
+  object *table = makehashtable(size, issymbol(test, EQUAL) ? test : symbol(MEMOIZE));
+  hashfield(table, HASHFLAGS)->integer = HASHWEAK;
+  object *stats = NULL;
+  for (int i=0; i<4; i++) push(number(0), stats);
+  return cons(symbol(MEMOIZE), cons(function, cons(table, cons(number(size), stats))));
+}
+
+void memoevict (object *memo, object *table) {
+  object *slots = hashfield(table, HASHSLOTS);
+  int capacity = hashcapacity(slots);
+  object **oldest = NULL;
+  for (int i=0; i<capacity; i++) {
+    object **p = arrayref(slots, i, capacity);
+    if (consp(*p) && (oldest == NULL || car(cdr(*p))->integer < car(cdr(*oldest))->integer)) oldest = p;
+  }
+  if (oldest == NULL) return;
+  *oldest = symbol(NOTHING);
+  hashfield(table, HASHCOUNT)->integer--;
+  memofield(memo, MEMOEVICTIONS)->integer++;
+}
+
+object *memocall (symbol_t name, object *memo, object *args, object *env) {
+  object *table = checkhashtable(name, memofield(memo, MEMOTABLE));
+  object *clock = memofield(memo, MEMOCLOCK);
+  clock->integer++;
+  bool found;
+  object **p = hashslot(table, args, &found);
+  if (found) {
+    memofield(memo, MEMOHITS)->integer++;
+    car(cdr(*p))->integer = clock->integer;
+    return cdr(cdr(*p));
+  }
+  memofield(memo, MEMOMISSES)->integer++;
+  object *result = apply(name, memofield(memo, MEMOFUNCTION), args, env);
+  // The call may have changed the table, and the argument list may be reused by the caller
+  object *key = NULL, *tail = NULL;
+  for (; args != NULL; args = cdr(args)) {
+    object *cell = cons(car(args), NULL);
+    if (key == NULL) key = cell; else cdr(tail) = cell;
+    tail = cell;
+  }
+  int size = memofield(memo, MEMOSIZE_)->integer;
+  if (size == 0) return result;
+  if (hashfield(table, HASHCOUNT)->integer >= size) memoevict(memo, table);
+  *hashplace(key, table, nil) = cons(number(clock->integer), result);
+  return result;
+}
+
+// Under memory pressure the garbage collector empties weak tables, which hold memoized results,
+// and drops the case tables, which keep their forms; returns true if any had entries
+bool flushweak () {
+  bool flushed = CaseCount > 0;
+  clearcases();
+  for (int i=0; i<WORKSPACESIZE; i++) {
+    object *table = &Workspace[i];
+    if (car(table) != (object *)HASHTABLE || !(hashfield(table, HASHFLAGS)->integer & HASHWEAK)) continue;
+    if (hashfield(table, HASHCOUNT)->integer == 0) continue;
+    clrhash(table);
+    flushed = true;
+  }
+  return flushed;
+}
+
+// Case table utilities
+
+bool casekey (object *key, int *types) {
+  int type = integerp(key) ? NUMBER : characterp(key) ? CHARACTER : 0;
+  if (type == 0 || (*types != 0 && type != *types)) return false;
+  *types = type;
+  return true;
+}
+
+// Returns the number of keys in the clauses before the t clause, or -1 unless they are all integers or all characters
+int casecount (object *clauses, bool otherwise, int *types) {
+  int n = 0;
+  for (; clauses != NULL; clauses = cdr(clauses)) {
+    object *clause = car(clauses);
+    if (!consp(clause)) return -1;
+    object *key = car(clause);
+    if (otherwise && issymbol(key, TEE)) break;
+    if (!consp(key)) {
+      if (!casekey(key, types)) return -1;
+      n++;
+    } else for (; key != NULL; key = cdr(key)) {
+      if (!consp(key) || !casekey(car(key), types)) return -1;
+      n++;
+    }
+  }
+  return n;
+}
+
+// Adds a key to the sorted keys, unless an earlier clause has it; returns the new number of keys
+int caseinsert (casekey_t *keys, int size, int32_t key, object *clause) {
+  int i = size;
+  while (i > 0 && keys[i-1].key > key) i--;
+  if (i > 0 && keys[i-1].key == key) return size;
+  memmove(&keys[i+1], &keys[i], (size-i)*sizeof(casekey_t));
+  keys[i].key = key; keys[i].clause = clause;
+  return size + 1;
+}
+
+// Returns the table for the case form args, making it if it's new
+casetable_t *casetable (object *args, bool otherwise) {
+  for (int i=0; i<CaseCount; i++) if (CaseTables[i].args == args) return &CaseTables[i];
+  int types = 0;
+  int n = casecount(cdr(args), otherwise, &types);
+  if (CaseCount == CASETABLES) {
+    // Drop the forms without a table first
+    int kept = 0;
+    for (int i=0; i<CaseCount; i++) if (CaseTables[i].kind != CASELINEAR) CaseTables[kept++] = CaseTables[i];
+    CaseCount = kept;
+  }
+  if (CaseCount == CASETABLES || (n >= CASEMIN && n <= CASEKEYS && CaseTop + n > CASEKEYS)) clearcases();
+  casetable_t *table = &CaseTables[CaseCount++];
+  table->args = args; table->otherwise = NULL; table->kind = CASELINEAR;
+  table->start = CaseTop; table->size = 0; table->min = 0; table->chars = (types == CHARACTER);
+  if (n < CASEMIN || n > CASEKEYS) return table;
+  casekey_t *keys = &CaseKeys[CaseTop];
+  int size = 0;
+  for (object *clauses = cdr(args); clauses != NULL; clauses = cdr(clauses)) {
+    object *clause = car(clauses), *key = car(clause);
+    if (otherwise && issymbol(key, TEE)) { table->otherwise = clause; break; }
+    if (!consp(key)) size = caseinsert(keys, size, key->integer, clause);
+    else for (; key != NULL; key = cdr(key)) size = caseinsert(keys, size, car(key)->integer, clause);
+  }
+  table->min = keys[0].key;
+  int64_t span = (int64_t)keys[size-1].key - keys[0].key + 1;
+  if (span <= 2*size && CaseTop + span <= CASEKEYS) {
+    // Spread the keys out from the top down, so none is overwritten before it's moved
+    int next = span;
+    for (int i=size-1; i>=0; i--) {
+      casekey_t entry = keys[i];
+      int slot = entry.key - table->min;
+      for (int j=slot+1; j<next; j++) keys[j].clause = NULL;
+      keys[slot] = entry;
+      next = slot;
+    }
+    table->kind = CASEDENSE; table->size = span;
+  } else {
+    table->kind = CASESORTED; table->size = size;
+  }
+  CaseTop = CaseTop + table->size;
+  return table;
+}
+
+// Returns the clause for test, or the t clause, or NULL
+object *caseclause (casetable_t *table, object *test) {
+  if (table->chars ? !characterp(test) : !integerp(test)) return table->otherwise;
+  int32_t key = test->integer;
+  casekey_t *keys = &CaseKeys[table->start];
+  if (table->kind == CASEDENSE) {
+    uint32_t slot = (uint32_t)key - (uint32_t)table->min;
+    if (slot < table->size && keys[slot].clause != NULL) return keys[slot].clause;
+    return table->otherwise;
+  }
+  int lo = 0, hi = table->size - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (keys[mid].key < key) lo = mid + 1;
+    else if (keys[mid].key > key) hi = mid - 1;
+    else return keys[mid].clause;
+  }
+  return table->otherwise;
+}
+
+// Structures
+
+// defstruct binds the constructor, the predicate and the accessors to lists (defstruct index name slot...),
+// where index is -1 for the constructor, -2 for the predicate, or the number of the slot an accessor reads,
+// and (name slot...) is the rest of the defstruct form, which identifies the structure type. An instance
+// is a STRUCT cell whose cdr is the list (type value...), so an accessor is a few cdrs, like nth
+
+enum structindex { STRUCTMAKE=-1, STRUCTP=-2 };
+
+// Checks the whole list, so that a quoted list such as '(defstruct) isn't called as one
+bool structfunctionp (object *function) {
+  if (!consp(function) || !issymbol(car(function), DEFSTRUCT)) return false;
+  function = cdr(function);
+  if (!consp(function) || !integerp(car(function)) || !consp(cdr(function)) || !symbolp(second(function))) return false;
+  int index = car(function)->integer, slots = 0;
+  for (object *list = cddr(function); list != NULL; list = cdr(list)) {
+    if (!consp(list)) return false;
+    object *slot = car(list);
+    if (consp(slot) && consp(cdr(slot))) slot = car(slot);
+    if (!symbolp(slot)) return false;
+    slots++;
+  }
+  return index == STRUCTMAKE || index == STRUCTP || (index >= 0 && index < slots);
+}
+
+object **structslot (symbol_t name, object *function, object *obj) {
+  if (!structp(obj) || car(cdr(obj)) != cddr(function)) error(name, PSTR("argument is not a structure of this type"), obj);
+  object *values = cddr(obj);
+  for (int i=second(function)->integer; i>0; i--) values = cdr(values);
+  return &car(values);
+}
+
+// The slot in the slot list of type that a keyword such as :x names, or NULL
+object *keywordslot (object *keyword, object *type) {
+  if (!symbolp(keyword)) return NULL;
+  char buffer[BUFFERSIZE];
+  char *s = symbolname(keyword->name);
+  if (s[0] != ':' || strlen(s) >= BUFFERSIZE) return NULL;
+  strcpy(buffer, s+1);
+  for (object *slots = cdr(type); slots != NULL; slots = cdr(slots)) {
+    object *slot = consp(car(slots)) ? car(car(slots)) : car(slots);
+    if (strcmp(buffer, symbolname(slot->name)) == 0) return slots;
+  }
+  return NULL;
+}
+
+// Arguments fill the slots in order, or if the first is a keyword naming a slot, they are :slot value
+// pairs. The default forms of the other slots are evaluated in env, the caller's environment, which a
+// collection during the evaluation has to keep
+object *structcall (symbol_t name, object *function, object *args, object *env) {
+  int index = second(function)->integer;
+  object *type = cddr(function);
+  if (index == STRUCTMAKE) {
+    bool keywords = args != NULL && keywordslot(first(args), type) != NULL;
+    for (object *pairs = args; keywords && pairs != NULL; pairs = cddr(pairs)) {
+      if (keywordslot(first(pairs), type) == NULL) error(name, PSTR("argument not recognised"), first(pairs));
+      if (cdr(pairs) == NULL) error(name, PSTR("keyword has no value"), first(pairs));
+    }
+    object *values = NULL;
+    for (object *slots = cdr(type); slots != NULL; slots = cdr(slots)) push(nil, values);
+    object *obj = myalloc();
+    obj->type = STRUCT;
+    cdr(obj) = cons(type, values);
+    push(obj, GCStack);
+    for (object *slots = cdr(type); slots != NULL; slots = cdr(slots)) {
+      object *pairs = args;
+      if (keywords) while (pairs != NULL && keywordslot(first(pairs), type) != slots) pairs = cddr(pairs);
+      if (pairs != NULL) {
+        car(values) = keywords ? second(pairs) : first(pairs);
+        if (!keywords) args = cdr(args);
+      }
+      else if (consp(car(slots))) car(values) = eval(second(car(slots)), env);
+      values = cdr(values);
+    }
+    pop(GCStack);
+    if (args != NULL && !keywords) error2(name, toomanyargs);
+    return obj;
+  }
+  if (args == NULL) error2(name, toofewargs);
+  if (cdr(args) != NULL) error2(name, toomanyargs);
+  if (index == STRUCTP) return (structp(first(args)) && car(cdr(first(args))) == type) ? tee : nil;
+  return *structslot(name, function, first(args));
+}
+
+void appendname (char *buffer, const char *s) {
+  if (strlen(buffer) + strlen(s) >= BUFFERSIZE) error2(DEFSTRUCT, PSTR("name too long"));
+  strcat(buffer, s);
+}
+
+// The symbol named prefix, the name of a, then infix and the name of b if b isn't nil
+object *structsymbol (PGM_P prefix, object *a, PGM_P infix, object *b) {
+  char buffer[BUFFERSIZE];
+  buffer[0] = '\0';
+  appendname(buffer, prefix);
+  appendname(buffer, symbolname(a->name));
+  appendname(buffer, infix);
+  if (b != nil) appendname(buffer, symbolname(b->name));
+  if ((int)strlen(buffer) >= maxbuffer(SymbolTop)) error2(DEFSTRUCT, PSTR("symbol table full"));
+  strcpy(SymbolTop, buffer);
+  object *symbol = internsymbol(SymbolTop);
+  if (symbol == nil || symbol->name < ENDFUNCTIONS) error(DEFSTRUCT, PSTR("name is a builtin"), symbol);
+  return symbol;
+}
+
+void printstruct (object *obj, pfun_t pfun) {
+  object *type = car(cdr(obj)), *values = cddr(obj);
+  pfstring(PSTR("#S("), pfun);
+  printobject(car(type), pfun);
+  for (object *slots = cdr(type); slots != NULL; slots = cdr(slots)) {
+    object *slot = car(slots);
+    pfun(' '); pfun(':'); printobject(consp(slot) ? car(slot) : slot, pfun);
+    pfun(' '); printobject(car(values), pfun);
+    values = cdr(values);
+  }
+  pfun(')');
+}
+
+// Reads #S(name :slot value...) by calling the constructor of the structure type name, as defined
+// most recently, with the :slot value pairs; the value forms are not evaluated
+object *readstruct (object *form) {
+  if (!consp(form) || !symbolp(car(form))) error(0, PSTR("illegal #S form"), form);
+  for (object *globals = GlobalEnv; globals != NULL; globals = cdr(globals)) {
+    object *pair = car(globals), *function = cdr(pair);
+    if (!structfunctionp(function) || second(function)->integer != STRUCTMAKE) continue;
+    if (car(cddr(function))->name != car(form)->name) continue;
+    object *args = cdr(form);
+    if (args != NULL && keywordslot(first(args), cddr(function)) == NULL) error(car(pair)->name, PSTR("argument not recognised"), first(args));
+    push(form, GCStack);
+    object *obj = structcall(car(pair)->name, function, args, NULL);
+    pop(GCStack);
+    return obj;
+  }
+  error(0, PSTR("no structure named"), car(form));
+  return nil;
+}
+
+// String utilities
+
+void indent (uint8_t spaces, char ch, pfun_t pfun) {
+  for (uint8_t i=0; i<spaces; i++) pfun(ch);
+}
+
+object *startstring (symbol_t name) {
+  object *string = myalloc();
+  string->type = STRING_;
+  GlobalString = NULL;
+  GlobalStringIndex = 0;
+  return string;
+}
+
+void buildstring (char ch, int *chars, object **head) {
+  static object* tail;
+  static uint8_t shift;
+  if (*chars == 0) {
+    shift = (sizeof(int)-1)*8;
+    *chars = ch<<shift;
+    object *cell = myalloc();
+    if (*head == NULL) *head = cell; else tail->car = cell;
+    cell->car = NULL;
+    cell->chars = *chars;
+    tail = cell;
+  } else {
+    shift = shift - 8;
+    *chars = *chars | ch<<shift;
+    tail->chars = *chars;
+    if (shift == 0) *chars = 0;
+  }
+}
+
+object *readstring (char delim, gfun_t gfun) {
+  object *obj = myalloc();
+  obj->type = STRING_;
+  int ch = gfun();
+  if (ch == -1) return nil;
+  object *head = NULL;
+  int chars = 0;
+  while ((ch != delim) && (ch != -1)) {
+    if (ch == '\\') ch = gfun();
+    buildstring(ch, &chars, &head);
+    ch = gfun();
+  }
+  obj->cdr = head;
+  return obj;
+}
+
+int stringlength (object *form) {
+  int length = 0;
+  form = cdr(form);
+  while (form != NULL) {
+    int chars = form->chars;
+    for (int i=(sizeof(int)-1)*8; i>=0; i=i-8) {
+      if (chars>>i & 0xFF) length++;
+    }
+    form = car(form);
+  }
+  return length;
+}
+
+char nthchar (object *string, int n) {
+  object *arg = cdr(string);
+  int top;
+  if (sizeof(int) == 4) { top = n>>2; n = 3 - (n&3); }
+  else { top = n>>1; n = 1 - (n&1); }
+  for (int i=0; i<top; i++) {
+    if (arg == NULL) return 0;
+    arg = car(arg);
+  }
+  if (arg == NULL) return 0;
+  return (arg->chars)>>(n*8) & 0xFF;
+}
+
+int gstr () {
+  if (LastChar) {
+    char temp = LastChar;
+    LastChar = 0;
+    return temp;
+  }
+  char c = nthchar(GlobalString, GlobalStringIndex++);
+  if (c != 0) return c;
+  return '\n'; // -1?
+}
+
+void pstr (char c) {
+  buildstring(c, &GlobalStringIndex, &GlobalString);
+}
+
+// Binary serialization - a compact tagged encoding of objects, written with a pfun_t and read with a gfun_t
+
+enum bintag { BINNIL, BINCONS, BININT8, BININT16, BININT32, BINFLOAT, BINCHAR, BINSTRING, BINSYMBOL,
+BINARRAY, BINDEF, BINREF, BINSYMREF, BINFIXED };
+#define BINSMALLINT 0x80 // 0x80-0xFF encode the integers 0 to 127
+
+// With shared structure, a cons or array reached more than once is written in full after BINDEF the
+// first time, and as BINREF and its definition number after that
+object *BinShared = NULL; // Conses and arrays reached more than once
+object *BinDefs = NULL;   // Shared conses and arrays written or read so far, most recent first
+int BinDefCount = 0;
+
+// The first BINSYMBOLS symbols are numbered as they are written, and written as BINSYMREF after that;
+// this also saves searching the workspace for each symbol read
+#define BINSYMBOLS 32
+object *BinSymbols[BINSYMBOLS];
+int BinSymbolCount = 0;
+
+void binword (uint32_t n, int bytes, pfun_t pfun) {
+  for (int i=0; i<bytes; i++) { pfun(n & 0xFF); n = n>>8; }
+}
+
+void binlength (uint32_t n, pfun_t pfun) {
+  while (n >= 0x80) { pfun((n & 0x7F) | 0x80); n = n>>7; }
+  pfun(n);
+}
+
+// Number of elements stored in an array, or of 32-bit words for a bit array
+int binarraysize (object *array) {
+  int size = 1;
+  bool bitp = false;
+  for (object *dims = cddr(array); dims != NULL; dims = cdr(dims)) {
+    int d = car(dims)->integer;
+    if (d < 0) { bitp = true; d = -d; }
+    size = size * d;
+  }
+  return bitp ? (size + 31)/32 : size;
+}
+
+bool binmember (object *obj, object *list) {
+  for (; list != NULL; list = cdr(list)) if (car(list) == obj) return true;
+  return false;
+}
+
+// Collects the conses and arrays reachable more than once in BinShared, using the mark bit.
+// Sets full rather than running out of space while cells are marked
+void binsharing (object *obj, bool *full) {
+  while (obj != NULL) {
+    #if defined(romlibrary)
+    if (romcell(obj)) return;
+    #endif
+    if (marked(obj)) {
+      if (binmember(obj, BinShared)) return;
+      if (Freespace == 0) *full = true; else push(obj, BinShared);
+      return;
+    }
+    if (arrayp(obj)) {
+      int size = binarraysize(obj);
+      mark(obj);
+      for (int i=0; i<size; i++) binsharing(*arrayref(obj, i, size), full);
+      return;
+    }
+    if (!consp(obj)) return;
+    object *arg = car(obj);
+    mark(obj);
+    binsharing(arg, full);
+    obj = cdr(obj);
+  }
+}
+
+void binunmark (object *obj) {
+  while (obj != NULL) {
+    #if defined(romlibrary)
+    if (romcell(obj)) return;
+    #endif
+    if (!marked(obj)) return;
+    unmark(obj);
+    if (arrayp(obj)) {
+      int size = binarraysize(obj);
+      for (int i=0; i<size; i++) binunmark(*arrayref(obj, i, size));
+      return;
+    }
+    binunmark(car(obj));
+    obj = cdr(obj);
+  }
+}
+
+// Writes a reference to a shared cons or array already written and returns true, or flags its definition
+bool binref (object *obj, pfun_t pfun) {
+  if (BinShared == NULL || !binmember(obj, BinShared)) return false;
+  int n = BinDefCount;
+  for (object *defs = BinDefs; defs != NULL; defs = cdr(defs)) {
+    n--;
+    if (car(defs) == obj) { pfun(BINREF); binlength(n, pfun); return true; }
+  }
+  push(obj, BinDefs); BinDefCount++;
+  pfun(BINDEF);
+  return false;
+}
+
+void binobject (symbol_t name, object *obj, pfun_t pfun) {
+  if (stackdeep(TASKGUARD/2)) error2(name, PSTR("Stack overflow"));
+  while (consp(obj)) {
+    if (binref(obj, pfun)) return;
+    pfun(BINCONS);
+    binobject(name, car(obj), pfun);
+    obj = cdr(obj);
+  }
+  if (obj == NULL) pfun(BINNIL);
+  else if (integerp(obj)) {
+    int i = obj->integer;
+    if (i >= 0 && i < 128) pfun(BINSMALLINT | i);
+    else if (i >= -128 && i < 128) { pfun(BININT8); binword(i, 1, pfun); }
+    else if (i >= -32768 && i < 32768) { pfun(BININT16); binword(i, 2, pfun); }
+    else { pfun(BININT32); binword(i, 4, pfun); }
+  } else if (floatp(obj)) {
+    union { float f; uint32_t i; } bits;
+    bits.f = obj->single_float;
+    pfun(BINFLOAT); binword(bits.i, 4, pfun);
+  } else if (fixedp(obj)) { pfun(BINFIXED); binword(obj->integer, 4, pfun); }
+  else if (characterp(obj)) { pfun(BINCHAR); pfun(obj->chars); }
+  else if (stringp(obj)) {
+    pfun(BINSTRING); binlength(stringlength(obj), pfun);
+    for (object *chain = cdr(obj); chain != NULL; chain = car(chain)) {
+      for (int i=(sizeof(int)-1)*8; i>=0; i=i-8) {
+        char ch = chain->chars>>i & 0xFF;
+        if (ch) pfun(ch);
+      }
+    }
+  } else if (symbolp(obj)) {
+    for (int i=0; i<BinSymbolCount; i++) {
+      if (BinSymbols[i]->name == obj->name) { pfun(BINSYMREF); pfun(i); return; }
+    }
+    if (BinSymbolCount < BINSYMBOLS) BinSymbols[BinSymbolCount++] = obj;
+    char *s = symbolname(obj->name);
+    pfun(BINSYMBOL); binlength(strlen(s), pfun); pstring(s, pfun);
+  } else if (arrayp(obj)) {
+    if (binref(obj, pfun)) return;
+    pfun(BINARRAY);
+    binobject(name, cddr(obj), pfun);
+    int size = binarraysize(obj);
+    for (int i=0; i<size; i++) binobject(name, *arrayref(obj, i, size), pfun);
+  } else error(name, PSTR("can't serialize"), obj);
+}
+
+void serialize (symbol_t name, object *obj, pfun_t pfun, bool shared) {
+  BinShared = NULL; BinDefs = NULL; BinDefCount = 0; BinSymbolCount = 0;
+  if (shared) {
+    bool full = false;
+    binsharing(obj, &full);
+    binunmark(obj);
+    if (full) error2(name, PSTR("no room for shared structure"));
+  }
+  binobject(name, obj, pfun);
+  BinShared = NULL; BinDefs = NULL;
+}
+
+int binbyte (gfun_t gfun) {
+  int b = gfun();
+  if (b == -1) error2(0, PSTR("incomplete binary data"));
+  return b & 0xFF;
+}
+
+uint32_t binreadword (int bytes, gfun_t gfun) {
+  uint32_t n = 0;
+  for (int i=0; i<bytes; i++) n = n | (uint32_t)binbyte(gfun)<<(8*i);
+  return n;
+}
+
+uint32_t binreadlength (gfun_t gfun) {
+  uint32_t n = 0;
+  int b, shift = 0;
+  do { b = binbyte(gfun); n = n | (uint32_t)(b & 0x7F)<<shift; shift = shift + 7; } while (b & 0x80);
+  return n;
+}
+
+object *internsymbol (char *buffer);
+
+object *binread (gfun_t gfun) {
+  if (stackdeep(TASKGUARD/2)) error2(0, PSTR("Stack overflow"));
+  object *head = NULL, *tail = NULL, *obj;
+  int tag = binbyte(gfun);
+  bool def = false;
+  while (tag == BINCONS || tag == BINDEF) {
+    if (tag == BINDEF) {
+      tag = binbyte(gfun);
+      if (tag == BINARRAY) { def = true; break; }
+      if (tag != BINCONS) error2(0, PSTR("invalid binary data"));
+      def = true;
+    }
+    object *cell = cons(NULL, NULL);
+    if (def) { push(cell, BinDefs); BinDefCount++; def = false; }
+    if (head == NULL) head = cell; else cdr(tail) = cell;
+    tail = cell;
+    car(cell) = binread(gfun);
+    tag = binbyte(gfun);
+  }
+  if (tag & BINSMALLINT) obj = number(tag & 0x7F);
+  else if (tag == BINNIL) obj = NULL;
+  else if (tag == BININT8) obj = number((int8_t)binreadword(1, gfun));
+  else if (tag == BININT16) obj = number((int16_t)binreadword(2, gfun));
+  else if (tag == BININT32) obj = number((int32_t)binreadword(4, gfun));
+  else if (tag == BINFLOAT) {
+    union { float f; uint32_t i; } bits;
+    bits.i = binreadword(4, gfun);
+    obj = makefloat(bits.f);
+  } else if (tag == BINFIXED) obj = makefixed((int32_t)binreadword(4, gfun));
+  else if (tag == BINCHAR) obj = character(binbyte(gfun));
+  else if (tag == BINSTRING) {
+    obj = myalloc();
+    obj->type = STRING_;
+    object *chain = NULL;
+    int chars = 0;
+    for (uint32_t n=binreadlength(gfun); n>0; n--) buildstring(binbyte(gfun), &chars, &chain);
+    obj->cdr = chain;
+  } else if (tag == BINSYMBOL) {
+    char *buffer = SymbolTop;
+    uint32_t n = binreadlength(gfun);
+    if (n > (uint32_t)maxbuffer(buffer)) error2(0, PSTR("symbol name too long"));
+    for (uint32_t i=0; i<n; i++) buffer[i] = binbyte(gfun);
+    for (uint32_t i=n; i<=6; i++) buffer[i] = '\0'; // pack40() reads six characters
+    buffer[n] = '\0';
+    obj = internsymbol(buffer);
+    if (obj != nil && BinSymbolCount < BINSYMBOLS) BinSymbols[BinSymbolCount++] = obj;
+  } else if (tag == BINSYMREF) {
+    int n = binbyte(gfun);
+    if (n >= BinSymbolCount) error2(0, PSTR("invalid binary data"));
+    obj = BinSymbols[n];
+  } else if (tag == BINARRAY) {
+    object *dims = binread(gfun);
+    if (dims == NULL) error2(0, PSTR("invalid binary data"));
+    for (object *d = dims; d != NULL; d = cdr(d)) {
+      if (!consp(d) || !integerp(car(d))) error2(0, PSTR("invalid binary data"));
+    }
+    // Bit arrays are saved with the first dimension negative
+    bool bitp = (first(dims)->integer < 0);
+    if (bitp) car(dims) = number(-first(dims)->integer);
+    obj = makearray(0, dims, NULL, bitp);
+    // A shared array is numbered before its elements, which can refer to it
+    if (def) { push(obj, BinDefs); BinDefCount++; }
+    int size = binarraysize(obj);
+    for (int i=0; i<size; i++) *arrayref(obj, i, size) = binread(gfun);
+  } else if (tag == BINREF) {
+    uint32_t n = binreadlength(gfun);
+    if (n >= (uint32_t)BinDefCount) error2(0, PSTR("invalid binary data"));
+    object *defs = BinDefs;
+    for (uint32_t i=BinDefCount-1; i>n; i--) defs = cdr(defs);
+    obj = car(defs);
+  } else error2(0, PSTR("invalid binary data"));
+  if (head == NULL) return obj;
+  cdr(tail) = obj;
+  return head;
+}
+
+object *deserialize (gfun_t gfun) {
+  BinDefs = NULL; BinDefCount = 0; BinSymbolCount = 0;
+  object *obj = binread(gfun);
+  BinDefs = NULL;
+  return obj;
+}
+
+// Byte buffer stream for the binary encoding
+uint8_t *BinBuffer;
+int BinIndex, BinSize;
+
+// Strings can't hold a zero byte, so binary data in a string is stored with one added to each byte,
+// and 0xFF 0x01 standing for 0xFF and 0xFF 0x02 for 0xFE
+object *BinChain;
+int BinShift;
+
+void pbinstring (char c) {
+  uint8_t b = c + 1;
+  if (b == 0 || b == 0xFF) { pstr(0xFF); pstr(b == 0 ? 1 : 2); }
+  else pstr(b);
+}
+
+int gbinchain () {
+  if (BinChain == NULL) return -1;
+  int c = (BinChain->chars)>>BinShift & 0xFF;
+  if (BinShift == 0) { BinChain = car(BinChain); BinShift = (sizeof(int)-1)*8; }
+  else BinShift = BinShift - 8;
+  return (c == 0) ? -1 : c;
+}
+
+int gbinstring () {
+  int c = gbinchain();
+  if (c == -1) return -1;
+  if (c == 0xFF) {
+    c = gbinchain();
+    return (c == 1) ? 0xFF : (c == 2) ? 0xFE : -1;
+  }
+  return c - 1;
+}
+
+void pbinbuffer (char c) {
+  if (BinIndex == BinSize) error2(0, PSTR("binary data too large"));
+  BinBuffer[BinIndex++] = c;
+}
+
+int gbinbuffer () {
+  return (BinIndex < BinSize) ? BinBuffer[BinIndex++] : -1;
+}
+
+#if defined(serialflash)
+// Key-value store - a log of records in the last KVSECTORS sectors of the image area. Each sector
+// starts with a sequence number; records are appended to the newest sector, and the live records
+// of the oldest sector are copied forward before it is erased, so all sectors wear evenly
+#define KVMAGIC 0x764B4C75 // "uLKv"
+#define KVKEYS 64           // Keys held in the index
+#define KVHEADER 6          // Record length (2 bytes), key length, kind, CRC (2 bytes)
+#define KVSPARE 2           // Free sectors kept by compaction between commands
+
+enum kvkind { PUTRECORD = 1, DELETERECORD = 2 };
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;
+} kvsector_t;
+
+typedef struct {
+  uint32_t hash;            // CRC-32 of the serialized key
+  uint32_t addr;            // Latest put record
+} kventry_t;
+
+kventry_t KVIndex[KVKEYS];
+int KVCount = -1;           // -1 until the store is scanned
+uint32_t KVSequence[KVSECTORS]; // 0 for a free sector
+uint32_t KVHead;            // Where the next record goes, or 0 to start a new sector
+int KVHeadSector;
+
+uint32_t kvsectoraddr (int s) {
+  return KVBASE + s*FLASHSECTOR;
+}
+
+uint32_t kvcrc (const uint8_t *data, int n, uint32_t crc) {
+  for (int i=0; i<n; i++) crc = crc32byte(crc, data[i]);
+  return crc;
+}
+
+// Reads the record at addr into FlashPage; returns its length, 0 at the end of the sector, or -1 if it is damaged
+int kvread (uint32_t addr, uint32_t end) {
+  if (addr + KVHEADER > end) return 0;
+  SerialFlashRead(addr, FlashPage, KVHEADER);
+  int length = FlashPage[0] | FlashPage[1]<<8;
+  if (length == 0xFFFF) return 0;
+  if (length < KVHEADER + FlashPage[2] || length > FLASHPAGE || addr + length > end) return -1;
+  SerialFlashRead(addr + KVHEADER, FlashPage + KVHEADER, length - KVHEADER);
+  uint32_t crc = ~kvcrc(FlashPage + KVHEADER, length - KVHEADER, kvcrc(FlashPage + 2, 2, 0xFFFFFFFF));
+  if ((crc & 0xFFFF) != (uint32_t)(FlashPage[4] | FlashPage[5]<<8)) return -1;
+  return length;
+}
+
+// Finds the index entry for the key in FlashPage at offset
+int kvfind (int offset, int keylength, uint32_t hash) {
+  for (int i=0; i<KVCount; i++) {
+    if (KVIndex[i].hash != hash) continue;
+    uint8_t buffer[32];
+    SerialFlashRead(KVIndex[i].addr, buffer, KVHEADER);
+    bool same = (buffer[2] == keylength);
+    for (int n=0; same && n<keylength; n=n+32) {
+      int chunk = (keylength - n < 32) ? keylength - n : 32;
+      SerialFlashRead(KVIndex[i].addr + KVHEADER + n, buffer, chunk);
+      same = (memcmp(buffer, FlashPage + offset + n, chunk) == 0);
+    }
+    if (same) return i;
+  }
+  return -1;
+}
+
+// Updates the index for the record in FlashPage, just read from or written to addr
+void kvindex (uint32_t addr) {
+  int keylength = FlashPage[2];
+  uint32_t hash = ~kvcrc(FlashPage + KVHEADER, keylength, 0xFFFFFFFF);
+  int i = kvfind(KVHEADER, keylength, hash);
+  if (FlashPage[3] == DELETERECORD) {
+    if (i != -1) KVIndex[i] = KVIndex[--KVCount];
+  } else if (i != -1) KVIndex[i].addr = addr;
+  else {
+    if (KVCount == KVKEYS) error2(0, PSTR("kv store full"));
+    KVIndex[KVCount].hash = hash; KVIndex[KVCount].addr = addr; KVCount++;
+  }
+}
+
+// Returns the sector with the lowest sequence number above after, or -1
+int kvnextsector (uint32_t after) {
+  int next = -1;
+  for (int s=0; s<KVSECTORS; s++) {
+    if (KVSequence[s] > after && (next == -1 || KVSequence[s] < KVSequence[next])) next = s;
+  }
+  return next;
+}
+
+// Builds the index by replaying the sectors in sequence order
+void kvscan () {
+  if (KVCount >= 0) return;
+  KVCount = 0; KVHead = 0; KVHeadSector = -1;
+  for (int s=0; s<KVSECTORS; s++) {
+    kvsector_t header;
+    SerialFlashRead(kvsectoraddr(s), (uint8_t *)&header, sizeof(kvsector_t));
+    KVSequence[s] = (header.magic == KVMAGIC) ? header.sequence : 0;
+  }
+  for (int s = kvnextsector(0); s != -1; s = kvnextsector(KVSequence[s])) {
+    uint32_t addr = kvsectoraddr(s) + sizeof(kvsector_t), end = kvsectoraddr(s) + FLASHSECTOR;
+    int length;
+    while ((length = kvread(addr, end)) > 0) {
+      kvindex(addr);
+      addr = addr + length;
+    }
+    KVHeadSector = s;
+    KVHead = (length == 0) ? addr : 0; // Don't append after a damaged record
+  }
+}
+
+int kvfreesectors () {
+  int n = 0;
+  for (int s=0; s<KVSECTORS; s++) if (KVSequence[s] == 0) n++;
+  return n;
+}
+
+// Starts a new sector, the next free one after the current sector
+void kvnewsector () {
+  int s = KVHeadSector, n = 0;
+  do {
+    s = (s + 1) % KVSECTORS;
+    if (n++ == KVSECTORS) error2(0, PSTR("kv store full"));
+  } while (KVSequence[s] != 0);
+  kvsector_t header;
+  header.magic = KVMAGIC;
+  header.sequence = (KVHeadSector == -1) ? 1 : KVSequence[KVHeadSector] + 1;
+  SerialFlashWrite(kvsectoraddr(s), (uint8_t *)&header, sizeof(kvsector_t));
+  KVSequence[s] = header.sequence;
+  KVHeadSector = s;
+  KVHead = kvsectoraddr(s) + sizeof(kvsector_t);
+}
+
+// Appends the record in FlashPage, which must leave a free sector for compaction
+void kvappend (int length) {
+  if (KVHead == 0 || KVHead + length > kvsectoraddr(KVHeadSector) + FLASHSECTOR) kvnewsector();
+  SerialFlashWrite(KVHead, FlashPage, length);
+  kvindex(KVHead);
+  KVHead = KVHead + length;
+}
+
+// Copies the live records of the oldest sector forward and erases it; returns false if there is nothing to compact
+bool kvcompact () {
+  int s = kvnextsector(0);
+  if (s == -1 || s == KVHeadSector) return false;
+  uint32_t addr = kvsectoraddr(s) + sizeof(kvsector_t), end = kvsectoraddr(s) + FLASHSECTOR;
+  int length;
+  while ((length = kvread(addr, end)) > 0) {
+    bool live = false;
+    for (int i=0; i<KVCount; i++) if (KVIndex[i].addr == addr) live = true;
+    // Deletes can go, as no older record of the key is left
+    if (live) kvappend(length);
+    addr = addr + length;
+  }
+  SerialFlashErase(kvsectoraddr(s));
+  KVSequence[s] = 0;
+  return true;
+}
+
+// Writes a record for key and value, serialized into FlashPage
+void kvwrite (symbol_t name, object *key, object *value, int kind) {
+  kvscan();
+  // Compact first, as compaction uses FlashPage, allowing for the largest record
+  if (KVHead == 0 || KVHead + FLASHPAGE > kvsectoraddr(KVHeadSector) + FLASHSECTOR) {
+    int tries = KVSECTORS;
+    while (kvfreesectors() <= 1) if (!kvcompact() || --tries == 0) error2(name, PSTR("kv store full"));
+  }
+  BinBuffer = FlashPage; BinIndex = KVHEADER; BinSize = FLASHPAGE;
+  serialize(name, key, pbinbuffer, false);
+  int keylength = BinIndex - KVHEADER;
+  if (keylength > 255) error(name, PSTR("key too large"), key);
+  uint32_t hash = ~kvcrc(FlashPage + KVHEADER, keylength, 0xFFFFFFFF);
+  if (KVCount == KVKEYS && kvfind(KVHEADER, keylength, hash) == -1) error2(name, PSTR("kv store full"));
+  if (kind == PUTRECORD) serialize(name, value, pbinbuffer, false);
+  int length = BinIndex;
+  FlashPage[0] = length & 0xFF; FlashPage[1] = length>>8;
+  FlashPage[2] = keylength; FlashPage[3] = kind;
+  uint32_t crc = ~kvcrc(FlashPage + KVHEADER, length - KVHEADER, kvcrc(FlashPage + 2, 2, 0xFFFFFFFF));
+  FlashPage[4] = crc & 0xFF; FlashPage[5] = crc>>8 & 0xFF;
+  kvappend(length);
+}
+
+// Returns the index entry for key, or -1
+int kvlookup (symbol_t name, object *key) {
+  kvscan();
+  BinBuffer = FlashPage; BinIndex = 0; BinSize = FLASHPAGE;
+  serialize(name, key, pbinbuffer, false);
+  return kvfind(0, BinIndex, ~kvcrc(FlashPage, BinIndex, 0xFFFFFFFF));
+}
+
+// Compacts one sector while waiting for input, once the store has been used
+void kvidle () {
+  if (KVCount >= 0 && kvfreesectors() < KVSPARE) kvcompact();
+}
+#else
+void kvidle () { }
+#endif
+
+// Lookup variable in environment
+
+object *value (symbol_t n, object *env) {
+  while (env != NULL) {
+    object *pair = car(env);
+    if (pair != NULL && car(pair)->name == n) return pair;
+    env = cdr(env);
+  }
+  return nil;
+}
+
+bool boundp (object *var, object *env) {
+  symbol_t varname = var->name;
+  if (value(varname, env) != NULL) return true;
+  if (value(varname, GlobalEnv) != NULL) return true;
+  return false;
+}
+
+// Returns a global binding that can be written, shadowing a ROM library binding with a RAM copy
+object *globalpair (object *pair) {
+  #if defined(romlibrary)
+  if (romcell(pair)) {
+    push(cons(car(pair), cdr(pair)), GlobalEnv);
+    return first(GlobalEnv);
+  }
+  #endif
+  return pair;
+}
+
+// Quoted lists in the ROM library are constants
+void checkwritable (symbol_t name, object *obj) {
+  #if defined(romlibrary)
+  if (romcell(obj)) error(name, PSTR("can't modify library constant"), obj);
+  #else
+  (void) name, (void) obj;
+  #endif
+}
+
+object *findvalue (object *var, object *env) {
+  symbol_t varname = var->name;
+  object *pair = value(varname, env);
+  if (pair == NULL) pair = value(varname, GlobalEnv);
+  if (pair == NULL) error(0, PSTR("unknown variable"), var);
+  return globalpair(pair);
+}
+
+// Handling closures
+
+object *bindparams (int tc, symbol_t name, object *state, object *function, object *args, object **env) {
+  int trace = 0;
   if (name) trace = tracing(name);
   if (trace) {
     indent(TraceDepth[trace-1]<<1, ' ', pserial);
@@ -1148,9 +3265,24 @@ object *closure (int tc, symbol_t name, object *state, object *function, object
   }
   if (args != NULL) error2(name, toomanyargs);
   if (trace) { pserial(')'); pln(pserial); }
-  // Do an implicit progn
   if (tc) push(nil, *env);
-  return tf_progn(function, *env);
+  return function;
+}
+
+object *closure (int tc, symbol_t name, object *state, object *function, object *args, object **env) {
+  object *forms = bindparams(tc, name, state, function, args, env);
+  // Do an implicit progn
+  return tf_progn(forms, *env);
+}
+
+object *makeclosure (object *args, object *env) {
+  object *envcopy = NULL;
+  while (env != NULL) {
+    object *pair = first(env);
+    if (pair != NULL) push(pair, envcopy);
+    env = cdr(env);
+  }
+  return cons(symbol(CLOSURE), cons(envcopy,args));
 }
 
 object *apply (symbol_t name, object *function, object *args, object *env) {
@@ -1169,10 +3301,63 @@ object *apply (symbol_t name, object *function, object *args, object *env) {
     object *result = closure(0, 0, car(function), cdr(function), args, &env);
     return eval(result, env);
   }
+  if (memop(function)) return memocall(name, function, args, env);
+  if (structfunctionp(function)) return structcall(name, function, args, env);
   error(name, PSTR("illegal function"), function);
   return NULL;
 }
 
+// Calling a function for each element. A builtin is checked once and called through its function
+// pointer with one argument list, reused for each call; list, funcall and apply can keep or change
+// their argument list, so they get a new one each time, like lambdas, which go through apply
+
+typedef struct {
+  object *function;
+  fn_ptr_type fptr;
+  object *args;
+  int nargs;
+} call_t;
+
+// Pushes the reused argument list on GCStack; the caller pops it when it has finished calling
+void callinit (symbol_t name, call_t *c, object *function, int nargs) {
+  c->function = function; c->fptr = NULL; c->args = NULL; c->nargs = nargs;
+  if (symbolp(function)) {
+    symbol_t fname = function->name;
+    if (fname < FUNCTIONS || fname >= ENDFUNCTIONS) error(name, PSTR("illegal function"), function);
+    checkminmax(fname, nargs);
+    c->fptr = (fn_ptr_type)lookupfn(fname);
+    if (fname != LIST && fname != FUNCALL && fname != APPLY) {
+      for (int i=0; i<nargs; i++) push(nil, c->args);
+    }
+  }
+  push(c->args, GCStack);
+}
+
+// The argument list to fill in for the next call
+object *callargs (call_t *c) {
+  if (c->args != NULL) return c->args;
+  object *args = NULL;
+  for (int i=0; i<c->nargs; i++) push(nil, args);
+  return args;
+}
+
+object *callfunction (symbol_t name, call_t *c, object *args, object *env) {
+  if (c->fptr) return c->fptr(args, env);
+  return apply(name, c->function, args, env);
+}
+
+object *call1 (symbol_t name, call_t *c, object *arg, object *env) {
+  object *args = callargs(c);
+  first(args) = arg;
+  return callfunction(name, c, args, env);
+}
+
+object *call2 (symbol_t name, call_t *c, object *arg1, object *arg2, object *env) {
+  object *args = callargs(c);
+  first(args) = arg1; second(args) = arg2;
+  return callfunction(name, c, args, env);
+}
+
 // In-place operations
 
 object **place (symbol_t name, object *args, object *env, int *bit) {
@@ -1184,11 +3369,13 @@ object **place (symbol_t name, object *args, object *env, int *bit) {
     if (fname == CAR || fname == FIRST) {
       object *value = eval(second(args), env);
       if (!listp(value)) error(name, PSTR("can't take car"), value);
+      checkwritable(name, value);
       return &car(value);
     }
     if (fname == CDR || fname == REST) {
       object *value = eval(second(args), env);
       if (!listp(value)) error(name, PSTR("can't take cdr"), value);
+      checkwritable(name, value);
       return &cdr(value);
     }
     if (fname == NTH) {
@@ -1200,6 +3387,7 @@ object **place (symbol_t name, object *args, object *env, int *bit) {
         if (list == NULL) error2(name, PSTR("index to nth is out of range"));
         index--;
       }
+      checkwritable(name, list);
       return &car(list);
     }
     if (fname == AREF) {
@@ -1207,6 +3395,21 @@ object **place (symbol_t name, object *args, object *env, int *bit) {
       if (!arrayp(array)) error(AREF, PSTR("first argument is not an array"), array);
       return getarray(AREF, array, cddr(args), env, bit);
     }
+    if (fname == GETHASH) {
+      object *key = eval(second(args), env);
+      push(key, GCStack);
+      object *table = eval(third(args), env);
+      push(table, GCStack);
+      object *def = (cdr(cddr(args)) != NULL) ? eval(car(cdr(cddr(args))), env) : nil;
+      pop(GCStack); pop(GCStack);
+      return hashplace(key, checkhashtable(GETHASH, table), def);
+    }
+    if (fname >= ENDFUNCTIONS) {
+      object *pair = value(fname, env);
+      if (pair == NULL) pair = value(fname, GlobalEnv);
+      if (pair != NULL && structfunctionp(cdr(pair)) && second(cdr(pair))->integer >= 0)
+        return structslot(fname, cdr(pair), eval(second(args), env));
+    }
   }
   error2(name, PSTR("illegal place"));
   return nil;
@@ -1381,14 +3584,144 @@ pfun_t pstreamfun (object *args) {
   else if (streamtype == STRINGSTREAM) {
     pfun = pstr;
   }
-  #if defined(sdcardsupport)
-  else if (streamtype == SDSTREAM) pfun = (pfun_t)SDwrite;
-  #endif
-  #if defined(gfxsupport)
-  else if (streamtype == GFXSTREAM) pfun = (pfun_t)gfxwrite;
-  #endif
-  else error2(0, PSTR("unknown stream type"));
-  return pfun;
+  #if defined(sdcardsupport)
+  else if (streamtype == SDSTREAM) pfun = (pfun_t)SDwrite;
+  #endif
+  #if defined(gfxsupport)
+  else if (streamtype == GFXSTREAM) pfun = (pfun_t)gfxwrite;
+  #endif
+  else error2(0, PSTR("unknown stream type"));
+  return pfun;
+}
+
+// Block streams - a streamops_t moves a block of bytes with one call to the device where the
+// stream supports it, and otherwise through the per-character gfun_t or pfun_t
+
+#define STREAMBLOCK 32 // Largest block passed to readblock or writeblock
+
+typedef struct {
+  gfun_t gfun;
+  pfun_t pfun;
+  int (*readblock) (uint8_t *buffer, int n); // NULL to read a byte at a time; returns the bytes read
+  void (*writeblock) (const uint8_t *buffer, int n); // NULL to write a byte at a time
+} streamops_t;
+
+#if !defined(CPU_NRF51822) && !defined(ARDUINO_FEATHER_F405)
+int serial1readblock (uint8_t *buffer, int n) {
+  int i = 0;
+  while (i < n) {
+    while (!Serial1.available()) testescape();
+    int chunk = Serial1.available();
+    if (chunk > n - i) chunk = n - i;
+    i = i + Serial1.readBytes((char *)buffer + i, chunk);
+  }
+  return n;
+}
+
+void serial1writeblock (const uint8_t *buffer, int n) { Serial1.write(buffer, n); }
+#endif
+
+int spireadblock (uint8_t *buffer, int n) {
+  uint8_t zeros[STREAMBLOCK];
+  memset(zeros, 0, n);
+  SPI.transfer(zeros, buffer, n, NULL);
+  return n;
+}
+
+void spiwriteblock (const uint8_t *buffer, int n) { SPI.transfer((void *)buffer, NULL, n, NULL); }
+
+void i2cwriteblock (const uint8_t *buffer, int n) { Wire.write(buffer, n); }
+
+void streamops (object *args, streamops_t *ops, bool output) {
+  ops->gfun = NULL; ops->pfun = NULL;
+  if (output) ops->pfun = pstreamfun(args); else ops->gfun = gstreamfun(args);
+  ops->readblock = NULL; ops->writeblock = NULL;
+  int stream = (args != NULL && first(args) != NULL) ? isstream(first(args)) : SERIALSTREAM<<8;
+  int streamtype = stream>>8, address = stream & 0xFF;
+  // Output to serial 0 is already collected into blocks by pserial()
+  if (streamtype == SERIALSTREAM) {
+    #if !defined(CPU_NRF51822) && !defined(ARDUINO_FEATHER_F405)
+    if (address == 1) { ops->readblock = serial1readblock; ops->writeblock = serial1writeblock; }
+    #endif
+  } else if (streamtype == SPISTREAM && address < 128) {
+    ops->readblock = spireadblock; ops->writeblock = spiwriteblock;
+  } else if (streamtype == I2CSTREAM) ops->writeblock = i2cwriteblock;
+}
+
+// Reads up to STREAMBLOCK bytes; returns the number read, which is less than n at the end of the stream
+int streamread (streamops_t *ops, uint8_t *buffer, int n) {
+  if (ops->readblock != NULL) return ops->readblock(buffer, n);
+  for (int i=0; i<n; i++) {
+    int c = ops->gfun();
+    if (c == -1) return i;
+    buffer[i] = c;
+  }
+  return n;
+}
+
+void streamwrite (streamops_t *ops, const uint8_t *buffer, int n) {
+  if (ops->writeblock != NULL) ops->writeblock(buffer, n);
+  else for (int i=0; i<n; i++) ops->pfun(buffer[i]);
+}
+
+// Sequences of bytes for read-sequence and write-sequence
+
+int bytevectorlength (symbol_t name, object *array) {
+  object *dims = cddr(array);
+  if (cdr(dims) != NULL || first(dims)->integer < 0) error(name, PSTR("not a one-dimensional array"), array);
+  return first(dims)->integer;
+}
+
+void putbyte (streamops_t *ops, uint8_t *buffer, int *n, uint8_t b) {
+  buffer[(*n)++] = b;
+  if (*n == STREAMBLOCK) { streamwrite(ops, buffer, *n); *n = 0; }
+}
+
+void writesequence (symbol_t name, object *seq, streamops_t *ops) {
+  uint8_t buffer[STREAMBLOCK];
+  int n = 0;
+  if (stringp(seq)) {
+    for (object *chain = cdr(seq); chain != NULL; chain = car(chain)) {
+      for (int i=(sizeof(int)-1)*8; i>=0; i=i-8) {
+        char ch = chain->chars>>i & 0xFF;
+        if (ch) putbyte(ops, buffer, &n, ch);
+      }
+    }
+  } else if (listp(seq)) {
+    for (; consp(seq); seq = cdr(seq)) putbyte(ops, buffer, &n, checkinteger(name, car(seq)));
+  } else if (arrayp(seq)) {
+    int size = bytevectorlength(name, seq);
+    for (int i=0; i<size; i++) putbyte(ops, buffer, &n, checkinteger(name, *arrayref(seq, i, size)));
+  } else error(name, PSTR("argument is not a sequence"), seq);
+  streamwrite(ops, buffer, n);
+}
+
+// Fills seq in order until it is full or the stream ends; returns the number of elements read
+int readsequence (symbol_t name, object *seq, streamops_t *ops) {
+  int length, size = 0;
+  if (stringp(seq)) length = stringlength(seq);
+  else if (listp(seq)) length = listlength(name, seq);
+  else if (arrayp(seq)) length = size = bytevectorlength(name, seq);
+  else error(name, PSTR("argument is not a sequence"), seq);
+  checkwritable(name, seq);
+  object *chain = stringp(seq) ? cdr(seq) : seq;
+  int shift = (sizeof(int)-1)*8, count = 0;
+  uint8_t buffer[STREAMBLOCK];
+  while (count < length) {
+    int want = (length - count < STREAMBLOCK) ? length - count : STREAMBLOCK;
+    int n = streamread(ops, buffer, want);
+    for (int i=0; i<n; i++) {
+      if (stringp(seq)) {
+        if (buffer[i] == 0) error2(name, PSTR("can't store a zero byte in a string"));
+        chain->chars = (chain->chars & ~(0xFF<<shift)) | buffer[i]<<shift;
+        if (shift == 0) { chain = car(chain); shift = (sizeof(int)-1)*8; } else shift = shift - 8;
+      } else if (arrayp(seq)) *arrayref(seq, count + i, size) = number(buffer[i]);
+      else { checkwritable(name, chain); car(chain) = number(buffer[i]); chain = cdr(chain); }
+    }
+    count = count + n;
+    if (n < want) break;
+  }
+  return count;
 }
 
 // Check pins
@@ -1726,11 +4059,39 @@ object *sp_defun (object *args, object *env) {
   if (!symbolp(var)) error(DEFUN, notasymbol, var);
   object *val = cons(symbol(LAMBDA), cdr(args));
   object *pair = value(var->name,GlobalEnv);
-  if (pair != NULL) cdr(pair) = val;
+  if (pair != NULL) cdr(globalpair(pair)) = val;
   else push(cons(var, val), GlobalEnv);
   return var;
 }
 
+object *sp_defmemo (object *args, object *env) {
+  object *var = sp_defun(args, env);
+  return fn_memoize(cons(var, NULL), env);
+}
+
+void structdefine (object *var, int index, object *type) {
+  object *val = cons(symbol(DEFSTRUCT), cons(number(index), type));
+  object *pair = value(var->name, GlobalEnv);
+  if (pair != NULL) cdr(globalpair(pair)) = val;
+  else push(cons(var, val), GlobalEnv);
+}
+
+object *sp_defstruct (object *args, object *env) {
+  (void) env;
+  object *name = first(args);
+  if (!symbolp(name)) error(DEFSTRUCT, notasymbol, name);
+  int index = 0;
+  for (object *slots = cdr(args); slots != NULL; slots = cdr(slots)) {
+    object *slot = car(slots);
+    if (consp(slot)) slot = car(slot);
+    if (!symbolp(slot)) error(DEFSTRUCT, notasymbol, slot);
+    structdefine(structsymbol(PSTR(""), name, PSTR("-"), slot), index++, args);
+  }
+  structdefine(structsymbol(PSTR(""), name, PSTR("-p"), nil), STRUCTP, args);
+  structdefine(structsymbol(PSTR("make-"), name, PSTR(""), nil), STRUCTMAKE, args);
+  return name;
+}
+
 object *sp_defvar (object *args, object *env) {
   checkargs(DEFVAR, args);
   object *var = first(args);
@@ -1739,7 +4100,7 @@ object *sp_defvar (object *args, object *env) {
   args = cdr(args);
   if (args != NULL) { setflag(NOESC); val = eval(first(args), env); clrflag(NOESC); }
   object *pair = value(var->name, GlobalEnv);
-  if (pair != NULL) cdr(pair) = val;
+  if (pair != NULL) cdr(globalpair(pair)) = val;
   else push(cons(var, val), GlobalEnv);
   return var;
 }
@@ -1759,6 +4120,7 @@ object *sp_setq (object *args, object *env) {
 object *sp_loop (object *args, object *env) {
   object *start = args;
   for (;;) {
+    if (Limits) checklimits(); // An empty loop doesn't reach eval
     args = start;
     while (args != NULL) {
       object *result = eval(car(args),env);
@@ -1790,6 +4152,7 @@ object *sp_pop (object *args, object *env) {
   int bit;
   checkargs(POP, args);
   object **loc = place(POP, first(args), env, &bit);
+  if (*loc == NULL) return nil;
   object *result = car(*loc);
   pop(*loc);
   return result;
@@ -1816,7 +4179,10 @@ object *sp_incf (object *args, object *env) {
     return number(newvalue);
   }
 
-  if (floatp(x) || floatp(inc)) {
+  if (fixedp(x) || fixedp(inc)) {
+    int64_t increment = (inc == NULL) ? FIXEDONE : fixedvalue(INCF, inc);
+    *loc = makefixed(fixedsat(fixedvalue(INCF, x) + increment));
+  } else if (floatp(x) || floatp(inc)) {
     float increment;
     float value = checkintfloat(INCF, x);
 
@@ -1859,14 +4225,17 @@ object *sp_decf (object *args, object *env) {
     return number(newvalue);
   }
 
-  if (floatp(x) || floatp(dec)) {
+  if (fixedp(x) || fixedp(dec)) {
+    int64_t decrement = (dec == NULL) ? FIXEDONE : fixedvalue(DECF, dec);
+    *loc = makefixed(fixedsat(fixedvalue(DECF, x) - decrement));
+  } else if (floatp(x) || floatp(dec)) {
     float decrement;
     float value = checkintfloat(DECF, x);
 
     if (dec == NULL) decrement = 1.0; else decrement = checkintfloat(DECF, dec);
 
     *loc = makefloat(value - decrement);
-  } if (integerp(x) && (integerp(dec) || dec == NULL)) {
+  } else if (integerp(x) && (integerp(dec) || dec == NULL)) {
     int decrement;
     int value = x->integer;
 
@@ -2248,7 +4617,7 @@ object *sp_defcode (object *args, object *env) {
 
   object *val = cons(codehead((origin+codesize)<<16 | origin), args);
   object *pair = value(var->name, GlobalEnv);
-  if (pair != NULL) cdr(pair) = val;
+  if (pair != NULL) cdr(globalpair(pair)) = val;
   else push(cons(var, val), GlobalEnv);
   clrflag(NOESC);
   return var;
@@ -2334,6 +4703,69 @@ object *sp_error (object *args, object *env) {
   longjmp(*handler, 1);
 }
 
+
+void checklimits () {
+  if (Limits & FUELLIMIT) {
+    if (Fuel == 0) error2(0, PSTR("out of fuel"));
+    Fuel--;
+  }
+  if ((Limits & DEADLINELIMIT) && (int32_t)(millis() - Deadline) >= 0) error2(0, PSTR("deadline passed"));
+}
+
+// Evaluate the body with a tighter limit, charging the steps used to any enclosing with-fuel
+object *withlimit (symbol_t name, object *args, object *env) {
+  checkargs(name, args);
+  int n = checkinteger(name, eval(first(args), env));
+  if (n < 0) error(name, PSTR("argument is negative"), first(args));
+  uint8_t oldlimits = Limits;
+  uint32_t oldfuel = Fuel, olddeadline = Deadline, startfuel;
+  if (name == WITHFUEL) {
+    if (!(Limits & FUELLIMIT) || (uint32_t)n < Fuel) Fuel = n;
+    Limits = Limits | FUELLIMIT;
+  } else {
+    uint32_t deadline = millis() + n;
+    if (!(Limits & DEADLINELIMIT) || (int32_t)(deadline - Deadline) < 0) Deadline = deadline;
+    Limits = Limits | DEADLINELIMIT;
+  }
+  startfuel = Fuel;
+  object *current_GCStack = GCStack;
+  jmp_buf dynamic_handler;
+  jmp_buf *previous_handler = handler;
+  handler = &dynamic_handler;
+  object *result = nil;
+  args = cdr(args);
+
+  bool signaled = false;
+  if (!setjmp(dynamic_handler)) {
+    while (args != NULL) {
+      result = eval(car(args),env);
+      if (tstflag(RETURNFLAG)) break;
+      args = cdr(args);
+    }
+  } else {
+    GCStack = current_GCStack;
+    signaled = true;
+  }
+  handler = previous_handler;
+  uint32_t used = startfuel - Fuel;
+  Limits = oldlimits; Deadline = olddeadline;
+  Fuel = (oldfuel > used) ? oldfuel - used : 0;
+
+  if (signaled) {
+    GCStack = NULL;
+    longjmp(*handler, 1);
+  }
+  else return result;
+}
+
+object *sp_withfuel (object *args, object *env) {
+  return withlimit(WITHFUEL, args, env);
+}
+
+object *sp_withdeadline (object *args, object *env) {
+  return withlimit(WITHDEADLINE, args, env);
+}
+
 // Tail-recursive forms
 
 object *tf_progn (object *args, object *env) {
@@ -2381,25 +4813,40 @@ object *tf_unless (object *args, object *env) {
   else return tf_progn(cdr(args),env);
 }
 
-object *tf_case (object *args, object *env) {
+object *casesub (symbol_t name, object *args, object *env, bool otherwise) {
   object *test = eval(first(args), env);
-  args = cdr(args);
-  while (args != NULL) {
-    object *clause = first(args);
-    if (!consp(clause)) error(CASE, PSTR("illegal clause"), clause);
-    object *key = car(clause);
-    object *forms = cdr(clause);
-    if (consp(key)) {
-      while (key != NULL) {
-        if (eq(test,car(key))) return tf_progn(forms, env);
-        key = cdr(key);
-      }
-    } else if (eq(test,key) || eq(key,tee)) return tf_progn(forms, env);
+  casetable_t *table = casetable(args, otherwise);
+  if (table->kind != CASELINEAR) {
+    object *clause = caseclause(table, test);
+    if (clause != NULL) return tf_progn(cdr(clause), env);
+  } else {
     args = cdr(args);
+    while (args != NULL) {
+      object *clause = first(args);
+      if (!consp(clause)) error(name, PSTR("illegal clause"), clause);
+      object *key = car(clause);
+      object *forms = cdr(clause);
+      if (consp(key)) {
+        while (key != NULL) {
+          if (eq(test,car(key))) return tf_progn(forms, env);
+          key = cdr(key);
+        }
+      } else if (eq(test,key) || (otherwise && eq(key,tee))) return tf_progn(forms, env);
+      args = cdr(args);
+    }
   }
+  if (!otherwise) error(name, PSTR("no clause matches"), test);
   return nil;
 }
 
+object *tf_case (object *args, object *env) {
+  return casesub(CASE, args, env, true);
+}
+
+object *tf_ecase (object *args, object *env) {
+  return casesub(ECASE, args, env, false);
+}
+
 object *tf_and (object *args, object *env) {
   if (args == NULL) return tee;
   object *more = cdr(args);
@@ -2487,6 +4934,11 @@ object *fn_eq (object *args, object *env) {
   return eq(first(args), second(args)) ? tee : nil;
 }
 
+object *fn_equal (object *args, object *env) {
+  (void) env;
+  return equal(first(args), second(args)) ? tee : nil;
+}
+
 // List functions
 
 object *fn_car (object *args, object *env) {
@@ -2668,105 +5120,448 @@ object *fn_apply (object *args, object *env) {
   return apply(APPLY, first(args), cdr(args), env);
 }
 
-object *fn_funcall (object *args, object *env) {
-  return apply(FUNCALL, first(args), cdr(args), env);
+object *fn_funcall (object *args, object *env) {
+  return apply(FUNCALL, first(args), cdr(args), env);
+}
+
+object *fn_append (object *args, object *env) {
+  (void) env;
+  object *head = NULL;
+  object *tail;
+  while (args != NULL) {
+    object *list = first(args);
+    if (!listp(list)) error(APPEND, notalist, list);
+    while (consp(list)) {
+      object *obj = cons(car(list), cdr(list));
+      if (head == NULL) head = obj;
+      else cdr(tail) = obj;
+      tail = obj;
+      list = cdr(list);
+      if (cdr(args) != NULL && improperp(list)) error(APPEND, notproper, first(args));
+    }
+    args = cdr(args);
+  }
+  return head;
+}
+
+object *fn_mapc (object *args, object *env) {
+  object *function = first(args);
+  args = cdr(args);
+  object *result = first(args);
+  object *params = cons(NULL, NULL);
+  push(params,GCStack);
+  // Make parameters
+  while (true) {
+    object *tailp = params;
+    object *lists = args;
+    while (lists != NULL) {
+      object *list = car(lists);
+      if (list == NULL) {
+         pop(GCStack);
+         return result;
+      }
+      if (improperp(list)) error(MAPC, notproper, list);
+      object *obj = cons(first(list),NULL);
+      car(lists) = cdr(list);
+      cdr(tailp) = obj; tailp = obj;
+      lists = cdr(lists);
+    }
+    apply(MAPC, function, cdr(params), env);
+  }
+}
+
+void mapcarfun (object *result, object **tail) {
+  object *obj = cons(result,NULL);
+  cdr(*tail) = obj; *tail = obj;
+}
+
+void mapcanfun (object *result, object **tail) {
+  while (consp(result)) {
+    cdr(*tail) = result; *tail = result;
+    result = cdr(result);
+  }
+  if (result != NULL) error(MAPCAN, resultproper, result);
+}
+
+object *mapcarcan (symbol_t name, object *args, object *env, mapfun_t fun) {
+  object *function = first(args);
+  args = cdr(args);
+  object *params = cons(NULL, NULL);
+  push(params,GCStack);
+  object *head = cons(NULL, NULL);
+  push(head,GCStack);
+  object *tail = head;
+  // Make parameters
+  while (true) {
+    object *tailp = params;
+    object *lists = args;
+    while (lists != NULL) {
+      object *list = car(lists);
+      if (list == NULL) {
+         pop(GCStack);
+         pop(GCStack);
+         return cdr(head);
+      }
+      if (improperp(list)) error(name, notproper, list);
+      object *obj = cons(first(list),NULL);
+      car(lists) = cdr(list);
+      cdr(tailp) = obj; tailp = obj;
+      lists = cdr(lists);
+    }
+    object *result = apply(name, function, cdr(params), env);
+    fun(result, &tail);
+  }
+}
+
+object *fn_mapcar (object *args, object *env) {
+  return mapcarcan(MAPCAR, args, env, mapcarfun);
+}
+
+object *fn_mapcan (object *args, object *env) {
+  return mapcarcan(MAPCAN, args, env, mapcanfun);
+}
+
+// Sequence functions - each walks its sequences once, and calls builtins without consing
+
+object *fn_reduce (object *args, object *env) {
+  object *function = first(args), *key = NULL, *acc = NULL, *item;
+  bool initial = false;
+  for (object *opts = cddr(args); opts != NULL; opts = cddr(opts)) {
+    object *var = first(opts);
+    if (cdr(opts) == NULL) error(REDUCE, PSTR("keyword has no value"), var);
+    if (issymbol(var, INITIALVALUE)) { acc = second(opts); initial = true; }
+    else if (issymbol(var, KEY)) key = second(opts);
+    else error(REDUCE, PSTR("argument not recognised"), var);
+  }
+  seq_t s;
+  seqinit(REDUCE, &s, second(args), env);
+  call_t f, k;
+  if (key != NULL) callinit(REDUCE, &k, key, 1);
+  if (!initial) {
+    if (!seqnext(REDUCE, &s, &item)) {
+      if (key != NULL) pop(GCStack);
+      return apply(REDUCE, function, NULL, env);
+    }
+    acc = (key != NULL) ? call1(REDUCE, &k, item, env) : item;
+  }
+  // Adding keeps a total in C, so only the result is boxed
+  if (issymbol(function, ADD)) {
+    total_t t = { 0, 0, 0.0, false, false };
+    totaladd(REDUCE, &t, acc);
+    while (seqnext(REDUCE, &s, &item)) totaladd(REDUCE, &t, (key != NULL) ? call1(REDUCE, &k, item, env) : item);
+    if (key != NULL) pop(GCStack);
+    return totalresult(REDUCE, &t);
+  }
+  push(acc, GCStack);
+  object *state = GCStack; // Keeps the value so far
+  callinit(REDUCE, &f, function, 2);
+  while (seqnext(REDUCE, &s, &item)) {
+    if (key != NULL) item = call1(REDUCE, &k, item, env);
+    acc = call2(REDUCE, &f, acc, item, env);
+    car(state) = acc;
+  }
+  pop(GCStack); pop(GCStack);
+  if (key != NULL) pop(GCStack);
+  return acc;
+}
+
+object *fn_countif (object *args, object *env) {
+  object *item;
+  seq_t s;
+  seqinit(COUNTIF, &s, second(args), env);
+  call_t f;
+  callinit(COUNTIF, &f, first(args), 1);
+  int count = 0;
+  while (seqnext(COUNTIF, &s, &item)) {
+    if (call1(COUNTIF, &f, item, env) != nil) count++;
+  }
+  pop(GCStack);
+  return number(count);
+}
+
+object *fn_findif (object *args, object *env) {
+  object *item;
+  seq_t s;
+  seqinit(FINDIF, &s, second(args), env);
+  call_t f;
+  callinit(FINDIF, &f, first(args), 1);
+  while (seqnext(FINDIF, &s, &item)) {
+    if (call1(FINDIF, &f, item, env) != nil) { pop(GCStack); return item; }
+  }
+  pop(GCStack);
+  return nil;
+}
+
+// The test defaults to eq; eq and equal are done in C
+object *fn_position (object *args, object *env) {
+  object *x = first(args), *test = NULL, *item;
+  object *opts = cddr(args);
+  if (opts != NULL) {
+    if (!issymbol(first(opts), TEST)) error(POSITION, PSTR("argument not recognised"), first(opts));
+    if (cdr(opts) == NULL) error(POSITION, PSTR("keyword has no value"), first(opts));
+    test = second(opts);
+    if (issymbol(test, EQ)) test = NULL;
+  }
+  bool equalp = issymbol(test, EQUAL);
+  seq_t s;
+  seqinit(POSITION, &s, second(args), env);
+  call_t f;
+  if (test != NULL && !equalp) callinit(POSITION, &f, test, 2);
+  int index = 0;
+  bool found = false;
+  while (!found && seqnext(POSITION, &s, &item)) {
+    if (test == NULL) found = eq(x, item);
+    else if (equalp) found = equal(x, item);
+    else found = (call2(POSITION, &f, x, item, env) != nil);
+    if (!found) index++;
+  }
+  if (test != NULL && !equalp) pop(GCStack);
+  return found ? number(index) : nil;
+}
+
+#define SEQMAX 4 // Sequences given to every or some
+
+// Returns the first result of the predicate that isn't nil, or with every set, nil as soon as a result is nil
+object *everysome (symbol_t name, object *args, object *env, bool every) {
+  seq_t seqs[SEQMAX];
+  int n = 0;
+  for (object *list = cdr(args); list != NULL; list = cdr(list)) seqinit(name, &seqs[n++], car(list), env);
+  call_t f;
+  callinit(name, &f, first(args), n);
+  object *result = every ? tee : nil;
+  while (true) {
+    object *fargs = callargs(&f), *arg = fargs, *item;
+    bool fresh = (f.args == NULL);
+    if (fresh) push(fargs, GCStack); // A generator can collect garbage before the list is complete
+    for (int i=0; i<n; i++) {
+      if (!seqnext(name, &seqs[i], &item)) {
+        if (fresh) pop(GCStack);
+        pop(GCStack);
+        return result;
+      }
+      car(arg) = item; arg = cdr(arg);
+    }
+    if (fresh) pop(GCStack);
+    result = callfunction(name, &f, fargs, env);
+    if (every ? (result == nil) : (result != nil)) break;
+  }
+  pop(GCStack);
+  return result;
+}
+
+object *fn_every (object *args, object *env) {
+  return everysome(EVERY, args, env, true);
+}
+
+object *fn_some (object *args, object *env) {
+  return everysome(SOME, args, env, false);
+}
+
+// Generators
+
+object *fn_makegenerator (object *args, object *env) {
+  (void) env;
+  return makegenerator(MAKEGENERATOR, first(args), NULL, NULL);
+}
+
+object *fn_next (object *args, object *env) {
+  return gennext(NEXT, checkgenerator(NEXT, first(args)), env);
+}
+
+object *fn_genmap (object *args, object *env) {
+  (void) env;
+  return makegenerator(GENMAP, first(args), checkgenerator(GENMAP, second(args)), NULL);
+}
+
+object *fn_genfilter (object *args, object *env) {
+  (void) env;
+  return makegenerator(GENFILTER, first(args), checkgenerator(GENFILTER, second(args)), NULL);
+}
+
+object *fn_gentake (object *args, object *env) {
+  (void) env;
+  int n = checkinteger(GENTAKE, first(args));
+  return makegenerator(GENTAKE, NULL, checkgenerator(GENTAKE, second(args)), number(n));
+}
+
+// Ring buffers
+
+object *fn_makering (object *args, object *env) {
+  int capacity = checkinteger(MAKERING, first(args)), kind = RINGINTEGER;
+  object *options = cdr(args);
+  while (options != NULL) {
+    object *var = first(options);
+    if (!issymbol(var, ELEMENTTYPE) || cdr(options) == NULL) error(MAKERING, PSTR("argument not recognised"), var);
+    object *type = second(options);
+    if (issymbol(type, FLOATFN)) kind = RINGFLOAT;
+    else if (issymbol(type, FIXEDFN)) kind = RINGFIXED;
+    else if (symbolp(type) && strcmp(symbolname(type->name), "integer") == 0) kind = RINGINTEGER;
+    else error(MAKERING, PSTR("element type not supported"), type);
+    options = cddr(options);
+  }
+  return makering(MAKERING, capacity, kind, args, env);
+}
+
+object *fn_ringpush (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGPUSH, second(args)));
+  uint32_t w = ringword(RINGPUSH, r, first(args));
+  object *dropped = nil;
+  if (r->count == r->capacity) dropped = ringobject(r, ringpop(r));
+  ringpush(r, w);
+  return dropped;
+}
+
+object *fn_ringpop (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGPOP, first(args)));
+  if (r->count == 0) return nil;
+  return ringobject(r, ringpop(r));
+}
+
+object *fn_ringref (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGREF, first(args)));
+  int i = checkinteger(RINGREF, second(args));
+  if (i < 0 || (uint32_t)i >= r->count) error(RINGREF, PSTR("index out of range"), second(args));
+  return ringobject(r, ringdata(r)[ringindex(r, r->first + i)]);
+}
+
+object *fn_ringlength (object *args, object *env) {
+  (void) env;
+  return number(ringblock(checkring(RINGLENGTH, first(args)))->count);
+}
+
+object *fn_ringsum (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGSUM, first(args)));
+  if (r->kind == RINGFLOAT) return makefloat(r->sum.f);
+  if (r->kind == RINGFIXED) return makefixed(fixedsat(r->sum.i));
+  if (r->sum.i < INT_MIN || r->sum.i > INT_MAX) return makefloat((float)r->sum.i);
+  return number(r->sum.i);
+}
+
+object *fn_ringmean (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGMEAN, first(args)));
+  int64_t n = r->count;
+  if (n == 0) return nil;
+  if (r->kind == RINGFLOAT) return makefloat(r->sum.f/n);
+  if (r->kind == RINGINTEGER) return makefloat((double)r->sum.i/n);
+  int64_t half = (r->sum.i < 0) ? -n/2 : n/2;
+  return makefixed((r->sum.i + half)/n);
+}
+
+object *ringextreme (symbol_t name, object *args, bool max) {
+  ring_t *r = ringblock(checkring(name, first(args)));
+  deque_t *d = max ? &r->max : &r->min;
+  if (d->count == 0) return nil;
+  uint32_t *slots = ringdata(r) + (max ? 1 : 2)*r->capacity;
+  return ringobject(r, ringdata(r)[slots[d->first]]);
+}
+
+object *fn_ringmin (object *args, object *env) {
+  (void) env;
+  return ringextreme(RINGMIN, args, false);
+}
+
+object *fn_ringmax (object *args, object *env) {
+  (void) env;
+  return ringextreme(RINGMAX, args, true);
+}
+
+object *fn_ringvariance (object *args, object *env) {
+  (void) env;
+  ring_t *r = ringblock(checkring(RINGVARIANCE, first(args)));
+  if (r->count == 0) return nil;
+  double v = ringvariance(r);
+  if (v < 0) v = 0; // Rounding
+  if (r->kind == RINGFIXED) return makefixed(fixedsat((int64_t)(v/FIXEDONE + 0.5)));
+  return makefloat(v);
+}
+
+// Hash tables
+
+object *fn_makehashtable (object *args, object *env) {
+  (void) env;
+  object *test = symbol(EQ);
+  int size = 0;
+  hashoptions(MAKEHASHTABLE, args, &size, &test);
+  return makehashtable(size, test);
+}
+
+object *fn_gethash (object *args, object *env) {
+  (void) env;
+  object *table = checkhashtable(GETHASH, second(args));
+  return gethash(first(args), table, (cddr(args) != NULL) ? third(args) : nil);
 }
 
-object *fn_append (object *args, object *env) {
+object *fn_remhash (object *args, object *env) {
   (void) env;
-  object *head = NULL;
-  object *tail;
-  while (args != NULL) {
-    object *list = first(args);
-    if (!listp(list)) error(APPEND, notalist, list);
-    while (consp(list)) {
-      object *obj = cons(car(list), cdr(list));
-      if (head == NULL) head = obj;
-      else cdr(tail) = obj;
-      tail = obj;
-      list = cdr(list);
-      if (cdr(args) != NULL && improperp(list)) error(APPEND, notproper, first(args));
-    }
-    args = cdr(args);
-  }
-  return head;
+  object *table = checkhashtable(REMHASH, second(args));
+  return remhash(first(args), table) ? tee : nil;
 }
 
-object *fn_mapc (object *args, object *env) {
+object *fn_maphash (object *args, object *env) {
   object *function = first(args);
-  args = cdr(args);
-  object *result = first(args);
-  object *params = cons(NULL, NULL);
-  push(params,GCStack);
-  // Make parameters
-  while (true) {
-    object *tailp = params;
-    object *lists = args;
-    while (lists != NULL) {
-      object *list = car(lists);
-      if (list == NULL) {
-         pop(GCStack);
-         return result;
-      }
-      if (improperp(list)) error(MAPC, notproper, list);
-      object *obj = cons(first(list),NULL);
-      car(lists) = cdr(list);
-      cdr(tailp) = obj; tailp = obj;
-      lists = cdr(lists);
-    }
-    apply(MAPC, function, cdr(params), env);
+  object *table = checkhashtable(MAPHASH, second(args));
+  object *slots = hashfield(table, HASHSLOTS);
+  push(slots, GCStack); // Keep the pairs if the function makes the table grow
+  int capacity = hashcapacity(slots);
+  for (int i=0; i<capacity; i++) {
+    object *pair = *arrayref(slots, i, capacity);
+    if (consp(pair)) apply(MAPHASH, function, cons(car(pair), cons(cdr(pair), NULL)), env);
   }
+  pop(GCStack);
+  return nil;
 }
 
-void mapcarfun (object *result, object **tail) {
-  object *obj = cons(result,NULL);
-  cdr(*tail) = obj; *tail = obj;
+object *fn_sxhash (object *args, object *env) {
+  (void) env;
+  return number(sxhash(first(args), HASHDEPTH) & 0x7FFFFFFF);
 }
 
-void mapcanfun (object *result, object **tail) {
-  while (consp(result)) {
-    cdr(*tail) = result; *tail = result;
-    result = cdr(result);
-  }
-  if (result != NULL) error(MAPCAN, resultproper, result);
+object *fn_hashtablecount (object *args, object *env) {
+  (void) env;
+  object *table = checkhashtable(HASHTABLECOUNT, first(args));
+  return number(hashfield(table, HASHCOUNT)->integer);
 }
 
-object *mapcarcan (symbol_t name, object *args, object *env, mapfun_t fun) {
-  object *function = first(args);
-  args = cdr(args);
-  object *params = cons(NULL, NULL);
-  push(params,GCStack);
-  object *head = cons(NULL, NULL);
-  push(head,GCStack);
-  object *tail = head;
-  // Make parameters
-  while (true) {
-    object *tailp = params;
-    object *lists = args;
-    while (lists != NULL) {
-      object *list = car(lists);
-      if (list == NULL) {
-         pop(GCStack);
-         pop(GCStack);
-         return cdr(head);
-      }
-      if (improperp(list)) error(name, notproper, list);
-      object *obj = cons(first(list),NULL);
-      car(lists) = cdr(list);
-      cdr(tailp) = obj; tailp = obj;
-      lists = cdr(lists);
-    }
-    object *result = apply(name, function, cdr(params), env);
-    fun(result, &tail);
-  }
-}
+// Memoized functions
 
-object *fn_mapcar (object *args, object *env) {
-  return mapcarcan(MAPCAR, args, env, mapcarfun);
+object *fn_memoize (object *args, object *env) {
+  (void) env;
+  object *function = first(args), *pair = NULL;
+  if (symbolp(function)) {
+    pair = value(function->name, GlobalEnv);
+    if (pair == NULL) error(MEMOIZE, PSTR("undefined"), function);
+    function = cdr(pair);
+  }
+  if (memop(function)) function = second(function);
+  if (!(consp(function) && (issymbol(car(function), LAMBDA) || issymbol(car(function), CLOSURE))))
+    error(MEMOIZE, PSTR("argument is not a function"), first(args));
+  object *test = symbol(EQ);
+  int size = MEMOSIZE;
+  hashoptions(MEMOIZE, cdr(args), &size, &test);
+  object *memo = makememo(function, size, test);
+  if (pair == NULL) return memo;
+  cdr(globalpair(pair)) = memo;
+  return first(args);
 }
 
-object *fn_mapcan (object *args, object *env) {
-  return mapcarcan(MAPCAN, args, env, mapcanfun);
+object *fn_memostats (object *args, object *env) {
+  (void) env;
+  object *memo = first(args);
+  if (symbolp(memo)) {
+    object *pair = value(memo->name, GlobalEnv);
+    if (pair != NULL) memo = cdr(pair);
+  }
+  if (!memop(memo)) error(MEMOSTATS, PSTR("argument is not memoized"), first(args));
+  object *table = memofield(memo, MEMOTABLE);
+  object *stats = cons(number(memofield(memo, MEMOSIZE_)->integer), NULL);
+  push(number(hashfield(table, HASHCOUNT)->integer), stats);
+  for (int field=MEMOEVICTIONS; field>=MEMOHITS; field--) push(number(memofield(memo, field)->integer), stats);
+  return stats;
 }
 
 // Arithmetic functions
@@ -2780,12 +5575,21 @@ object *add_floats (object *args, float fresult) {
   return makefloat(fresult);
 }
 
+object *add_fixed (object *args, int32_t q) {
+  while (args != NULL) {
+    q = fixedsat((int64_t)q + checkfixed(ADD, car(args)));
+    args = cdr(args);
+  }
+  return makefixed(q);
+}
+
 object *fn_add (object *args, object *env) {
   (void) env;
   int result = 0;
   while (args != NULL) {
     object *arg = car(args);
     if (floatp(arg)) return add_floats(args, (float)result);
+    else if (fixedp(arg)) return add_fixed(args, fixedsat((int64_t)result * FIXEDONE));
     else if (integerp(arg)) {
       int val = arg->integer;
       if (val < 1) { if (INT_MIN - val > result) return add_floats(args, (float)result); }
@@ -2806,12 +5610,21 @@ object *subtract_floats (object *args, float fresult) {
   return makefloat(fresult);
 }
 
+object *subtract_fixed (object *args, int32_t q) {
+  while (args != NULL) {
+    q = fixedsat((int64_t)q - checkfixed(SUBTRACT, car(args)));
+    args = cdr(args);
+  }
+  return makefixed(q);
+}
+
 object *negate (object *arg) {
   if (integerp(arg)) {
     int result = arg->integer;
     if (result == INT_MIN) return makefloat(-result);
     else return number(-result);
   } else if (floatp(arg)) return makefloat(-(arg->single_float));
+  else if (fixedp(arg)) return makefixed(fixedsat(-(int64_t)arg->integer));
   else error(SUBTRACT, notanumber, arg);
   return nil;
 }
@@ -2822,11 +5635,13 @@ object *fn_subtract (object *args, object *env) {
   args = cdr(args);
   if (args == NULL) return negate(arg);
   else if (floatp(arg)) return subtract_floats(args, arg->single_float);
+  else if (fixedp(arg)) return subtract_fixed(args, arg->integer);
   else if (integerp(arg)) {
     int result = arg->integer;
     while (args != NULL) {
       arg = car(args);
       if (floatp(arg)) return subtract_floats(args, result);
+      else if (fixedp(arg)) return subtract_fixed(args, fixedsat((int64_t)result * FIXEDONE));
       else if (integerp(arg)) {
         int val = (car(args))->integer;
         if (val < 1) { if (INT_MAX + val < result) return subtract_floats(args, result); }
@@ -2849,12 +5664,21 @@ object *multiply_floats (object *args, float fresult) {
   return makefloat(fresult);
 }
 
+object *multiply_fixed (object *args, int32_t q) {
+  while (args != NULL) {
+    q = fixedmultiply(MULTIPLY, q, car(args));
+    args = cdr(args);
+  }
+  return makefixed(q);
+}
+
 object *fn_multiply (object *args, object *env) {
   (void) env;
   int result = 1;
   while (args != NULL){
     object *arg = car(args);
     if (floatp(arg)) return multiply_floats(args, result);
+    else if (fixedp(arg)) return multiply_fixed(cdr(args), fixedsat((int64_t)arg->integer * result));
     else if (integerp(arg)) {
       int64_t val = result * (int64_t)(arg->integer);
       if ((val > INT_MAX) || (val < INT_MIN)) return multiply_floats(args, result);
@@ -2876,13 +5700,22 @@ object *divide_floats (object *args, float fresult) {
   return makefloat(fresult);
 }
 
+object *divide_fixed (object *args, int32_t q) {
+  while (args != NULL) {
+    q = fixeddivide(DIVIDE, q, car(args));
+    args = cdr(args);
+  }
+  return makefixed(q);
+}
+
 object *fn_divide (object *args, object *env) {
   (void) env;
   object* arg = first(args);
   args = cdr(args);
   // One argument
   if (args == NULL) {
-    if (floatp(arg)) {
+    if (fixedp(arg)) return makefixed(fixeddivide(DIVIDE, FIXEDONE, arg));
+    else if (floatp(arg)) {
       float f = arg->single_float;
       if (f == 0.0) error2(DIVIDE, PSTR("division by zero"));
       return makefloat(1.0 / f);
@@ -2895,16 +5728,22 @@ object *fn_divide (object *args, object *env) {
   }
   // Multiple arguments
   if (floatp(arg)) return divide_floats(args, arg->single_float);
+  else if (fixedp(arg)) return divide_fixed(args, arg->integer);
   else if (integerp(arg)) {
     int result = arg->integer;
     while (args != NULL) {
       arg = car(args);
       if (floatp(arg)) {
         return divide_floats(args, result);
+      } else if (fixedp(arg)) {
+        return divide_fixed(args, fixedsat((int64_t)result * FIXEDONE));
       } else if (integerp(arg)) {
         int i = arg->integer;
         if (i == 0) error2(DIVIDE, PSTR("division by zero"));
-        if ((result % i) != 0) return divide_floats(args, result);
+        if ((result % i) != 0) {
+          if (fixedargs(args)) return divide_fixed(args, fixedsat((int64_t)result * FIXEDONE));
+          return divide_floats(args, result);
+        }
         if ((result == INT_MIN) && (i == -1)) return divide_floats(args, result);
         result = result / i;
         args = cdr(args);
@@ -2926,6 +5765,13 @@ object *fn_mod (object *args, object *env) {
     int remainder = dividend % divisor;
     if ((dividend<0) != (divisor<0)) remainder = remainder + divisor;
     return number(remainder);
+  } else if (fixedp(arg1) || fixedp(arg2)) {
+    int64_t divisor = fixedvalue(MOD, arg2);
+    if (divisor == 0) error2(MOD, PSTR("division by zero"));
+    int64_t dividend = fixedvalue(MOD, arg1);
+    int64_t remainder = dividend % divisor;
+    if (remainder != 0 && (dividend<0) != (divisor<0)) remainder = remainder + divisor;
+    return makefixed(fixedsat(remainder));
   } else {
     float fdivisor = checkintfloat(MOD, arg2);
     if (fdivisor == 0.0) error2(MOD, PSTR("division by zero"));
@@ -2940,6 +5786,7 @@ object *fn_oneplus (object *args, object *env) {
   (void) env;
   object* arg = first(args);
   if (floatp(arg)) return makefloat((arg->single_float) + 1.0);
+  else if (fixedp(arg)) return makefixed(fixedsat((int64_t)arg->integer + FIXEDONE));
   else if (integerp(arg)) {
     int result = arg->integer;
     if (result == INT_MAX) return makefloat((arg->integer) + 1.0);
@@ -2952,6 +5799,7 @@ object *fn_oneminus (object *args, object *env) {
   (void) env;
   object* arg = first(args);
   if (floatp(arg)) return makefloat((arg->single_float) - 1.0);
+  else if (fixedp(arg)) return makefixed(fixedsat((int64_t)arg->integer - FIXEDONE));
   else if (integerp(arg)) {
     int result = arg->integer;
     if (result == INT_MIN) return makefloat((arg->integer) - 1.0);
@@ -2964,6 +5812,7 @@ object *fn_abs (object *args, object *env) {
   (void) env;
   object *arg = first(args);
   if (floatp(arg)) return makefloat(abs(arg->single_float));
+  else if (fixedp(arg)) return makefixed(fixedsat(llabs((int64_t)arg->integer)));
   else if (integerp(arg)) {
     int result = arg->integer;
     if (result == INT_MIN) return makefloat(abs((float)result));
@@ -2989,6 +5838,8 @@ object *fn_maxfn (object *args, object *env) {
     object *arg = car(args);
     if (integerp(result) && integerp(arg)) {
       if ((arg->integer) > (result->integer)) result = arg;
+    } else if (fixedp(result) || fixedp(arg)) {
+      if (fixedcompare(MAXFN, arg, result) > 0) result = arg;
     } else if ((checkintfloat(MAXFN, arg) > checkintfloat(MAXFN, result))) result = arg;
     args = cdr(args);
   }
@@ -3003,6 +5854,8 @@ object *fn_minfn (object *args, object *env) {
     object *arg = car(args);
     if (integerp(result) && integerp(arg)) {
       if ((arg->integer) < (result->integer)) result = arg;
+    } else if (fixedp(result) || fixedp(arg)) {
+      if (fixedcompare(MINFN, arg, result) < 0) result = arg;
     } else if ((checkintfloat(MINFN, arg) < checkintfloat(MINFN, result))) result = arg;
     args = cdr(args);
   }
@@ -3021,6 +5874,8 @@ object *fn_noteq (object *args, object *env) {
       object *arg2 = first(nargs);
       if (integerp(arg1) && integerp(arg2)) {
         if ((arg1->integer) == (arg2->integer)) return nil;
+      } else if (fixedp(arg1) || fixedp(arg2)) {
+        if (fixedcompare(NOTEQ, arg1, arg2) == 0) return nil;
       } else if ((checkintfloat(NOTEQ, arg1) == checkintfloat(NOTEQ, arg2))) return nil;
       nargs = cdr(nargs);
     }
@@ -3037,6 +5892,8 @@ object *fn_numeq (object *args, object *env) {
     object *arg2 = first(args);
     if (integerp(arg1) && integerp(arg2)) {
       if (!((arg1->integer) == (arg2->integer))) return nil;
+    } else if (fixedp(arg1) || fixedp(arg2)) {
+      if (!(fixedcompare(NUMEQ, arg1, arg2) == 0)) return nil;
     } else if (!(checkintfloat(NUMEQ, arg1) == checkintfloat(NUMEQ, arg2))) return nil;
     arg1 = arg2;
     args = cdr(args);
@@ -3052,6 +5909,8 @@ object *fn_less (object *args, object *env) {
     object *arg2 = first(args);
     if (integerp(arg1) && integerp(arg2)) {
       if (!((arg1->integer) < (arg2->integer))) return nil;
+    } else if (fixedp(arg1) || fixedp(arg2)) {
+      if (!(fixedcompare(LESS, arg1, arg2) < 0)) return nil;
     } else if (!(checkintfloat(LESS, arg1) < checkintfloat(LESS, arg2))) return nil;
     arg1 = arg2;
     args = cdr(args);
@@ -3067,6 +5926,8 @@ object *fn_lesseq (object *args, object *env) {
     object *arg2 = first(args);
     if (integerp(arg1) && integerp(arg2)) {
       if (!((arg1->integer) <= (arg2->integer))) return nil;
+    } else if (fixedp(arg1) || fixedp(arg2)) {
+      if (!(fixedcompare(LESSEQ, arg1, arg2) <= 0)) return nil;
     } else if (!(checkintfloat(LESSEQ, arg1) <= checkintfloat(LESSEQ, arg2))) return nil;
     arg1 = arg2;
     args = cdr(args);
@@ -3082,6 +5943,8 @@ object *fn_greater (object *args, object *env) {
     object *arg2 = first(args);
     if (integerp(arg1) && integerp(arg2)) {
       if (!((arg1->integer) > (arg2->integer))) return nil;
+    } else if (fixedp(arg1) || fixedp(arg2)) {
+      if (!(fixedcompare(GREATER, arg1, arg2) > 0)) return nil;
     } else if (!(checkintfloat(GREATER, arg1) > checkintfloat(GREATER, arg2))) return nil;
     arg1 = arg2;
     args = cdr(args);
@@ -3097,6 +5960,8 @@ object *fn_greatereq (object *args, object *env) {
     object *arg2 = first(args);
     if (integerp(arg1) && integerp(arg2)) {
       if (!((arg1->integer) >= (arg2->integer))) return nil;
+    } else if (fixedp(arg1) || fixedp(arg2)) {
+      if (!(fixedcompare(GREATEREQ, arg1, arg2) >= 0)) return nil;
     } else if (!(checkintfloat(GREATEREQ, arg1) >= checkintfloat(GREATEREQ, arg2))) return nil;
     arg1 = arg2;
     args = cdr(args);
@@ -3108,7 +5973,7 @@ object *fn_plusp (object *args, object *env) {
   (void) env;
   object *arg = first(args);
   if (floatp(arg)) return ((arg->single_float) > 0.0) ? tee : nil;
-  else if (integerp(arg)) return ((arg->integer) > 0) ? tee : nil;
+  else if (integerp(arg) || fixedp(arg)) return ((arg->integer) > 0) ? tee : nil;
   else error(PLUSP, notanumber, arg);
   return nil;
 }
@@ -3117,7 +5982,7 @@ object *fn_minusp (object *args, object *env) {
   (void) env;
   object *arg = first(args);
   if (floatp(arg)) return ((arg->single_float) < 0.0) ? tee : nil;
-  else if (integerp(arg)) return ((arg->integer) < 0) ? tee : nil;
+  else if (integerp(arg) || fixedp(arg)) return ((arg->integer) < 0) ? tee : nil;
   else error(MINUSP, notanumber, arg);
   return nil;
 }
@@ -3126,7 +5991,7 @@ object *fn_zerop (object *args, object *env) {
   (void) env;
   object *arg = first(args);
   if (floatp(arg)) return ((arg->single_float) == 0.0) ? tee : nil;
-  else if (integerp(arg)) return ((arg->integer) == 0) ? tee : nil;
+  else if (integerp(arg) || fixedp(arg)) return ((arg->integer) == 0) ? tee : nil;
   else error(ZEROP, notanumber, arg);
   return nil;
 }
@@ -3153,7 +6018,7 @@ object *fn_integerp (object *args, object *env) {
 object *fn_numberp (object *args, object *env) {
   (void) env;
   object *arg = first(args);
-  return (integerp(arg) || floatp(arg)) ? tee : nil;
+  return (integerp(arg) || floatp(arg) || fixedp(arg)) ? tee : nil;
 }
 
 // Floating-point functions
@@ -3161,6 +6026,8 @@ object *fn_numberp (object *args, object *env) {
 object *fn_floatfn (object *args, object *env) {
   (void) env;
   object *arg = first(args);
+  if (fixedp(arg)) return makefloat((float)(arg->integer) / FIXEDONE);
+  if (!integerp(arg) && !floatp(arg)) error(FLOATFN, notanumber, arg);
   return (floatp(arg)) ? arg : makefloat((float)(arg->integer));
 }
 
@@ -3169,6 +6036,26 @@ object *fn_floatp (object *args, object *env) {
   return floatp(first(args)) ? tee : nil;
 }
 
+object *fn_fixedfn (object *args, object *env) {
+  (void) env;
+  object *arg = first(args);
+  if (fixedp(arg)) return arg;
+  else if (integerp(arg)) return makefixed(fixedsat((int64_t)arg->integer * FIXEDONE));
+  else if (floatp(arg)) {
+    float f = arg->single_float * FIXEDONE;
+    if (isnan(f)) error(FIXEDFN, PSTR("not a number"), arg);
+    if (f >= 2147483647.0f) return makefixed(INT_MAX);
+    if (f <= -2147483648.0f) return makefixed(INT_MIN);
+    return makefixed(lroundf(f));
+  } else error(FIXEDFN, notanumber, arg);
+  return nil;
+}
+
+object *fn_fixedp (object *args, object *env) {
+  (void) env;
+  return fixedp(first(args)) ? tee : nil;
+}
+
 object *fn_sin (object *args, object *env) {
   (void) env;
   return makefloat(sin(checkintfloat(SIN, first(args))));
@@ -3261,6 +6148,7 @@ object *fn_expt (object *args, object *env) {
 object *fn_ceiling (object *args, object *env) {
   (void) env;
   object *arg = first(args);
+  if (fixedargs(args)) return fixedround(CEILING, args);
   args = cdr(args);
   if (args != NULL) return number(ceil(checkintfloat(CEILING, arg) / checkintfloat(CEILING, first(args))));
   else return number(ceil(checkintfloat(CEILING, arg)));
@@ -3269,6 +6157,7 @@ object *fn_ceiling (object *args, object *env) {
 object *fn_floor (object *args, object *env) {
   (void) env;
   object *arg = first(args);
+  if (fixedargs(args)) return fixedround(FLOOR, args);
   args = cdr(args);
   if (args != NULL) return number(floor(checkintfloat(FLOOR, arg) / checkintfloat(FLOOR, first(args))));
   else return number(floor(checkintfloat(FLOOR, arg)));
@@ -3277,6 +6166,7 @@ object *fn_floor (object *args, object *env) {
 object *fn_truncate (object *args, object *env) {
   (void) env;
   object *arg = first(args);
+  if (fixedargs(args)) return fixedround(TRUNCATE, args);
   args = cdr(args);
   if (args != NULL) return number((int)(checkintfloat(TRUNCATE, arg) / checkintfloat(TRUNCATE, first(args))));
   else return number((int)(checkintfloat(TRUNCATE, arg)));
@@ -3289,11 +6179,175 @@ int myround (float number) {
 object *fn_round (object *args, object *env) {
   (void) env;
   object *arg = first(args);
+  if (fixedargs(args)) return fixedround(ROUND, args);
   args = cdr(args);
   if (args != NULL) return number(myround(checkintfloat(ROUND, arg) / checkintfloat(ROUND, first(args))));
   else return number(myround(checkintfloat(ROUND, arg)));
 }
 
+// Array kernels
+
+// Kernels allocate without collecting, so they collect first if they may need more cells than are free
+void kernelspace (object *args, object *env, unsigned int cells) {
+  if (Freespace < cells) gc(args, env);
+}
+
+// The sum and product of two numbers, following + and *
+object *addnumbers (symbol_t name, object *arg1, object *arg2) {
+  if (integerp(arg1) && integerp(arg2)) {
+    int64_t n = (int64_t)arg1->integer + arg2->integer;
+    return (n < INT_MIN || n > INT_MAX) ? makefloat((float)n) : number(n);
+  }
+  if (fixedp(arg1) || fixedp(arg2)) return makefixed(fixedsat(fixedvalue(name, arg1) + fixedvalue(name, arg2)));
+  return makefloat(checkintfloat(name, arg1) + checkintfloat(name, arg2));
+}
+
+object *multiplynumbers (symbol_t name, object *arg1, object *arg2) {
+  if (integerp(arg1) && integerp(arg2)) {
+    int64_t n = (int64_t)arg1->integer * arg2->integer;
+    return (n < INT_MIN || n > INT_MAX) ? makefloat((float)n) : number(n);
+  }
+  if (fixedp(arg1)) return makefixed(fixedmultiply(name, arg1->integer, arg2));
+  if (fixedp(arg2)) return makefixed(fixedmultiply(name, arg2->integer, arg1));
+  return makefloat(checkintfloat(name, arg1) * checkintfloat(name, arg2));
+}
+
+object *fn_arraymap (object *args, object *env) {
+  object *function = first(args), *array = second(args);
+  int size = arraysize(ARRAYMAP, array);
+  kernelspace(args, env, 3*size + 4); // Tree, argument lists, and results
+  object *dims = NULL, *tail = NULL;
+  for (object *d = cddr(array); d != NULL; d = cdr(d)) {
+    object *cell = cons(car(d), NULL);
+    if (tail == NULL) dims = cell; else cdr(tail) = cell;
+    tail = cell;
+  }
+  object *result = makearray(ARRAYMAP, dims, NULL, false);
+  push(result, GCStack);
+  call_t f;
+  callinit(ARRAYMAP, &f, function, 1);
+  cursor_t in, out;
+  cursorinit(&in, array, size); cursorinit(&out, result, size);
+  for (int i=0; i<size; i++) {
+    cursorset(&in, i); cursorset(&out, i);
+    cursorelement(&out) = call1(ARRAYMAP, &f, cursorelement(&in), env);
+  }
+  pop(GCStack); pop(GCStack);
+  return result;
+}
+
+object *fn_arrayadd (object *args, object *env) {
+  object *dest = first(args), *array1 = second(args), *array2 = third(args);
+  int size = samearrays(ARRAYADD, array1, array2);
+  samearrays(ARRAYADD, dest, array1);
+  checkwritable(ARRAYADD, dest);
+  kernelspace(args, env, size);
+  cursor_t in1, in2, out;
+  cursorinit(&in1, array1, size); cursorinit(&in2, array2, size); cursorinit(&out, dest, size);
+  for (int i=0; i<size; i++) {
+    cursorset(&in1, i); cursorset(&in2, i); cursorset(&out, i);
+    cursorelement(&out) = addnumbers(ARRAYADD, cursorelement(&in1), cursorelement(&in2));
+  }
+  return dest;
+}
+
+object *fn_arrayscale (object *args, object *env) {
+  object *array = first(args), *k = second(args);
+  int size = arraysize(ARRAYSCALE, array);
+  checkwritable(ARRAYSCALE, array);
+  kernelspace(args, env, size);
+  cursor_t c;
+  cursorinit(&c, array, size);
+  for (int i=0; i<size; i++) {
+    cursorset(&c, i);
+    cursorelement(&c) = multiplynumbers(ARRAYSCALE, cursorelement(&c), k);
+  }
+  return array;
+}
+
+object *fn_dot (object *args, object *env) {
+  (void) env;
+  object *array1 = first(args), *array2 = second(args);
+  int size = samearrays(DOTFN, array1, array2);
+  total_t t = { 0, 0, 0.0, false, false };
+  cursor_t in1, in2;
+  cursorinit(&in1, array1, size); cursorinit(&in2, array2, size);
+  for (int i=0; i<size; i++) {
+    cursorset(&in1, i); cursorset(&in2, i);
+    totalmultiply(DOTFN, &t, cursorelement(&in1), cursorelement(&in2));
+  }
+  return totalresult(DOTFN, &t);
+}
+
+object *fn_arraysum (object *args, object *env) {
+  (void) env;
+  object *array = first(args);
+  int size = arraysize(ARRAYSUM, array);
+  total_t t = { 0, 0, 0.0, false, false };
+  cursor_t c;
+  cursorinit(&c, array, size);
+  for (int i=0; i<size; i++) {
+    cursorset(&c, i);
+    totaladd(ARRAYSUM, &t, cursorelement(&c));
+  }
+  return totalresult(ARRAYSUM, &t);
+}
+
+// Returns the element that compares lowest, or highest for array-max, or nil for an empty array
+object *arrayextreme (symbol_t name, object *array) {
+  int size = arraysize(name, array), sign = (name == ARRAYMAX) ? -1 : 1;
+  cursor_t c;
+  cursorinit(&c, array, size);
+  object *result = NULL;
+  for (int i=0; i<size; i++) {
+    cursorset(&c, i);
+    object *arg = cursorelement(&c);
+    int compare = -sign;
+    if (result == NULL) {
+      if (!(integerp(arg) || fixedp(arg) || floatp(arg))) error(name, notanumber, arg);
+    } else if (integerp(arg) && integerp(result)) compare = (arg->integer > result->integer) - (arg->integer < result->integer);
+    else if (fixedp(arg) || fixedp(result)) compare = fixedcompare(name, arg, result);
+    else {
+      float a = checkintfloat(name, arg), b = checkintfloat(name, result);
+      compare = (a > b) - (a < b);
+    }
+    if (compare * sign < 0) result = arg;
+  }
+  return result;
+}
+
+object *fn_arraymin (object *args, object *env) {
+  (void) env;
+  return arrayextreme(ARRAYMIN, first(args));
+}
+
+object *fn_arraymax (object *args, object *env) {
+  (void) env;
+  return arrayextreme(ARRAYMAX, first(args));
+}
+
+// FIR filter: element n of the result is the sum of kernel[k] * array[n-k], taking array[j] as 0 for j < 0
+object *fn_convolve (object *args, object *env) {
+  object *array = first(args), *kernel = second(args);
+  int size = arraysize(CONVOLVE, array), ksize = arraysize(CONVOLVE, kernel);
+  if (cdr(cddr(array)) != NULL || cdr(cddr(kernel)) != NULL) error2(CONVOLVE, PSTR("arrays must be one-dimensional"));
+  kernelspace(args, env, 2*size);
+  object *result = makearray(CONVOLVE, cons(number(size), NULL), NULL, false);
+  cursor_t in, k, out;
+  cursorinit(&in, array, size); cursorinit(&k, kernel, ksize); cursorinit(&out, result, size);
+  for (int n=0; n<size; n++) {
+    total_t t = { 0, 0, 0.0, false, false };
+    int last = (n < ksize) ? n : ksize - 1;
+    for (int j=0; j<=last; j++) {
+      cursorset(&k, j); cursorset(&in, n - j);
+      totalmultiply(CONVOLVE, &t, cursorelement(&k), cursorelement(&in));
+    }
+    cursorset(&out, n);
+    cursorelement(&out) = totalresult(CONVOLVE, &t);
+  }
+  return result;
+}
+
 // Characters
 
 object *fn_char (object *args, object *env) {
@@ -3360,6 +6414,7 @@ object *fn_stringgreater (object *args, object *env) {
 
 object *fn_sort (object *args, object *env) {
   if (first(args) == NULL) return nil;
+  for (object *cell = first(args); cell != NULL; cell = cdr(cell)) checkwritable(SORT, cell);
   object *list = cons(nil,first(args));
   push(list,GCStack);
   object *predicate = second(args);
@@ -3564,6 +6619,9 @@ object *fn_makunbound (object *args, object *env) {
   (void) env;
   object *var = first(args);
   if (!symbolp(var)) error(MAKUNBOUND, notasymbol, var);
+  #if defined(romlibrary)
+  if (romcell(value(var->name, GlobalEnv))) error(MAKUNBOUND, PSTR("can't unbind library symbol"), var);
+  #endif
   delassoc(var, &GlobalEnv);
   return var;
 }
@@ -3640,6 +6698,12 @@ object *fn_writebyte (object *args, object *env) {
 object *fn_writestring (object *args, object *env) {
   (void) env;
   object *obj = first(args);
+  if (stringp(obj)) {
+    streamops_t ops;
+    streamops(cdr(args), &ops, true);
+    writesequence(WRITESTRING, obj, &ops);
+    return nil;
+  }
   pfun_t pfun = pstreamfun(cdr(args));
   char temp = Flags_;
   clrflag(PRINTREADABLY);
@@ -3651,6 +6715,13 @@ object *fn_writestring (object *args, object *env) {
 object *fn_writeline (object *args, object *env) {
   (void) env;
   object *obj = first(args);
+  if (stringp(obj)) {
+    streamops_t ops;
+    streamops(cdr(args), &ops, true);
+    writesequence(WRITELINE, obj, &ops);
+    pln(ops.pfun);
+    return nil;
+  }
   pfun_t pfun = pstreamfun(cdr(args));
   char temp = Flags_;
   clrflag(PRINTREADABLY);
@@ -3660,6 +6731,21 @@ object *fn_writeline (object *args, object *env) {
   return nil;
 }
 
+object *fn_readsequence (object *args, object *env) {
+  (void) env;
+  streamops_t ops;
+  streamops(cdr(args), &ops, false);
+  return number(readsequence(READSEQUENCE, first(args), &ops));
+}
+
+object *fn_writesequence (object *args, object *env) {
+  (void) env;
+  streamops_t ops;
+  streamops(cdr(args), &ops, true);
+  writesequence(WRITESEQUENCE, first(args), &ops);
+  return first(args);
+}
+
 object *fn_restarti2c (object *args, object *env) {
   (void) env;
   int stream = first(args)->integer;
@@ -3705,6 +6791,96 @@ object *fn_loadimage (object *args, object *env) {
   return number(loadimage(args));
 }
 
+object *fn_checkpoint (object *args, object *env) {
+  if (args != NULL) args = eval(first(args), env);
+  return number(checkpoint(args));
+}
+
+object *fn_kvput (object *args, object *env) {
+  (void) env;
+#if defined(serialflash)
+  kvwrite(KVPUT, first(args), second(args), PUTRECORD);
+  return second(args);
+#else
+  (void) args;
+  error2(KVPUT, PSTR("not available"));
+  return nil;
+#endif
+}
+
+object *fn_kvget (object *args, object *env) {
+  (void) env;
+#if defined(serialflash)
+  int i = kvlookup(KVGET, first(args));
+  if (i == -1) return (cdr(args) != NULL) ? second(args) : nil;
+  uint32_t addr = KVIndex[i].addr;
+  int length = kvread(addr, addr + FLASHPAGE);
+  if (length <= 0) error2(KVGET, PSTR("kv record damaged"));
+  BinBuffer = FlashPage; BinIndex = KVHEADER + FlashPage[2]; BinSize = length;
+  return deserialize(gbinbuffer);
+#else
+  (void) args;
+  error2(KVGET, PSTR("not available"));
+  return nil;
+#endif
+}
+
+object *fn_kvdelete (object *args, object *env) {
+  (void) env;
+#if defined(serialflash)
+  object *key = first(args);
+  if (kvlookup(KVDELETE, key) == -1) return nil;
+  kvwrite(KVDELETE, key, NULL, DELETERECORD);
+  return tee;
+#else
+  (void) args;
+  error2(KVDELETE, PSTR("not available"));
+  return nil;
+#endif
+}
+
+object *fn_serialize (object *args, object *env) {
+  (void) env;
+  object *obj = first(args);
+  args = cdr(args);
+  bool shared = (args != NULL && cdr(args) != NULL && second(args) != NULL);
+  if (args != NULL && first(args) != NULL) {
+    pfun_t pfun = pstreamfun(args);
+    if (pfun == pstr) pfun = pbinstring;
+    serialize(SERIALIZE, obj, pfun, shared);
+    return obj;
+  }
+  object *string = startstring(SERIALIZE);
+  serialize(SERIALIZE, obj, pbinstring, shared);
+  string->cdr = GlobalString;
+  return string;
+}
+
+object *fn_deserialize (object *args, object *env) {
+  (void) env;
+  object *arg = first(args);
+  if (stringp(arg)) {
+    BinChain = cdr(arg); BinShift = (sizeof(int)-1)*8;
+    return deserialize(gbinstring);
+  }
+  return deserialize(gstreamfun(args));
+}
+
+object *fn_checkpointstats (object *args, object *env) {
+  (void) args, (void) env;
+#if defined(serialflash)
+  object *stats = cons(number(FlashWrites), cons(number(FlashErases), NULL));
+  push(number(LOGEND - LOGBASE), stats);
+  push(number(SavedPages ? LogAddr - LogBase : 0), stats);
+  push(number(Checkpoints), stats);
+  push(number(Generation), stats);
+  return stats;
+#else
+  error2(CHECKPOINTSTATS, PSTR("not available"));
+  return nil;
+#endif
+}
+
 object *fn_cls (object *args, object *env) {
   (void) args, (void) env;
   pserial(12);
@@ -3763,6 +6939,7 @@ object *fn_analogwrite (object *args, object *env) {
 object *fn_delay (object *args, object *env) {
   (void) env;
   object *arg1 = first(args);
+  serialflush();
   delay(checkinteger(DELAY, arg1));
   return arg1;
 }
@@ -3775,6 +6952,7 @@ object *fn_millis (object *args, object *env) {
 object *fn_sleep (object *args, object *env) {
   (void) env;
   object *arg1 = first(args);
+  serialflush();
   sleep(checkinteger(SLEEP, arg1));
   return arg1;
 }
@@ -3842,22 +7020,36 @@ object *fn_pprintall (object *args, object *env) {
 #if defined(gfxsupport)
   if (pfun == gfxwrite) ppwidth = GFXPPWIDTH;
 #endif
-  object *globals = GlobalEnv;
-  while (globals != NULL) {
-    object *pair = first(globals);
-    object *var = car(pair);
-    object *val = cdr(pair);
-    pln(pfun);
-    if (consp(val) && symbolp(car(val)) && car(val)->name == LAMBDA) {
-      superprint(cons(symbol(DEFUN), cons(var, cdr(val))), 0, pfun);
-    } else if (consp(val) && car(val)->type == CODE) {
-      superprint(cons(symbol(DEFCODE), cons(var, cdr(val))), 0, pfun);
-    } else {
-      superprint(cons(symbol(DEFVAR), cons(var, cons(quote(val), NULL))), 0, pserial);
+  // The defstruct forms go first, so that variables holding structures read back. Each is printed once,
+  // for the constructor, and defines the predicate and accessors too
+  for (int pass=0; pass<2; pass++) {
+    object *globals = GlobalEnv;
+    while (globals != NULL) {
+      object *pair = first(globals);
+      object *var = car(pair);
+      object *val = cdr(pair);
+      globals = cdr(globals);
+      bool definition = structfunctionp(val) && second(val)->integer == STRUCTMAKE;
+      if (pass == 0 ? !definition : structfunctionp(val)) continue;
+      pln(pfun);
+      if (consp(val) && symbolp(car(val)) && car(val)->name == LAMBDA) {
+        superprint(cons(symbol(DEFUN), cons(var, cdr(val))), 0, pfun);
+      } else if (consp(val) && car(val)->type == CODE) {
+        superprint(cons(symbol(DEFCODE), cons(var, cdr(val))), 0, pfun);
+      } else if (definition) {
+        superprint(cons(symbol(DEFSTRUCT), cddr(val)), 0, pfun);
+      } else if (memop(val) && consp(second(val)) && issymbol(car(second(val)), LAMBDA)) {
+        superprint(cons(symbol(DEFUN), cons(var, cdr(second(val)))), 0, pfun);
+        pln(pfun);
+        object *test = issymbol(hashfield(memofield(val, MEMOTABLE), HASHTEST), EQUAL) ? symbol(EQUAL) : symbol(EQ);
+        superprint(cons(symbol(MEMOIZE), cons(quote(var), cons(symbol(SIZE), cons(memofield(val, MEMOSIZE_),
+          cons(symbol(TEST), cons(quote(test), NULL)))))), 0, pfun);
+      } else {
+        superprint(cons(symbol(DEFVAR), cons(var, cons(quote(val), NULL))), 0, pserial);
+      }
+      pln(pfun);
+      testescape();
     }
-    pln(pfun);
-    testescape();
-    globals = cdr(globals);
   }
   ppwidth = PPWIDTH;
   return symbol(NOTHING);
@@ -3941,14 +7133,93 @@ object *fn_format (object *args, object *env) {
       if (ch == '~') { tilde = true; pad = ' '; width = 0; comma = false; quote = false; }
       else if (!mute) pfun(ch);
     }
-    n++;
+    n++;
+  }
+  if (output == nil) { obj->cdr = GlobalString; return obj; }
+  else return nil;
+}
+
+// LispLibrary
+
+// Index of the defun and defvar forms in LispLibrary, built on first use by scanning the text
+#define LIBRARYINDEXSIZE 64
+
+uint16_t LibraryIndex[LIBRARYINDEXSIZE];
+int LibraryEntries = -1;
+bool LibraryComplete;
+
+int libraryskip (int i) {
+  while (issp(LispLibrary[i])) i++;
+  return i;
+}
+
+bool librarydelimiter (char c) {
+  return c == 0 || c == '(' || c == ')' || issp(c);
+}
+
+// Returns the offset just past the form starting at i
+int libraryform (int i) {
+  int depth = 0;
+  do {
+    char c = LispLibrary[i];
+    if (c == 0) return i;
+    if (c == '"') {
+      i++;
+      while (LispLibrary[i] != '"' && LispLibrary[i] != 0) {
+        if (LispLibrary[i] == '\\' && LispLibrary[i+1] != 0) i++;
+        i++;
+      }
+      i++;
+    } else if (c == '#' && LispLibrary[i+1] == '\\') {
+      i = i + 3;
+      while (!librarydelimiter(LispLibrary[i])) i++;
+    } else if (c == '(') { depth++; i++; }
+    else if (c == ')') { depth--; i++; }
+    else if (depth == 0) {
+      while (!librarydelimiter(LispLibrary[i])) i++;
+    } else i++;
+  } while (depth > 0);
+  return i;
+}
+
+// Returns the offset of the defined name if the form at i is a defun or defvar, otherwise -1
+int libraryname (int i) {
+  if (LispLibrary[i] != '(') return -1;
+  i = libraryskip(i+1);
+  int n;
+  if (strncasecmp(&LispLibrary[i], "defun", 5) == 0) n = 5;
+  else if (strncasecmp(&LispLibrary[i], "defvar", 6) == 0) n = 6;
+  else return -1;
+  if (!issp(LispLibrary[i+n])) return -1;
+  return libraryskip(i+n);
+}
+
+// Returns the offset of the first definition at or after i, or -1
+int librarynext (int i) {
+  for (;;) {
+    i = libraryskip(i);
+    if (LispLibrary[i] == 0) return -1;
+    if (libraryname(i) != -1) return i;
+    i = libraryform(i);
+  }
+}
+
+// Returns the offset of definition n, given the offset of definition n-1, or -1 after the last
+int libraryentry (int n, int previous) {
+  if (LibraryEntries < 0) {
+    LibraryEntries = 0; LibraryComplete = true;
+    int i = librarynext(0);
+    while (i != -1) {
+      if (LibraryEntries == LIBRARYINDEXSIZE) { LibraryComplete = false; break; }
+      LibraryIndex[LibraryEntries++] = i;
+      i = librarynext(libraryform(i));
+    }
   }
-  if (output == nil) { obj->cdr = GlobalString; return obj; }
-  else return nil;
+  if (n < LibraryEntries) return LibraryIndex[n];
+  if (LibraryComplete) return -1;
+  return librarynext(libraryform(previous)); // Beyond the index
 }
 
-// LispLibrary
-
 object *fn_require (object *args, object *env) {
   object *arg = first(args);
   object *globals = GlobalEnv;
@@ -3956,37 +7227,496 @@ object *fn_require (object *args, object *env) {
   while (globals != NULL) {
     object *pair = first(globals);
     object *var = car(pair);
-    if (symbolp(var) && var == arg) return nil;
+    if (symbolp(var) && var->name == arg->name) return nil;
     globals = cdr(globals);
   }
-  GlobalStringIndex = 0;
-  object *line = read(glibrary);
-  while (line != NULL) {
+  char *name = symbolname(arg->name);
+  int len = strlen(name);
+  int i = -1;
+  for (int n=0; (i = libraryentry(n, i)) != -1; n++) {
     // Is this the definition we want
-    int fname = first(line)->name;
-    if ((fname == DEFUN || fname == DEFVAR) && symbolp(second(line)) && second(line)->name == arg->name) {
-      eval(line, env);
+    int p = libraryname(i);
+    if (strncasecmp(&LispLibrary[p], name, len) == 0 && librarydelimiter(LispLibrary[p+len])) {
+      GlobalStringIndex = i; LastChar = 0;
+      eval(read(glibrary), env);
       return tee;
     }
-    line = read(glibrary);
   }
   return nil;
 }
 
 object *fn_listlibrary (object *args, object *env) {
   (void) args, (void) env;
-  GlobalStringIndex = 0;
-  object *line = read(glibrary);
-  while (line != NULL) {
-    int fname = first(line)->name;
-    if (fname == DEFUN || fname == DEFVAR) {
-      pstring(symbolname(second(line)->name), pserial); pserial(' ');
-    }
-    line = read(glibrary);
+  int i = -1;
+  for (int n=0; (i = libraryentry(n, i)) != -1; n++) {
+    int p = libraryname(i);
+    while (!librarydelimiter(LispLibrary[p])) pserial(LispLibrary[p++]);
+    pserial(' ');
   }
   return symbol(NOTHING);
 }
 
+// Tasks
+
+enum taskstate { TASKFREE, TASKNEW, TASKREADY, TASKDONE };
+
+typedef struct {
+  jmp_buf context;
+  jmp_buf *handler;
+  uint8_t *canary;
+  object *function;
+  object *result;
+  object *gcstack;
+  uint32_t fuel;
+  uint32_t deadline;
+  uint8_t limits;
+  uint8_t state;
+} task_t;
+
+task_t Tasks[TASKMAX+1]; // Task 0 is the REPL
+uint8_t TaskStack[TASKMAX][TASKSTACKSIZE] __attribute__((aligned (16)));
+int CurrentTask = 0;
+uint8_t *Canary = &End;
+
+// A task stack is filled with END when the task starts, and Canary points to its bottom. eval gives
+// a stack overflow error rather than go into the guard, which is left for the C code that runs
+// below the deepest eval. The printer and binread recurse into at most half of it, and
+// gc() and taskswitch() check that the rest is still intact. The REPL stack has only the one
+// canary byte, End
+inline bool stackdeep (int guard) {
+  return *Canary != END || (CurrentTask != 0 && (uint8_t *)__builtin_frame_address(0) < Canary + guard);
+}
+
+bool stackguard () {
+  if (CurrentTask == 0) return *Canary == END;
+  for (int i=0; i<TASKGUARD/2; i=i+4) if (*(uint32_t *)&Canary[i] != END * 0x01010101U) return false;
+  return true;
+}
+
+void marktasks () {
+  for (int i=0; i<=TASKMAX; i++) {
+    markobject(Tasks[i].function);
+    markobject(Tasks[i].result);
+    markobject(Tasks[i].gcstack);
+  }
+}
+
+void movetasks (object *from, object *to) {
+  for (int i=0; i<=TASKMAX; i++) {
+    if (Tasks[i].function == from) Tasks[i].function = to;
+    if (Tasks[i].result == from) Tasks[i].result = to;
+    if (Tasks[i].gcstack == from) Tasks[i].gcstack = to;
+  }
+}
+
+void resettasks () {
+  for (int i=1; i<=TASKMAX; i++) {
+    Tasks[i].state = TASKFREE;
+    Tasks[i].function = NULL; Tasks[i].result = NULL; Tasks[i].gcstack = NULL;
+  }
+}
+
+extern "C" void taskentry () {
+  task_t *t = &Tasks[CurrentTask];
+  jmp_buf task_handler;
+  handler = &task_handler;
+  // result already holds nothing, as the workspace may be full after an error
+  if (!setjmp(task_handler)) t->result = apply(0, t->function, NULL, NULL);
+  t = &Tasks[CurrentTask];
+  memset(Canary, END, TASKGUARD); // After a stack overflow, so that taskswitch() doesn't report it again
+  GCStack = NULL;
+  t->function = NULL;
+  t->state = TASKDONE;
+  for (;;) taskswitch(); // Never resumed
+}
+
+void taskstart (uint8_t *top) {
+#if defined(__arm__)
+  asm volatile ("mov sp, %0\n\tbl taskentry" : : "r" (top));
+#elif defined(__x86_64__)
+  asm volatile ("mov %0, %%rsp\n\tcall taskentry" : : "r" (top));
+#else
+  (void) top;
+  error2(SPAWN, PSTR("not available"));
+#endif
+}
+
+void taskswitch () {
+  int next = CurrentTask;
+  do next = (next == TASKMAX) ? 0 : next+1;
+  while (next != 0 && Tasks[next].state != TASKNEW && Tasks[next].state != TASKREADY);
+  if (next == CurrentTask) return;
+  if (!stackguard()) error2(0, PSTR("Stack overflow"));
+  task_t *t = &Tasks[CurrentTask];
+  t->handler = handler;
+  t->canary = Canary;
+  t->gcstack = GCStack;
+  t->limits = Limits; t->fuel = Fuel; t->deadline = Deadline;
+  if (!setjmp(t->context)) {
+    CurrentTask = next;
+    t = &Tasks[next];
+    if (t->state == TASKNEW) {
+      t->state = TASKREADY;
+      GCStack = NULL;
+      Limits = 0;
+      Canary = TaskStack[next-1];
+      memset(Canary, END, TASKSTACKSIZE);
+      taskstart(TaskStack[next-1] + TASKSTACKSIZE);
+    }
+    longjmp(t->context, 1);
+  }
+  // Resumed
+  t = &Tasks[CurrentTask];
+  handler = t->handler;
+  Canary = t->canary;
+  GCStack = t->gcstack;
+  t->gcstack = NULL;
+  Limits = t->limits; Fuel = t->fuel; Deadline = t->deadline;
+}
+
+object *fn_spawn (object *args, object *env) {
+  (void) env;
+  for (int i=1; i<=TASKMAX; i++) {
+    if (Tasks[i].state == TASKFREE) {
+      Tasks[i].function = first(args);
+      Tasks[i].result = symbol(NOTHING);
+      Tasks[i].state = TASKNEW;
+      return number(i);
+    }
+  }
+  error2(SPAWN, PSTR("too many tasks"));
+  return nil;
+}
+
+object *fn_taskyield (object *args, object *env) {
+  (void) args;
+  push(env, GCStack); // Keep our environment while other tasks run
+  taskswitch();
+  pop(GCStack);
+  return nil;
+}
+
+object *fn_taskjoin (object *args, object *env) {
+  (void) env;
+  int id = checkinteger(TASKJOIN, first(args));
+  if (id < 1 || id > TASKMAX || Tasks[id].state == TASKFREE) error(TASKJOIN, PSTR("no such task"), first(args));
+  if (id == CurrentTask) error2(TASKJOIN, PSTR("task can't join itself"));
+  push(env, GCStack);
+  while (Tasks[id].state != TASKDONE) taskswitch();
+  pop(GCStack);
+  object *result = Tasks[id].result;
+  Tasks[id].result = NULL;
+  Tasks[id].state = TASKFREE;
+  return result;
+}
+
+// Heap-stack evaluator - used instead of eval when HEAPSTACK is set, so that recursion
+// through function calls and the tail forms is bounded by the workspace rather than the C stack
+
+enum framekind { KPROGN, KIF, KCOND, KWHEN, KUNLESS, KAND, KOR, KSETQ, KLET, KLETSTAR, KARGS, KTRACE };
+
+// A frame is (header next env . data); the header holds the frame kind and the tail-call flag
+inline object *pushframe (object *k, int kind, int tc, object *env, object *data) {
+  return cons(number(kind | tc<<4), cons(k, cons(env, data)));
+}
+
+// Registers are kept in a list on GCStack whenever the evaluator calls out
+inline void hsave (object *regs, object *k, object *result, object *env, object *form) {
+  car(regs) = k; regs = cdr(regs);
+  car(regs) = result; regs = cdr(regs);
+  car(regs) = env;
+  second(regs) = form;
+}
+
+object *heval (object *form, object *env) {
+  object *regs = cons(NULL, cons(NULL, cons(NULL, cons(NULL, NULL))));
+  push(regs, GCStack);
+  object *k = NULL, *result = NULL, *frame, *data, *function, *args, *body, *assign;
+  int tc = 0, ptc, kind, ftc;
+  symbol_t name;
+
+  EVAL:
+  yield();
+  if (stackdeep(TASKGUARD)) error2(0, PSTR("Stack overflow"));
+  hsave(regs, k, result, env, form);
+  if (Freespace <= WORKSPACESIZE>>4) gc(form, env);
+  if (tstflag(ESCAPE)) { clrflag(ESCAPE); error2(0, PSTR("escape!"));}
+  if (!tstflag(NOESC)) testescape();
+  if (Limits) checklimits();
+  if (EventHead != EventTail) runevents(form, env);
+
+  if (form == NULL) { result = nil; goto RETURN; }
+
+  if (form->type >= NUMBER && form->type <= STRING_) { result = form; goto RETURN; }
+
+  if (symbolp(form)) {
+    name = form->name;
+    object *pair = value(name, env);
+    if (pair == NULL) pair = value(name, GlobalEnv);
+    if (pair != NULL) result = cdr(pair);
+    else if (name <= ENDFUNCTIONS || keywordp(name)) result = form;
+    else error(0, PSTR("undefined"), form);
+    goto RETURN;
+  }
+
+  if (form->type == CODE) error2(0, PSTR("can't evaluate CODE header"));
+
+  function = car(form);
+  args = cdr(form);
+
+  if (function == NULL) error(0, PSTR("illegal function"), nil);
+  if (!listp(args)) error(0, PSTR("can't evaluate a dotted pair"), args);
+
+  if (symbolp(function)) {
+    name = function->name;
+
+    if ((name == LET) || (name == LETSTAR)) {
+      if (!listp(first(args))) error(name, notalist, first(args));
+      kind = (name == LET) ? KLET : KLETSTAR;
+      k = pushframe(k, kind, tc, env, cons(env, args));
+      frame = k; data = cdr(cddr(frame));
+      goto LETSTEP;
+    }
+
+    if (name == LAMBDA) {
+      result = (env == NULL) ? form : makeclosure(args, env);
+      goto RETURN;
+    }
+
+    if (name == PROGN) { body = args; ptc = 1; goto PROGN; }
+
+    if (name == IF) {
+      if (args == NULL || cdr(args) == NULL) error2(IF, PSTR("missing argument(s)"));
+      k = pushframe(k, KIF, 1, env, cdr(args));
+      form = first(args); tc = 0; goto EVAL;
+    }
+
+    if (name == COND) {
+      if (args == NULL) { result = nil; goto RETURN; }
+      if (!consp(first(args))) error(COND, PSTR("illegal clause"), first(args));
+      k = pushframe(k, KCOND, 1, env, args);
+      form = first(first(args)); tc = 0; goto EVAL;
+    }
+
+    if ((name == WHEN) || (name == UNLESS)) {
+      if (args == NULL) error2(name, noargument);
+      k = pushframe(k, (name == WHEN) ? KWHEN : KUNLESS, 1, env, cdr(args));
+      form = first(args); tc = 0; goto EVAL;
+    }
+
+    if ((name == AND) || (name == OR)) {
+      if (args == NULL) { result = (name == AND) ? tee : nil; goto RETURN; }
+      if (cdr(args) == NULL) { form = car(args); tc = 1; goto EVAL; }
+      k = pushframe(k, (name == AND) ? KAND : KOR, 1, env, cdr(args));
+      form = car(args); tc = 0; goto EVAL;
+    }
+
+    if (name == SETQ) {
+      if (args == NULL) { result = nil; goto RETURN; }
+      if (cdr(args) == NULL) error2(SETQ, oddargs);
+      k = pushframe(k, KSETQ, 0, env, cons(findvalue(first(args), env), cddr(args)));
+      form = second(args); tc = 0; goto EVAL;
+    }
+
+    if ((name > SPECIAL_FORMS) && (name < TAIL_FORMS)) {
+      result = ((fn_ptr_type)lookupfn(name))(args, env);
+      goto RETURN;
+    }
+
+    if ((name > TAIL_FORMS) && (name < FUNCTIONS)) {
+      form = ((fn_ptr_type)lookupfn(name))(args, env);
+      tc = 1;
+      goto EVAL;
+    }
+
+    if (name < SPECIAL_FORMS) error2(name, PSTR("can't be used as a function"));
+  }
+
+  // Evaluate the function and then the parameters into (fname head . rest)
+  k = pushframe(k, KARGS, tc, env, cons(function, cons(NULL, args)));
+  form = function; tc = 0;
+  goto EVAL;
+
+  PROGN:
+  if (body == NULL) { result = nil; goto RETURN; }
+  if (cdr(body) != NULL) { k = pushframe(k, KPROGN, ptc, env, cdr(body)); tc = 0; }
+  else tc = ptc;
+  form = car(body);
+  goto EVAL;
+
+  LETSTEP:
+  while (second(data) != NULL) {
+    assign = car(second(data));
+    if (consp(assign) && cdr(assign) != NULL) {
+      form = second(assign);
+      env = (kind == KLETSTAR) ? first(data) : third(frame);
+      tc = 0;
+      goto EVAL;
+    }
+    push(cons(consp(assign) ? first(assign) : assign, nil), first(data));
+    second(data) = cdr(second(data));
+  }
+  k = second(frame);
+  env = first(data); body = cddr(data); ptc = car(frame)->integer>>4;
+  goto PROGN;
+
+  RETURN:
+  if (k == NULL) {
+    pop(GCStack);
+    return result;
+  }
+  frame = k;
+  kind = car(frame)->integer & 0x0F;
+  ftc = car(frame)->integer>>4;
+  k = second(frame);
+  env = third(frame);
+  data = cdr(cddr(frame));
+
+  switch (kind) {
+    case KPROGN:
+    if (tstflag(RETURNFLAG)) { form = result; tc = ftc; goto EVAL; }
+    form = car(data);
+    if (cdr(data) == NULL) tc = ftc;
+    else { cdr(cddr(frame)) = cdr(data); k = frame; tc = 0; }
+    goto EVAL;
+
+    case KIF:
+    if (result == nil) {
+      data = cdr(data);
+      if (data == NULL) goto RETURN;
+    }
+    form = first(data); tc = 1;
+    goto EVAL;
+
+    case KCOND:
+    if (result != nil) {
+      body = cdr(first(data));
+      if (body == NULL) goto RETURN;
+      ptc = 1; goto PROGN;
+    }
+    data = cdr(data);
+    if (data == NULL) goto RETURN;
+    if (!consp(first(data))) error(COND, PSTR("illegal clause"), first(data));
+    cdr(cddr(frame)) = data; k = frame;
+    form = first(first(data)); tc = 0;
+    goto EVAL;
+
+    case KWHEN: case KUNLESS:
+    if ((result != nil) == (kind == KWHEN)) { body = data; ptc = 1; goto PROGN; }
+    result = nil;
+    goto RETURN;
+
+    case KAND: case KOR:
+    if ((result == nil) == (kind == KAND)) goto RETURN;
+    form = car(data);
+    if (cdr(data) == NULL) tc = 1;
+    else { cdr(cddr(frame)) = cdr(data); k = frame; tc = 0; }
+    goto EVAL;
+
+    case KSETQ:
+    cdr(car(data)) = result;
+    args = cdr(data);
+    if (args == NULL) goto RETURN;
+    if (cdr(args) == NULL) error2(SETQ, oddargs);
+    car(data) = findvalue(first(args), env);
+    cdr(data) = cddr(args);
+    k = frame;
+    form = second(args); tc = 0;
+    goto EVAL;
+
+    case KLET: case KLETSTAR:
+    push(cons(first(car(second(data))), result), first(data));
+    second(data) = cdr(second(data));
+    k = frame;
+    goto LETSTEP;
+
+    case KTRACE:
+    name = data->name;
+    if (int trace = tracing(name)) {
+      indent((--(TraceDepth[trace-1]))<<1, ' ', pserial);
+      pint(TraceDepth[trace-1], pserial);
+      pserial(':'); pserial(' ');
+      printobject(data, pserial); pfstring(PSTR(" returned "), pserial);
+      printobject(result, pserial); pln(pserial);
+    }
+    goto RETURN;
+  }
+
+  // KARGS
+  result = cons(result, NULL);
+  if (second(data) == NULL) second(data) = result;
+  else {
+    args = second(data);
+    while (cdr(args) != NULL) args = cdr(args);
+    cdr(args) = result;
+  }
+  args = cddr(data);
+  if (args != NULL) {
+    cddr(data) = cdr(args);
+    k = frame;
+    form = car(args); tc = 0;
+    goto EVAL;
+  }
+  result = second(data);
+  hsave(regs, k, result, env, form);
+  function = car(result);
+  args = cdr(result);
+
+  if (symbolp(function)) {
+    name = function->name;
+    if (name >= ENDFUNCTIONS) error(0, PSTR("not valid here"), first(data));
+    checkminmax(name, listlength(name, args));
+    result = ((fn_ptr_type)lookupfn(name))(args, env);
+    goto RETURN;
+  }
+
+  if (consp(function)) {
+    name = symbolp(first(data)) ? first(data)->name : 0;
+    if (issymbol(car(function), LAMBDA)) {
+      body = bindparams(ftc, name, NULL, cdr(function), args, &env);
+      if (name && tracing(name)) { k = pushframe(k, KTRACE, 0, env, first(data)); ptc = 0; }
+      else ptc = 1;
+      goto PROGN;
+    }
+
+    if (issymbol(car(function), CLOSURE)) {
+      function = cdr(function);
+      body = bindparams(ftc, name, car(function), cdr(function), args, &env);
+      ptc = 1;
+      goto PROGN;
+    }
+
+    if (memop(function)) {
+      result = memocall(name, function, args, env);
+      goto RETURN;
+    }
+
+    if (structfunctionp(function)) {
+      result = structcall(name, function, args, env);
+      goto RETURN;
+    }
+
+    if (car(function)->type == CODE) {
+      int nargs = listlength(name, args);
+      int n = listlength(DEFCODE, second(function));
+      if (nargs<n) error2(name, toofewargs);
+      if (nargs>n) error2(name, toomanyargs);
+      uint32_t entry = startblock(car(function)) + 1;
+      result = call(entry, n, args, env);
+      goto RETURN;
+    }
+  }
+  error(0, PSTR("illegal function"), first(data)); return nil;
+}
+
+object *fn_heapeval (object *args, object *env) {
+  (void) env;
+  if (args != NULL) {
+    if (first(args) != nil) setflag(HEAPSTACK); else clrflag(HEAPSTACK);
+  }
+  return tstflag(HEAPSTACK) ? tee : nil;
+}
+
 // Graphics functions
 
 object *fn_drawpixel (object *args, object *env) {
@@ -4188,6 +7918,10 @@ const char string3[] PROGMEM = "&optional";
 const char string4[] PROGMEM = ":initial-element";
 const char string5[] PROGMEM = ":element-type";
 const char string6[] PROGMEM = "bit";
+const char string6_25[] PROGMEM = ":test";
+const char string6_5[] PROGMEM = ":size";
+const char string6_75[] PROGMEM = ":initial-value";
+const char string6_875[] PROGMEM = ":key";
 const char string7[] PROGMEM = "&rest";
 const char string8[] PROGMEM = "lambda";
 const char string9[] PROGMEM = "let";
@@ -4196,6 +7930,8 @@ const char string11[] PROGMEM = "closure";
 const char string12[] PROGMEM = "";
 const char string13[] PROGMEM = "quote";
 const char string14[] PROGMEM = "defun";
+const char string14_5[] PROGMEM = "defmemo";
+const char string14_7[] PROGMEM = "defstruct";
 const char string15[] PROGMEM = "defvar";
 const char string16[] PROGMEM = "setq";
 const char string17[] PROGMEM = "loop";
@@ -4220,6 +7956,8 @@ const char string35[] PROGMEM = "defcode";
 const char string35_5[] PROGMEM = "unwind-protect";
 const char string35_75[] PROGMEM = "ignore-errors";
 const char string35_825[] PROGMEM = "error";
+const char string35_9[] PROGMEM = "with-fuel";
+const char string35_95[] PROGMEM = "with-deadline";
 const char string36[] PROGMEM = "";
 const char string37[] PROGMEM = "progn";
 const char string38[] PROGMEM = "if";
@@ -4227,6 +7965,7 @@ const char string39[] PROGMEM = "cond";
 const char string40[] PROGMEM = "when";
 const char string41[] PROGMEM = "unless";
 const char string42[] PROGMEM = "case";
+const char string42_5[] PROGMEM = "ecase";
 const char string43[] PROGMEM = "and";
 const char string44[] PROGMEM = "or";
 const char string45[] PROGMEM = "";
@@ -4393,6 +8132,59 @@ const char string205[] PROGMEM = "set-text-wrap";
 const char string206[] PROGMEM = "fill-screen";
 const char string207[] PROGMEM = "set-rotation";
 const char string208[] PROGMEM = "invert-display";
+const char string209[] PROGMEM = "spawn";
+const char string210[] PROGMEM = "task-yield";
+const char string211[] PROGMEM = "task-join";
+const char string212[] PROGMEM = "heap-eval";
+const char string213[] PROGMEM = "checkpoint";
+const char string214[] PROGMEM = "checkpoint-stats";
+const char string215[] PROGMEM = "kv-put";
+const char string216[] PROGMEM = "kv-get";
+const char string217[] PROGMEM = "kv-delete";
+const char string218[] PROGMEM = "serialize";
+const char string219[] PROGMEM = "deserialize";
+const char string220[] PROGMEM = "read-sequence";
+const char string221[] PROGMEM = "write-sequence";
+const char string222[] PROGMEM = "equal";
+const char string223[] PROGMEM = "make-hash-table";
+const char string224[] PROGMEM = "gethash";
+const char string225[] PROGMEM = "remhash";
+const char string226[] PROGMEM = "maphash";
+const char string227[] PROGMEM = "hash-table-count";
+const char string228[] PROGMEM = "sxhash";
+const char string229[] PROGMEM = "memoize";
+const char string230[] PROGMEM = "memo-stats";
+const char string231[] PROGMEM = "fixed";
+const char string232[] PROGMEM = "fixedp";
+const char string233[] PROGMEM = "array-map";
+const char string234[] PROGMEM = "array-add!";
+const char string235[] PROGMEM = "array-scale!";
+const char string236[] PROGMEM = "dot";
+const char string237[] PROGMEM = "array-sum";
+const char string238[] PROGMEM = "array-min";
+const char string239[] PROGMEM = "array-max";
+const char string240[] PROGMEM = "convolve";
+const char string241[] PROGMEM = "reduce";
+const char string242[] PROGMEM = "count-if";
+const char string243[] PROGMEM = "find-if";
+const char string244[] PROGMEM = "position";
+const char string245[] PROGMEM = "every";
+const char string246[] PROGMEM = "some";
+const char string247[] PROGMEM = "make-generator";
+const char string248[] PROGMEM = "next";
+const char string249[] PROGMEM = "gen-map";
+const char string250[] PROGMEM = "gen-filter";
+const char string251[] PROGMEM = "gen-take";
+const char string252[] PROGMEM = "make-ring";
+const char string253[] PROGMEM = "ring-push";
+const char string254[] PROGMEM = "ring-pop";
+const char string255[] PROGMEM = "ring-ref";
+const char string256[] PROGMEM = "ring-length";
+const char string257[] PROGMEM = "ring-sum";
+const char string258[] PROGMEM = "ring-mean";
+const char string259[] PROGMEM = "ring-min";
+const char string260[] PROGMEM = "ring-max";
+const char string261[] PROGMEM = "ring-variance";
 
 // Third parameter is no. of arguments; 1st hex digit is min, 2nd hex digit is max, 0xF is unlimited
 const tbl_entry_t lookup_table[] PROGMEM = {
@@ -4403,6 +8195,10 @@ const tbl_entry_t lookup_table[] PROGMEM = {
   { string4, NULL, 0x00 },
   { string5, NULL, 0x00 },
   { string6, NULL, 0x00 },
+  { string6_25, NULL, 0x00 },
+  { string6_5, NULL, 0x00 },
+  { string6_75, NULL, 0x00 },
+  { string6_875, NULL, 0x00 },
   { string7, NULL, 0x00 },
   { string8, NULL, 0x0F },
   { string9, NULL, 0x0F },
@@ -4411,6 +8207,8 @@ const tbl_entry_t lookup_table[] PROGMEM = {
   { string12, NULL, 0x00 },
   { string13, sp_quote, 0x11 },
   { string14, sp_defun, 0x2F },
+  { string14_5, sp_defmemo, 0x2F },
+  { string14_7, sp_defstruct, 0x1F },
   { string15, sp_defvar, 0x12 },
   { string16, sp_setq, 0x2F },
   { string17, sp_loop, 0x0F },
@@ -4435,6 +8233,8 @@ const tbl_entry_t lookup_table[] PROGMEM = {
   { string35_5, sp_unwindprotect, 0x1F },
   { string35_75, sp_ignoreerrors, 0x0F },
   { string35_825, sp_error, 0x1F },
+  { string35_9, sp_withfuel, 0x1F },
+  { string35_95, sp_withdeadline, 0x1F },
   { string36, NULL, 0x00 },
   { string37, tf_progn, 0x0F },
   { string38, tf_if, 0x23 },
@@ -4442,6 +8242,7 @@ const tbl_entry_t lookup_table[] PROGMEM = {
   { string40, tf_when, 0x1F },
   { string41, tf_unless, 0x1F },
   { string42, tf_case, 0x1F },
+  { string42_5, tf_ecase, 0x1F },
   { string43, tf_and, 0x0F },
   { string44, tf_or, 0x0F },
   { string45, NULL, 0x00 },
@@ -4608,6 +8409,59 @@ const tbl_entry_t lookup_table[] PROGMEM = {
   { string206, fn_fillscreen, 0x01 },
   { string207, fn_setrotation, 0x11 },
   { string208, fn_invertdisplay, 0x11 },
+  { string209, fn_spawn, 0x11 },
+  { string210, fn_taskyield, 0x00 },
+  { string211, fn_taskjoin, 0x11 },
+  { string212, fn_heapeval, 0x01 },
+  { string213, fn_checkpoint, 0x01 },
+  { string214, fn_checkpointstats, 0x00 },
+  { string215, fn_kvput, 0x22 },
+  { string216, fn_kvget, 0x12 },
+  { string217, fn_kvdelete, 0x11 },
+  { string218, fn_serialize, 0x13 },
+  { string219, fn_deserialize, 0x11 },
+  { string220, fn_readsequence, 0x12 },
+  { string221, fn_writesequence, 0x12 },
+  { string222, fn_equal, 0x22 },
+  { string223, fn_makehashtable, 0x04 },
+  { string224, fn_gethash, 0x23 },
+  { string225, fn_remhash, 0x22 },
+  { string226, fn_maphash, 0x22 },
+  { string227, fn_hashtablecount, 0x11 },
+  { string228, fn_sxhash, 0x11 },
+  { string229, fn_memoize, 0x15 },
+  { string230, fn_memostats, 0x11 },
+  { string231, fn_fixedfn, 0x11 },
+  { string232, fn_fixedp, 0x11 },
+  { string233, fn_arraymap, 0x22 },
+  { string234, fn_arrayadd, 0x33 },
+  { string235, fn_arrayscale, 0x22 },
+  { string236, fn_dot, 0x22 },
+  { string237, fn_arraysum, 0x11 },
+  { string238, fn_arraymin, 0x11 },
+  { string239, fn_arraymax, 0x11 },
+  { string240, fn_convolve, 0x22 },
+  { string241, fn_reduce, 0x26 },
+  { string242, fn_countif, 0x22 },
+  { string243, fn_findif, 0x22 },
+  { string244, fn_position, 0x24 },
+  { string245, fn_every, 0x25 },
+  { string246, fn_some, 0x25 },
+  { string247, fn_makegenerator, 0x11 },
+  { string248, fn_next, 0x11 },
+  { string249, fn_genmap, 0x22 },
+  { string250, fn_genfilter, 0x22 },
+  { string251, fn_gentake, 0x22 },
+  { string252, fn_makering, 0x13 },
+  { string253, fn_ringpush, 0x22 },
+  { string254, fn_ringpop, 0x11 },
+  { string255, fn_ringref, 0x22 },
+  { string256, fn_ringlength, 0x11 },
+  { string257, fn_ringsum, 0x11 },
+  { string258, fn_ringmean, 0x11 },
+  { string259, fn_ringmin, 0x11 },
+  { string260, fn_ringmax, 0x11 },
+  { string261, fn_ringvariance, 0x11 },
   LOOKUP_TABLE_ENTRIES
 };
 
@@ -4677,15 +8531,19 @@ void testescape () {
 uint8_t End;
 
 object *eval (object *form, object *env) {
+  if (tstflag(HEAPSTACK)) return heval(form, env);
   int TC=0;
   EVAL:
   yield(); // Needed on ESP8266 to avoid Soft WDT Reset
   // Enough space?
-  if (End != 0xA5) error2(0, PSTR("Stack overflow"));
+  if (stackdeep(TASKGUARD)) error2(0, PSTR("Stack overflow"));
   if (Freespace <= WORKSPACESIZE>>4) gc(form, env);
   // Escape
   if (tstflag(ESCAPE)) { clrflag(ESCAPE); error2(0, PSTR("escape!"));}
   if (!tstflag(NOESC)) testescape();
+  if (Limits) checklimits();
+  // Interrupt events
+  if (EventHead != EventTail) runevents(form, env);
 
   if (form == NULL) return nil;
 
@@ -4697,7 +8555,7 @@ object *eval (object *form, object *env) {
     if (pair != NULL) return cdr(pair);
     pair = value(name, GlobalEnv);
     if (pair != NULL) return cdr(pair);
-    else if (name <= ENDFUNCTIONS) return form;
+    else if (name <= ENDFUNCTIONS || keywordp(name)) return form;
     error(0, PSTR("undefined"), form);
   }
 
@@ -4739,13 +8597,7 @@ object *eval (object *form, object *env) {
 
     if (name == LAMBDA) {
       if (env == NULL) return form;
-      object *envcopy = NULL;
-      while (env != NULL) {
-        object *pair = first(env);
-        if (pair != NULL) push(pair, envcopy);
-        env = cdr(env);
-      }
-      return cons(symbol(CLOSURE), cons(envcopy,args));
+      return makeclosure(args, env);
     }
 
     if ((name > SPECIAL_FORMS) && (name < TAIL_FORMS)) {
@@ -4818,6 +8670,18 @@ object *eval (object *form, object *env) {
     goto EVAL;
   }
 
+    if (memop(function)) {
+      object *result = memocall(symbolp(fname) ? fname->name : 0, function, args, env);
+      pop(GCStack);
+      return result;
+    }
+
+    if (structfunctionp(function)) {
+      object *result = structcall(symbolp(fname) ? fname->name : 0, function, args, env);
+      pop(GCStack);
+      return result;
+    }
+
     if (car(function)->type == CODE) {
       int n = listlength(DEFCODE, second(function));
       if (nargs<n) error2(fname->name, toofewargs);
@@ -4837,10 +8701,24 @@ inline int maxbuffer (char *buffer) {
   return SYMBOLTABLESIZE-(buffer-SymbolTable)-1;
 }
 
+// Serial output is collected in SerialBuffer and sent with one Serial.write at the end of each line,
+// when the buffer fills, before waiting for input or a delay, and before an error is reported
+#define SERIALBUFFER 64
+uint8_t SerialBuffer[SERIALBUFFER];
+uint8_t SerialCount = 0;
+
+void serialflush () {
+  if (SerialCount == 0) return;
+  Serial.write(SerialBuffer, SerialCount);
+  SerialCount = 0;
+}
+
 void pserial (char c) {
   LastPrint = c;
-  if (c == '\n') Serial.write('\r');
-  Serial.write(c);
+  if (SerialCount >= SERIALBUFFER - 1) serialflush();
+  if (c == '\n') SerialBuffer[SerialCount++] = '\r';
+  SerialBuffer[SerialCount++] = c;
+  if (c == '\n') serialflush();
 }
 
 const char ControlCodes[] PROGMEM = "Null\0SOH\0STX\0ETX\0EOT\0ENQ\0ACK\0Bell\0Backspace\0Tab\0Newline\0VT\0"
@@ -4983,6 +8861,7 @@ void pfl (pfun_t pfun) {
 }
 
 void plist (object *form, pfun_t pfun) {
+    if (stackdeep(TASKGUARD/2)) error2(0, PSTR("Stack overflow"));
     pfun('(');
     printobject(car(form), pfun);
     form = cdr(form);
@@ -5012,10 +8891,15 @@ void printobject (object *form, pfun_t pfun) {
   else if (listp(form)) plist(form, pfun);
   else if (integerp(form)) pint(form->integer, pfun);
   else if (floatp(form)) pfloat(form->single_float, pfun);
+  else if (fixedp(form)) pfixed(form->integer, pfun);
   else if (symbolp(form)) { if (form->name != NOTHING) pstring(symbolname(form->name), pfun); }
   else if (characterp(form)) pcharacter(form->chars, pfun);
   else if (stringp(form)) printstring(form, pfun);
   else if (arrayp(form)) printarray(form, pfun);
+  else if (hashtablep(form)) pfstring(PSTR("<hash-table>"), pfun);
+  else if (ringp(form)) pfstring(PSTR("<ring>"), pfun);
+  else if (structp(form)) printstruct(form, pfun);
+  else if (generatorp(form)) pfstring(PSTR("<generator>"), pfun);
   else if (form->type == CODE) pfstring(PSTR("code"), pfun);
   else if (streamp(form)) pstream(form, pfun);
   else error2(0, PSTR("error in print"));
@@ -5041,12 +8925,26 @@ int glibrary () {
 }
 
 void loadfromlibrary (object *env) {
+  #if defined(romlibrary)
+  if (GlobalEnv == NULL) GlobalEnv = ROMENV;
+  else {
+    object *globals = GlobalEnv;
+    while (cdr(globals) != NULL) globals = cdr(globals);
+    cdr(globals) = ROMENV;
+  }
+  object *forms = ROMFORMS;
+  while (forms != NULL) {
+    eval(first(forms), env);
+    forms = cdr(forms);
+  }
+  #else
   GlobalStringIndex = 0;
   object *line = read(glibrary);
   while (line != NULL) {
     eval(line, env);
     line = read(glibrary);
   }
+  #endif
 }
 
 // For line editor
@@ -5136,6 +9034,163 @@ void processkey (char c) {
   return;
 }
 
+// Framed upload - tools/upload.py sends a program without going through the line editor. UPLOADSTART
+// then 'U' at the start of a line starts an upload. Each frame is a type, a sequence number, a 16-bit
+// length, the payload, and the CRC-32 of all of these. The reply to each frame is UPLOADACK once its
+// payload has been used, UPLOADNAK to send it again, or UPLOADCAN if the upload stopped with an error.
+// Source frames are read straight into the reader; a form frame holds one serialized form
+
+#define UPLOADSTART   0x01
+#define UPLOADACK     0x06
+#define UPLOADNAK     0x15
+#define UPLOADCAN     0x18
+#define UPLOADFRAME   256   // Largest payload; frames are received into KybdBuf
+#define UPLOADTIMEOUT 1000  // Milliseconds to wait for the next byte of a frame
+#define UPLOADQUIET   20    // Milliseconds without input after a damaged frame
+#define UPLOADRETRIES 8
+
+enum uploadframe { UPLOADSOURCE = 'S', UPLOADFORM = 'B', UPLOADEND = 'E' };
+
+bool ReplReading = false; // Only the top level REPL reading a new form can start an upload
+int UploadType, UploadLength, UploadIndex;
+uint8_t UploadSequence;
+bool UploadComment;
+
+int uploadbyte (unsigned long timeout) {
+  unsigned long start = millis();
+  while (!Serial.available()) if (millis() - start > timeout) return -1;
+  return Serial.read();
+}
+
+void uploadreply (uint8_t c) {
+  serialflush();
+  Serial.write(c);
+}
+
+// Receives the next frame into KybdBuf, asking for it again until it arrives intact
+void uploadframe () {
+  for (int tries=0; tries<UPLOADRETRIES; tries++) {
+    uint8_t header[4];
+    uint32_t crc = 0xFFFFFFFF, check = 0;
+    bool ok = true;
+    int length = 0;
+    for (int i=0; ok && i<4+length+4; i++) {
+      int b = uploadbyte(UPLOADTIMEOUT);
+      if (b == -1) ok = false;
+      else if (i < 4) {
+        header[i] = b; crc = crc32byte(crc, b);
+        if (i == 3) length = header[2] | header[3]<<8;
+        if (i == 3 && length > UPLOADFRAME) ok = false;
+      } else if (i < 4+length) { KybdBuf[i-4] = b; crc = crc32byte(crc, b); }
+      else check = check | (uint32_t)b<<(8*(i-4-length));
+    }
+    if (ok && check == ~crc) {
+      if (header[1] == UploadSequence) {
+        UploadType = header[0]; UploadLength = length; UploadIndex = 0;
+        UploadSequence++;
+        return;
+      }
+      // A repeat of the last frame, as its UPLOADACK was lost
+      if (header[1] == (uint8_t)(UploadSequence - 1)) { uploadreply(UPLOADACK); tries--; continue; }
+    }
+    while (uploadbyte(UPLOADQUIET) != -1);
+    uploadreply(UPLOADNAK);
+  }
+  error2(0, PSTR("upload failed"));
+}
+
+void uploadnext () {
+  uploadreply(UPLOADACK);
+  uploadframe();
+}
+
+// Reads source for the reader, continuing in the next frame
+int gupload () {
+  if (LastChar) {
+    char temp = LastChar;
+    LastChar = 0;
+    return temp;
+  }
+  while (UploadIndex == UploadLength) {
+    uploadnext();
+    if (UploadType != UPLOADSOURCE) error2(0, PSTR("incomplete form in upload"));
+  }
+  return KybdBuf[UploadIndex++];
+}
+
+int guploadform () {
+  if (UploadIndex == UploadLength) return -1;
+  return KybdBuf[UploadIndex++];
+}
+
+// Skips white space and comments between forms; returns false at the end of the frame
+bool uploadskip () {
+  if (LastChar) return true;
+  while (UploadIndex < UploadLength) {
+    char c = KybdBuf[UploadIndex];
+    if (UploadComment) { if (c == '\n') UploadComment = false; }
+    else if (c == ';') UploadComment = true;
+    else if (!issp(c)) return true;
+    UploadIndex++;
+  }
+  return false;
+}
+
+void printprompt ();
+
+// Evaluates the forms in the frames that follow; returns when the upload ends or fails
+void upload () {
+  if (uploadbyte(UPLOADTIMEOUT) != 'U') return;
+  ReplReading = false;
+  int forms = 0;
+  jmp_buf dynamic_handler;
+  jmp_buf *previous_handler = handler;
+  handler = &dynamic_handler;
+  if (!setjmp(dynamic_handler)) {
+    UploadSequence = 0; UploadComment = false; LastChar = 0;
+    uploadnext();
+    while (UploadType != UPLOADEND) {
+      object *form;
+      if (UploadType == UPLOADFORM) {
+        form = deserialize(guploadform);
+        UploadIndex = UploadLength;
+      } else if (UploadType == UPLOADSOURCE) {
+        if (!uploadskip()) { uploadnext(); continue; }
+        form = read(gupload);
+        if (form == (object *)KET) error2(0, PSTR("unmatched right bracket"));
+      } else error2(0, PSTR("unknown upload frame"));
+      push(form, GCStack);
+      eval(form, NULL);
+      pop(GCStack);
+      forms++;
+      if (UploadIndex == UploadLength && LastChar == 0) uploadnext();
+    }
+    uploadreply(UPLOADACK);
+    pfl(pserial); pint(forms, pserial); pfstring(PSTR(" forms uploaded"), pserial); pln(pserial);
+  } else {
+    while (uploadbyte(UPLOADQUIET) != -1);
+    uploadreply(UPLOADCAN);
+  }
+  handler = previous_handler;
+  LastChar = 0;
+  WritePtr = 0;
+  ReplReading = true;
+  printprompt();
+}
+
+bool IdleConsed = false; // The REPL collects garbage again before evaluating the line
+
+// Runs timers, interrupt handlers and tasks while waiting for input, with testescape() off so
+// that the Lisp code they run doesn't read and discard what is being typed
+void replidle () {
+  bool noesc = tstflag(NOESC);
+  setflag(NOESC);
+  unsigned int free = Freespace;
+  process_system();
+  if (Freespace != free) IdleConsed = true;
+  if (!noesc) clrflag(NOESC);
+}
+
 int gserial () {
   if (LastChar) {
     char temp = LastChar;
@@ -5144,8 +9199,11 @@ int gserial () {
   }
 #if defined(lineeditor)
   while (!KybdAvailable) {
-    while (!Serial.available()) process_system();
+    while (!Serial.available()) { serialflush(); replidle(); kvidle(); }
+    // The line editor echoes straight to Serial, so buffered output such as the prompt goes first
+    serialflush();
     char temp = Serial.read();
+    if (temp == UPLOADSTART && WritePtr == 0 && ReplReading) { upload(); continue; }
     processkey(temp);
   }
   if (ReadPtr != WritePtr) return KybdBuf[ReadPtr++];
@@ -5153,8 +9211,9 @@ int gserial () {
   WritePtr = 0;
   return '\n';
 #else
-  while (!Serial.available()) process_system();
+  while (!Serial.available()) { serialflush(); replidle(); kvidle(); }
   char temp = Serial.read();
+  if (temp == UPLOADSTART && ReplReading) { upload(); return gserial(); }
   if (temp != '\n') pserial(temp);
   return temp;
 #endif
@@ -5162,6 +9221,15 @@ int gserial () {
 
 #define issp(x) (x == ' ' || x == '\n' || x == '\r' || x == '\t')
 
+// Returns the symbol named in buffer, which must be at SymbolTop
+object *internsymbol (char *buffer) {
+  int x = builtin(buffer);
+  if (x == NIL) return nil;
+  if (x < ENDFUNCTIONS) return newsymbol(x);
+  else if (strlen(buffer) <= 6 && valid40(buffer)) return newsymbol(pack40(buffer));
+  else return newsymbol(longsymbol(buffer));
+}
+
 object *nextitem (gfun_t gfun) {
   int ch = gfun();
   while(issp(ch)) ch = gfun();
@@ -5216,6 +9284,7 @@ object *nextitem (gfun_t gfun) {
     } else if (ch2 == 'B') base = 2;
     else if (ch2 == 'O') base = 8;
     else if (ch2 == 'X') base = 16;
+    else if (ch2 == 'Q') return readfixed(gfun);
     else if (ch == '\'') return nextitem(gfun);
     else if (ch == '.') {
       setflag(NOESC);
@@ -5225,6 +9294,7 @@ object *nextitem (gfun_t gfun) {
     }
     else if (ch == '(') { LastChar = ch; return readarray(1, read(gfun)); }
     else if (ch == '*') return readbitarray(gfun);
+    else if (ch2 == 'S') return readstruct(read(gfun));
     else if (ch >= '1' && ch <= '9' && (gfun() & ~0x20) == 'A') return readarray(ch - '0', read(gfun));
     else error2(0, PSTR("illegal character after #"));
     ch = gfun();
@@ -5280,35 +9350,36 @@ object *nextitem (gfun_t gfun) {
     error2(0, PSTR("unknown character"));
   }
 
-  int x = builtin(buffer);
-  if (x == NIL) return nil;
-  if (x < ENDFUNCTIONS) return newsymbol(x);
-  else if (index <= 6 && valid40(buffer)) return newsymbol(pack40(buffer));
-  else return newsymbol(longsymbol(buffer));
+  return internsymbol(buffer);
 }
 
+// The list read so far is kept on GCStack, because timers and interrupt handlers can run
+// and collect garbage while gserial() waits for the next line
 object *readrest (gfun_t gfun) {
   object *item = nextitem(gfun);
   object *head = NULL;
   object *tail = NULL;
+  push(NULL, GCStack);
 
   while (item != (object *)KET) {
     if (item == (object *)BRA) {
       item = readrest(gfun);
     } else if (item == (object *)QUO) {
-      item = cons(symbol(QUOTE), cons(read(gfun), NULL));
+      item = read(gfun);
+      item = cons(symbol(QUOTE), cons(item, NULL));
     } else if (item == (object *)DOT) {
       tail->cdr = read(gfun);
       if (readrest(gfun) != NULL) error2(0, PSTR("malformed list"));
-      return head;
+      break;
     } else {
       object *cell = cons(item, NULL);
-      if (head == NULL) head = cell;
+      if (head == NULL) { head = cell; car(GCStack) = head; }
       else tail->cdr = cell;
       tail = cell;
       item = nextitem(gfun);
     }
   }
+  pop(GCStack);
   return head;
 }
 
@@ -5317,7 +9388,7 @@ object *read (gfun_t gfun) {
   if (item == (object *)KET) error2(0, PSTR("incomplete list"));
   if (item == (object *)BRA) return readrest(gfun);
   if (item == (object *)DOT) return read(gfun);
-  if (item == (object *)QUO) return cons(symbol(QUOTE), cons(read(gfun), NULL));
+  if (item == (object *)QUO) { item = read(gfun); return cons(symbol(QUOTE), cons(item, NULL)); }
   return item;
 }
 
@@ -5336,6 +9407,11 @@ void initgfx () {
 void initenv () {
   GlobalEnv = NULL;
   tee = symbol(TEE);
+  #if defined(romlibrary)
+  // The ROM library refers to its long symbols by index, so they go first
+  memcpy(SymbolTable, LispRomSymbols, ROMSYMBOLS);
+  SymbolTop = SymbolTable + ROMSYMBOLS;
+  #endif
 }
 
 void ulisp_setup () {
@@ -5351,21 +9427,28 @@ void ulisp_setup () {
 
 // Read/Evaluate/Print loop
 
+void printprompt () {
+  #if defined (printfreespace)
+  pint(Freespace, pserial);
+  #endif
+  if (BreakLevel) {
+    pfstring(PSTR(" : "), pserial);
+    pint(BreakLevel, pserial);
+  }
+  pfstring(PSTR("> "), pserial);
+}
+
 void repl (object *env) {
   for (;;) {
     randomSeed(micros());
     gc(NULL, env);
-    #if defined (printfreespace)
-    pint(Freespace, pserial);
-    #endif
-    if (BreakLevel) {
-      pfstring(PSTR(" : "), pserial);
-      pint(BreakLevel, pserial);
-    }
-    pfstring(PSTR("> "), pserial);
+    printprompt();
+    ReplReading = (BreakLevel == 0);
     object *line = read(gserial);
+    ReplReading = false;
     if (BreakLevel && line == nil) { pln(pserial); return; }
     if (line == (object *)KET) error2(0, PSTR("unmatched right bracket"));
+    if (IdleConsed) { IdleConsed = false; gc(line, env); }
     push(line, GCStack);
     pfl(pserial);
     line = eval(line, env);
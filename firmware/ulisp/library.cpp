@@ -2,20 +2,38 @@
 
 // Insert your own function definitions here
 
-enum function_ { PEEK = _ENDFUNCTIONS, POKE, PUBLISH, NOW, ZONE, ENDFUNCTIONS};
+enum function_ { PEEK = _ENDFUNCTIONS, POKE, PUBLISH, NOW, ZONE, SCHEDULEEVERY, SCHEDULEAT, CANCEL, TIMERSTATS,
+ATTACHINTERRUPT, DETACHINTERRUPT, INTERRUPTSTATS,
+ENDFUNCTIONS};
 
 object *fn_peek (object *args, object *env);
 object *fn_poke (object *args, object *env);
 object *fn_publish (object *args, object *env);
 object *fn_now (object *args, object *env);
 object *fn_zone (object *args, object *env);
+object *fn_scheduleevery (object *args, object *env);
+object *fn_scheduleat (object *args, object *env);
+object *fn_cancel (object *args, object *env);
+object *fn_timerstats (object *args, object *env);
+object *fn_attachinterrupt (object *args, object *env);
+object *fn_detachinterrupt (object *args, object *env);
+object *fn_interruptstats (object *args, object *env);
 void process_system();
+void runevents (object *form, object *env);
+extern volatile uint8_t EventHead, EventTail;
 
 extern const char string_fn_peek[] PROGMEM;
 extern const char string_fn_poke[] PROGMEM;
 extern const char string_fn_publish[] PROGMEM;
 extern const char string_fn_now[] PROGMEM;
 extern const char string_fn_zone[] PROGMEM;
+extern const char string_fn_scheduleevery[] PROGMEM;
+extern const char string_fn_scheduleat[] PROGMEM;
+extern const char string_fn_cancel[] PROGMEM;
+extern const char string_fn_timerstats[] PROGMEM;
+extern const char string_fn_attachinterrupt[] PROGMEM;
+extern const char string_fn_detachinterrupt[] PROGMEM;
+extern const char string_fn_interruptstats[] PROGMEM;
 
 #ifdef LOOKUP_TABLE_ENTRIES
 #undef LOOKUP_TABLE_ENTRIES
@@ -26,6 +44,13 @@ extern const char string_fn_zone[] PROGMEM;
     { string_fn_publish, fn_publish, 0x22 }, \
     { string_fn_now, fn_now, 0x00 }, \
     { string_fn_zone, fn_zone, 0x11 }, \
+    { string_fn_scheduleevery, fn_scheduleevery, 0x22 }, \
+    { string_fn_scheduleat, fn_scheduleat, 0x22 }, \
+    { string_fn_cancel, fn_cancel, 0x11 }, \
+    { string_fn_timerstats, fn_timerstats, 0x11 }, \
+    { string_fn_attachinterrupt, fn_attachinterrupt, 0x33 }, \
+    { string_fn_detachinterrupt, fn_detachinterrupt, 0x11 }, \
+    { string_fn_interruptstats, fn_interruptstats, 0x00 }, \
 
 #else // __ULISP_C_H
 
@@ -77,13 +102,23 @@ int string_reader () {
   return (c != 0) ? c : -1;
 }
 
+// Default eval step limits for code run from the cloud, timers and interrupts
+#define CLOUDFUEL 20000
+#define TIMERFUEL 10000
+
+// Wraps a call as (ignore-errors (with-fuel fuel call))
+object *limitedcall (object *call, int fuel) {
+  object *limited = cons(symbol(WITHFUEL), cons(number(fuel), cons(call, NULL)));
+  return cons(symbol(IGNOREERRORS), cons(limited, NULL));
+}
+
 int fnc (String data) {
     STR_POSITION = 0;
     data.concat("\n");
     data.replace(")", " )");
     STR_READER = data.c_str();
     object *lisp_data = read(string_reader);
-    object *form = cons(symbol(IGNOREERRORS), cons(cons(newsymbol(pack40("cloud\0")), cons(lisp_data, NULL)), NULL));
+    object *form = limitedcall(cons(newsymbol(pack40("cloud\0")), cons(lisp_data, NULL)), CLOUDFUEL);
     object *result = eval(form, NULL);
     if (symbolp(result) && result->name == NOTHING) {
         return -1;
@@ -98,21 +133,318 @@ object *fn_zone (object *args, object *env) {
   return nil;
 }
 
-int lastHour = -1;
-int lastMinute = -1;
-int lastSecond = -1;
+// Scheduler - timers are kept in a binary min-heap ordered on their millis() due time,
+// the call forms live in Roots[TIMERROOT] as an alist of (id . form)
+
+#define TIMERMAX 32
+
+typedef struct {
+  uint32_t due;
+  uint32_t period;      // 0 for a one-shot timer
+  int id;
+  uint32_t runs;
+  uint32_t maxjitter;   // Worst lateness in ms
+  uint32_t totaljitter;
+} timerentry_t;
+
+timerentry_t Timers[TIMERMAX];
+int TimerCount = 0;
+int TimerId = 0;
+
+inline bool timerbefore (int i, int j) {
+  return (int32_t)(Timers[i].due - Timers[j].due) < 0;
+}
+
+void timerswap (int i, int j) {
+  timerentry_t temp = Timers[i];
+  Timers[i] = Timers[j];
+  Timers[j] = temp;
+}
+
+void timersiftup (int i) {
+  while (i > 0 && timerbefore(i, (i-1)/2)) {
+    timerswap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+void timersiftdown (int i) {
+  for (;;) {
+    int least = i, left = 2*i+1, right = 2*i+2;
+    if (left < TimerCount && timerbefore(left, least)) least = left;
+    if (right < TimerCount && timerbefore(right, least)) least = right;
+    if (least == i) return;
+    timerswap(i, least);
+    i = least;
+  }
+}
+
+void timerremove (int i) {
+  TimerCount--;
+  if (i == TimerCount) return;
+  Timers[i] = Timers[TimerCount];
+  timersiftdown(i);
+  timersiftup(i);
+}
+
+int timerfind (int id) {
+  for (int i=0; i<TimerCount; i++) if (Timers[i].id == id) return i;
+  return -1;
+}
+
+object *timerform (int id, bool remove) {
+  object *prev = NULL;
+  object *list = Roots[TIMERROOT];
+  while (list != NULL) {
+    object *pair = car(list);
+    if (car(pair)->integer == id) {
+      if (remove) {
+        if (prev == NULL) Roots[TIMERROOT] = cdr(list); else cdr(prev) = cdr(list);
+      }
+      return cdr(pair);
+    }
+    prev = list;
+    list = cdr(list);
+  }
+  return nil;
+}
+
+int schedule (symbol_t name, uint32_t delay, uint32_t period, object *fn) {
+  if (TimerCount == TIMERMAX) error2(name, PSTR("too many timers"));
+  // Build the call form once, quoting lambdas and closures
+  object *call = symbolp(fn) ? fn : cons(symbol(QUOTE), cons(fn, NULL));
+  object *form = limitedcall(cons(call, NULL), TIMERFUEL);
+  int id = ++TimerId;
+  push(cons(number(id), form), Roots[TIMERROOT]);
+  timerentry_t *t = &Timers[TimerCount];
+  t->due = millis() + delay;
+  t->period = period;
+  t->id = id;
+  t->runs = 0; t->maxjitter = 0; t->totaljitter = 0;
+  timersiftup(TimerCount++);
+  return id;
+}
+
+object *fn_scheduleevery (object *args, object *env) {
+  (void) env;
+  int ms = checkinteger(SCHEDULEEVERY, first(args));
+  if (ms <= 0) error(SCHEDULEEVERY, PSTR("period must be positive"), first(args));
+  return number(schedule(SCHEDULEEVERY, ms, ms, second(args)));
+}
+
+object *fn_scheduleat (object *args, object *env) {
+  (void) env;
+  int when = checkinteger(SCHEDULEAT, first(args));
+  if (!Time.isValid()) error2(SCHEDULEAT, PSTR("time not valid"));
+  int64_t secs = (int64_t)when - Time.now();
+  // Due times are compared as signed differences, so a delay must fit in an int32_t
+  if (secs > INT32_MAX/1000) error(SCHEDULEAT, PSTR("time too far ahead"), first(args));
+  return number(schedule(SCHEDULEAT, (secs > 0) ? (uint32_t)secs*1000 : 0, 0, second(args)));
+}
+
+object *fn_cancel (object *args, object *env) {
+  (void) env;
+  int id = checkinteger(CANCEL, first(args));
+  int i = timerfind(id);
+  if (i == -1) return nil;
+  timerremove(i);
+  timerform(id, true);
+  return tee;
+}
+
+object *fn_timerstats (object *args, object *env) {
+  (void) env;
+  int i = timerfind(checkinteger(TIMERSTATS, first(args)));
+  if (i == -1) return nil;
+  timerentry_t *t = &Timers[i];
+  int mean = (t->runs == 0) ? 0 : t->totaljitter / t->runs;
+  return cons(number(t->runs), cons(number(t->maxjitter), cons(number(mean), NULL)));
+}
+
+void runtimers () {
+  uint32_t now = millis();
+  while (TimerCount > 0 && (int32_t)(now - Timers[0].due) >= 0) {
+    timerentry_t *t = &Timers[0];
+    int id = t->id;
+    uint32_t jitter = now - t->due;
+    t->runs++;
+    t->totaljitter = t->totaljitter + jitter;
+    if (jitter > t->maxjitter) t->maxjitter = jitter;
+    object *form;
+    if (t->period) {
+      // Keep the phase, skipping any periods we have missed
+      do t->due = t->due + t->period; while ((int32_t)(now - t->due) >= 0);
+      timersiftdown(0);
+      form = timerform(id, false);
+    } else {
+      timerremove(0);
+      form = timerform(id, true);
+    }
+    if (form == NULL) { // Forms were dropped by load-image
+      int i = timerfind(id);
+      if (i != -1) timerremove(i);
+    } else {
+      // A one-shot timer's form is no longer in Roots[TIMERROOT]
+      push(form, GCStack);
+      eval(form, NULL);
+      pop(GCStack);
+    }
+    now = millis();
+  }
+}
+
+// Interrupts - each attached pin gets a slot with its own ISR, which only records the
+// pin level and time in a ring buffer; the events are delivered to the Lisp handlers,
+// kept in Roots[EVENTROOT] as an alist of (pin . fn), from eval and process_system
+
+#define EVENTSLOTS 8
+#define EVENTBUFSIZE 64   // Power of 2
+
+typedef struct {
+  uint32_t micros;
+  uint16_t pin;
+  uint8_t level;
+} event_t;
+
+event_t Events[EVENTBUFSIZE];
+volatile uint8_t EventHead = 0, EventTail = 0; // ISRs write head, runevents writes tail
+volatile uint32_t EventDrops = 0;
+uint32_t EventCount = 0;
+int EventPin[EVENTSLOTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+bool InEvents = false;
+
+// Only written from ISRs of one priority, which don't preempt each other
+void pushevent (int slot) {
+  uint8_t head = EventHead, next = (head + 1) & (EVENTBUFSIZE-1);
+  if (next == EventTail) { EventDrops++; return; }
+  event_t *e = &Events[head];
+  e->micros = micros();
+  e->pin = EventPin[slot];
+  e->level = pinReadFast(EventPin[slot]);
+  EventHead = next;
+}
+
+void isr0 () { pushevent(0); }
+void isr1 () { pushevent(1); }
+void isr2 () { pushevent(2); }
+void isr3 () { pushevent(3); }
+void isr4 () { pushevent(4); }
+void isr5 () { pushevent(5); }
+void isr6 () { pushevent(6); }
+void isr7 () { pushevent(7); }
+
+void (*const IsrTable[EVENTSLOTS])() = { isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7 };
+
+int eventslot (int pin) {
+  for (int i=0; i<EVENTSLOTS; i++) if (EventPin[i] == pin) return i;
+  return -1;
+}
+
+object *eventhandler (int pin, bool remove) {
+  object *prev = NULL;
+  object *list = Roots[EVENTROOT];
+  while (list != NULL) {
+    object *pair = car(list);
+    if (car(pair)->integer == pin) {
+      if (remove) {
+        if (prev == NULL) Roots[EVENTROOT] = cdr(list); else cdr(prev) = cdr(list);
+      }
+      return cdr(pair);
+    }
+    prev = list;
+    list = cdr(list);
+  }
+  return NULL;
+}
+
+void detachevent (int pin) {
+  int slot = eventslot(pin);
+  if (slot == -1) return;
+  detachInterrupt(pin);
+  EventPin[slot] = -1;
+  eventhandler(pin, true);
+}
+
+object *fn_attachinterrupt (object *args, object *env) {
+  (void) env;
+  int pin = checkinteger(ATTACHINTERRUPT, first(args));
+  int mode = checkinteger(ATTACHINTERRUPT, second(args));
+  object *fn = third(args);
+  InterruptMode modes[3] = { CHANGE, RISING, FALLING };
+  if (mode < 0 || mode > 2) error(ATTACHINTERRUPT, PSTR("invalid mode"), second(args));
+  detachevent(pin);
+  if (fn == NULL) return nil;
+  int slot = eventslot(-1);
+  if (slot == -1) error2(ATTACHINTERRUPT, PSTR("too many interrupts"));
+  push(cons(number(pin), fn), Roots[EVENTROOT]);
+  EventPin[slot] = pin;
+  if (!attachInterrupt(pin, IsrTable[slot], modes[mode])) {
+    EventPin[slot] = -1;
+    eventhandler(pin, true);
+    error(ATTACHINTERRUPT, PSTR("can't attach to pin"), first(args));
+  }
+  return tee;
+}
+
+object *fn_detachinterrupt (object *args, object *env) {
+  (void) env;
+  int pin = checkinteger(DETACHINTERRUPT, first(args));
+  if (eventslot(pin) == -1) return nil;
+  detachevent(pin);
+  return tee;
+}
+
+object *fn_interruptstats (object *args, object *env) {
+  (void) args, (void) env;
+  int queued = (EventHead - EventTail) & (EVENTBUFSIZE-1);
+  return cons(number(EventCount), cons(number(EventDrops), cons(number(queued), NULL)));
+}
+
+// Called from eval when EventHead != EventTail; calls (fn pin level micros) for each event.
+// Handlers have their own fuel, so the steps they take aren't charged to the code they interrupt,
+// and their garbage is collected before that code continues, so it still has the free space eval
+// made sure of
+void runevents (object *form, object *env) {
+  if (InEvents) return;
+  InEvents = true;
+  unsigned int free = Freespace;
+  uint8_t oldlimits = Limits;
+  uint32_t oldfuel = Fuel, olddeadline = Deadline;
+  Limits = 0;
+  jmp_buf dynamic_handler;
+  jmp_buf *previous_handler = handler;
+  handler = &dynamic_handler;
+  if (setjmp(dynamic_handler)) { // Out of memory building the call
+    handler = previous_handler;
+    InEvents = false;
+    Limits = oldlimits; Fuel = oldfuel; Deadline = olddeadline;
+    GCStack = NULL;
+    longjmp(*handler, 1);
+  }
+  push(form, GCStack);
+  push(env, GCStack);
+  while (EventTail != EventHead) {
+    event_t e = Events[EventTail];
+    EventTail = (EventTail + 1) & (EVENTBUFSIZE-1);
+    EventCount++;
+    object *fn = eventhandler(e.pin, false);
+    if (fn == NULL) continue; // Detached, or dropped by load-image
+    object *call = symbolp(fn) ? fn : cons(symbol(QUOTE), cons(fn, NULL));
+    object *callargs = cons(number(e.pin), cons(number(e.level), cons(number(e.micros), NULL)));
+    eval(limitedcall(cons(call, callargs), TIMERFUEL), NULL);
+  }
+  pop(GCStack); pop(GCStack);
+  handler = previous_handler;
+  InEvents = false;
+  Limits = oldlimits; Fuel = oldfuel; Deadline = olddeadline;
+  if (Freespace < free) gc(form, env);
+}
+
 void process_system() {
     Particle.process();
-    int h = Time.hour();
-    int min = Time.minute();
-    int s = (Time.second)();
-    if (Time.isValid() && (lastHour != h || lastMinute != min || lastSecond != s)) {
-        lastHour = h;
-        lastMinute = min;
-        lastSecond = s;
-        object *form = cons(symbol(IGNOREERRORS), cons(cons(newsymbol(pack40("alarm\0")), NULL), NULL));
-        eval(form, NULL);
-    }
+    runtimers();
+    if (EventHead != EventTail) runevents(NULL, NULL);
+    taskswitch();
 }
 
 const char string_fn_peek[] PROGMEM = "peek";
@@ -120,5 +452,12 @@ const char string_fn_poke[] PROGMEM = "poke";
 const char string_fn_publish[] PROGMEM = "publish";
 const char string_fn_now[] PROGMEM = "now";
 const char string_fn_zone[] PROGMEM = "zone";
+const char string_fn_scheduleevery[] PROGMEM = "schedule-every";
+const char string_fn_scheduleat[] PROGMEM = "schedule-at";
+const char string_fn_cancel[] PROGMEM = "cancel";
+const char string_fn_timerstats[] PROGMEM = "timer-stats";
+const char string_fn_attachinterrupt[] PROGMEM = "attach-interrupt";
+const char string_fn_detachinterrupt[] PROGMEM = "detach-interrupt";
+const char string_fn_interruptstats[] PROGMEM = "interrupt-stats";
 
 #endif
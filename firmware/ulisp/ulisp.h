@@ -8,12 +8,14 @@ typedef int BitOrder;
 
 // Compile options
 
-// #define resetautorun
+#define resetautorun
 #define printfreespace
 // #define printgcs
 // #define sdcardsupport
+#define serialflash
 // #define gfxsupport
 #define lisplibrary
+#define romlibrary
 #define assemblerlist
 #define lineeditor
 #define vt100
@@ -24,6 +26,7 @@ typedef uint16_t uint16;
 
 extern uint8_t End;
 extern jmp_buf toplevel_handler;
+extern jmp_buf *handler;
 
 void autorunimage ();
 
@@ -51,10 +54,15 @@ void autorunimage ();
 
 #define integerp(x)        ((x) != NULL && (x)->type == NUMBER)
 #define floatp(x)          ((x) != NULL && (x)->type == FLOAT)
+#define fixedp(x)          ((x) != NULL && (x)->type == FIXED)
 #define symbolp(x)         ((x) != NULL && (x)->type == SYMBOL)
 #define stringp(x)         ((x) != NULL && (x)->type == STRING_)
 #define characterp(x)      ((x) != NULL && (x)->type == CHARACTER)
 #define arrayp(x)          ((x) != NULL && (x)->type == ARRAY)
+#define hashtablep(x)      ((x) != NULL && (x)->type == HASHTABLE)
+#define ringp(x)           ((x) != NULL && (x)->type == RING)
+#define structp(x)         ((x) != NULL && (x)->type == STRUCT)
+#define generatorp(x)      ((x) != NULL && (x)->type == GENERATOR)
 #define streamp(x)         ((x) != NULL && (x)->type == STREAM)
 
 #define mark(x)            (car(x) = (object *)(((uintptr_t)(car(x))) | MARKBIT))
@@ -75,9 +83,12 @@ void autorunimage ();
 // Constants
 
 const int TRACEMAX = 3; // Number of traced functions
-enum type { ZZERO=0, SYMBOL=2, CODE=4, NUMBER=6, STREAM=8, CHARACTER=10, FLOAT=12, ARRAY=14, STRING_=16, PAIR=18 };  // ARRAY STRING and PAIR must be last
+enum type { ZZERO=0, SYMBOL=2, CODE=4, NUMBER=6, STREAM=8, CHARACTER=10, FLOAT=12, FIXED=14, RING=16, ARRAY=18, HASHTABLE=20, STRUCT=22, GENERATOR=24, STRING_=26, PAIR=28 };  // ARRAY HASHTABLE STRUCT GENERATOR STRING and PAIR must be last
 enum token { UNUSED, BRA, KET, QUO, DOT };
 enum stream { SERIALSTREAM, I2CSTREAM, SPISTREAM, SDSTREAM, STRINGSTREAM, GFXSTREAM };
+enum root { TIMERROOT, EVENTROOT, ROOTS }; // Objects referenced from C-side tables
+enum hashfield { HASHSLOTS, HASHTEST, HASHCOUNT, HASHUSED, HASHFLAGS }; // The list in a hash table's cdr
+enum hashflag { HASHSTALE=1, HASHWEAK=2 };
 
 // Stream names used by printobject
 const char serialstream[] PROGMEM = "serial";
@@ -88,10 +99,10 @@ const char stringstream[] PROGMEM = "string";
 const char gfxstream[] PROGMEM = "gfx";
 const char *const streamname[] PROGMEM = {serialstream, i2cstream, spistream, sdstream, stringstream, gfxstream};
 
-enum function { NIL, TEE, NOTHING, OPTIONAL, INITIALELEMENT, ELEMENTTYPE, BIT, AMPREST, LAMBDA, LET,
-LETSTAR, CLOSURE, SPECIAL_FORMS, QUOTE, DEFUN, DEFVAR, SETQ, LOOP, RETURN, PUSH, POP, INCF, DECF, SETF,
+enum function { NIL, TEE, NOTHING, OPTIONAL, INITIALELEMENT, ELEMENTTYPE, BIT, TEST, SIZE, INITIALVALUE, KEY,
+AMPREST, LAMBDA, LET, LETSTAR, CLOSURE, SPECIAL_FORMS, QUOTE, DEFUN, DEFMEMO, DEFSTRUCT, DEFVAR, SETQ, LOOP, RETURN, PUSH, POP, INCF, DECF, SETF,
 DOLIST, DOTIMES, TRACE, UNTRACE, FORMILLIS, WITHOUTPUTTOSTRING, WITHSERIAL, WITHI2C, WITHSPI, WITHSDCARD,
-WITHGFX, DEFCODE, UNWINDPROTECT, IGNOREERRORS, SP_ERROR, TAIL_FORMS, PROGN, IF, COND, WHEN, UNLESS, CASE, AND, OR, FUNCTIONS, NOT, NULLFN, CONS,
+WITHGFX, DEFCODE, UNWINDPROTECT, IGNOREERRORS, SP_ERROR, WITHFUEL, WITHDEADLINE, TAIL_FORMS, PROGN, IF, COND, WHEN, UNLESS, CASE, ECASE, AND, OR, FUNCTIONS, NOT, NULLFN, CONS,
 ATOM, LISTP, CONSP, SYMBOLP, ARRAYP, BOUNDP, SETFN, STREAMP, EQ, CAR, FIRST, CDR, REST, CAAR, CADR,
 SECOND, CDAR, CDDR, CAAAR, CAADR, CADAR, CADDR, THIRD, CDAAR, CDADR, CDDAR, CDDDR, LENGTH,
 ARRAYDIMENSIONS, LIST, MAKEARRAY, REVERSE, NTH, AREF, ASSOC, MEMBER, APPLY, FUNCALL, APPEND, MAPC, MAPCAR,
@@ -105,7 +116,14 @@ WRITEBYTE, WRITESTRING, WRITELINE, RESTARTI2C, GC, ROOM, SAVEIMAGE, LOADIMAGE, C
 DIGITALWRITE, ANALOGREAD, ANALOGWRITE, DELAY, MILLIS, SLEEP, NOTE, EDIT, PPRINT, PPRINTALL, FORMAT,
 REQUIRE, LISTLIBRARY, DRAWPIXEL, DRAWLINE, DRAWRECT, FILLRECT, DRAWCIRCLE, FILLCIRCLE, DRAWROUNDRECT,
 FILLROUNDRECT, DRAWTRIANGLE, FILLTRIANGLE, DRAWCHAR, SETCURSOR, SETTEXTCOLOR, SETTEXTSIZE, SETTEXTWRAP,
-FILLSCREEN, SETROTATION, INVERTDISPLAY, _ENDFUNCTIONS };
+FILLSCREEN, SETROTATION, INVERTDISPLAY, SPAWN, TASKYIELD, TASKJOIN, HEAPEVAL, CHECKPOINT,
+CHECKPOINTSTATS, KVPUT, KVGET, KVDELETE, SERIALIZE,
+DESERIALIZE, READSEQUENCE, WRITESEQUENCE, EQUAL, MAKEHASHTABLE, GETHASH, REMHASH, MAPHASH,
+HASHTABLECOUNT, SXHASH, MEMOIZE, MEMOSTATS, FIXEDFN, FIXEDP, ARRAYMAP, ARRAYADD, ARRAYSCALE, DOTFN,
+ARRAYSUM, ARRAYMIN, ARRAYMAX, CONVOLVE, REDUCE, COUNTIF, FINDIF, POSITION, EVERY, SOME,
+MAKEGENERATOR, NEXT, GENMAP, GENFILTER, GENTAKE, MAKERING, RINGPUSH, RINGPOP, RINGREF, RINGLENGTH,
+RINGSUM, RINGMEAN, RINGMIN, RINGMAX, RINGVARIANCE,
+_ENDFUNCTIONS };
 
 // Typedefs
 
@@ -143,6 +161,12 @@ typedef int (*gfun_t)();
 typedef void (*pfun_t)(char);
 typedef int PinMode_;
 
+extern object *GCStack;
+extern object *Roots[ROOTS];
+extern unsigned int Freespace;
+extern uint8_t Limits;
+extern uint32_t Fuel, Deadline;
+
 // API
 
 #define ULISP_SETUP_EXCEPTION_HANDLING \
@@ -155,12 +179,14 @@ typedef int PinMode_;
 void ulisp_setup ();
 void ulisp_reset ();
 void repl (object *env);
+void taskswitch ();
 
 // Forward declarations
 
 inline int maxbuffer (char *buffer);
 char nthchar (object *string, int n);
 void pserial (char c);
+void serialflush ();
 void pfstring (const char *s, pfun_t pfun);
 void pint (int i, pfun_t pfun);
 inline void pln (pfun_t pfun);
@@ -192,6 +218,7 @@ void prin1object (object *form, pfun_t pfun);
 extern object *tee;
 object *tf_progn (object *form, object *env);
 object *eval (object *form, object *env);
+void gc (object *form, object *env);
 object *read (gfun_t gfun);
 void repl(object *env);
 void prin1object (object *form, pfun_t pfun);
@@ -207,6 +234,7 @@ int pack40 (const char *buffer);
 
 object *number (int n);
 object *makefloat (float f);
+object *makefixed (int32_t q);
 object *character (char c);
 
 #define LOOKUP_TABLE_ENTRIES
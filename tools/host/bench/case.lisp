@@ -0,0 +1,45 @@
+; Byte decoders for [user-050] case tables. Prints the best of 7 runs, in milliseconds, of
+; decoding 200 bytes 500 times with: a 40-way case on the keys 0 to 39, which gets a jump table;
+; a 40-way case on keys spread out to 255, which gets a sorted table; the same 40-way decoder as
+; a cond of eq tests, the way case used to search; a 3-way case, too small for a table; and
+; the loop alone.
+;
+;   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+;   python3 tools/upload.py --exec build/host/ulisp_big tools/host/bench/case.lisp
+
+(defun decode (b)
+  (case b
+    (0 1) (1 2) (2 3) (3 4) (4 5) (5 6) (6 7) (7 8) (8 9) (9 10)
+    (10 11) (11 12) (12 13) (13 14) (14 15) (15 16) (16 17) (17 18) (18 19) (19 20)
+    (20 21) (21 22) (22 23) (23 24) (24 25) (25 26) (26 27) (27 28) (28 29) (29 30)
+    (30 31) (31 32) (32 33) (33 34) (34 35) (35 36) (36 37) (37 38) (38 39) (39 40)
+    (t 0)))
+
+(defun sparse (b)
+  (case b
+    (0 1) (7 2) (14 3) (21 4) (28 5) (35 6) (42 7) (49 8) (56 9) (63 10)
+    (70 11) (77 12) (84 13) (91 14) (98 15) (105 16) (112 17) (119 18) (126 19) (133 20)
+    (140 21) (147 22) (154 23) (161 24) (168 25) (175 26) (182 27) (189 28) (196 29) (203 30)
+    (210 31) (217 32) (224 33) (231 34) (238 35) (245 36) (252 37) (253 38) (254 39) (255 40)
+    (t 0)))
+
+(eval (list 'defun 'linear '(b)
+  (cons 'cond (let (l) (dotimes (i 40) (push (list (list 'eq 'b i) (1+ i)) l)) (reverse (cons '(t 0) l))))))
+
+(defun small (b) (case b (0 1) (1 2) (2 3) (t 0)))
+(defun ident (b) b)
+
+(defvar bytes (let (l) (dotimes (i 200) (push (mod (* i 7) 40) l)) l))
+(defvar sbytes (mapcar (lambda (x) (* 7 x)) bytes))
+
+(defun once (f data)
+  (let ((t0 (millis))) (dotimes (k 500) (dolist (b data) (funcall f b))) (- (millis) t0)))
+
+(defun best (f data)
+  (let ((m 100000)) (dotimes (r 7) (setq m (min m (once f data)))) m))
+
+(format t "loop ~a ms~%" (best ident bytes))
+(format t "dense case ~a ms~%" (best decode bytes))
+(format t "sparse case ~a ms~%" (best sparse sbytes))
+(format t "cond of eq ~a ms~%" (best linear bytes))
+(format t "3-way case ~a ms~%" (best small bytes))
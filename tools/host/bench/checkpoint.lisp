@@ -0,0 +1,124 @@
+; Flash wear of checkpoint against save-image, for [user-034] incremental checkpoints.
+; An image of 25 functions is saved, then one variable is updated 20 times and saved after
+; each update, first with checkpoint and then with save-image. Prints the pages programmed
+; and the sectors erased by each series, from checkpoint-stats.
+;
+;   tools/host/build.sh && rm -f build/host/flash.bin
+;   python3 tools/upload.py --exec build/host/ulisp tools/host/bench/checkpoint.lisp
+
+(defun fn0 (x y) (let ((a (* x 0)) (b (list x y 0))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 0)) b))))
+(defun fn1 (x y) (let ((a (* x 1)) (b (list x y 1))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 1)) b))))
+(defun fn2 (x y) (let ((a (* x 2)) (b (list x y 2))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 2)) b))))
+(defun fn3 (x y) (let ((a (* x 3)) (b (list x y 3))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 3)) b))))
+(defun fn4 (x y) (let ((a (* x 4)) (b (list x y 4))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 4)) b))))
+(defun fn5 (x y) (let ((a (* x 5)) (b (list x y 5))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 5)) b))))
+(defun fn6 (x y) (let ((a (* x 6)) (b (list x y 6))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 6)) b))))
+(defun fn7 (x y) (let ((a (* x 7)) (b (list x y 7))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 7)) b))))
+(defun fn8 (x y) (let ((a (* x 8)) (b (list x y 8))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 8)) b))))
+(defun fn9 (x y) (let ((a (* x 9)) (b (list x y 9))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 9)) b))))
+(defun fn10 (x y) (let ((a (* x 10)) (b (list x y 10))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 10)) b))))
+(defun fn11 (x y) (let ((a (* x 11)) (b (list x y 11))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 11)) b))))
+(defun fn12 (x y) (let ((a (* x 12)) (b (list x y 12))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 12)) b))))
+(defun fn13 (x y) (let ((a (* x 13)) (b (list x y 13))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 13)) b))))
+(defun fn14 (x y) (let ((a (* x 14)) (b (list x y 14))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 14)) b))))
+(defun fn15 (x y) (let ((a (* x 15)) (b (list x y 15))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 15)) b))))
+(defun fn16 (x y) (let ((a (* x 16)) (b (list x y 16))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 16)) b))))
+(defun fn17 (x y) (let ((a (* x 17)) (b (list x y 17))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 17)) b))))
+(defun fn18 (x y) (let ((a (* x 18)) (b (list x y 18))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 18)) b))))
+(defun fn19 (x y) (let ((a (* x 19)) (b (list x y 19))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 19)) b))))
+(defun fn20 (x y) (let ((a (* x 20)) (b (list x y 20))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 20)) b))))
+(defun fn21 (x y) (let ((a (* x 21)) (b (list x y 21))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 21)) b))))
+(defun fn22 (x y) (let ((a (* x 22)) (b (list x y 22))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 22)) b))))
+(defun fn23 (x y) (let ((a (* x 23)) (b (list x y 23))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 23)) b))))
+(defun fn24 (x y) (let ((a (* x 24)) (b (list x y 24))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 24)) b))))
+
+(defvar counter 0)
+(defvar start nil)
+(defun wear () (let ((s (checkpoint-stats))) (list (nth 4 s) (nth 5 s))))
+(defun report (what) (let ((w (wear))) (format t "~a: ~a page writes, ~a sector erases~%" what (- (first w) (first start)) (- (second w) (second start)))))
+
+(save-image)
+(setq start (wear))
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(incf counter)
+(checkpoint)
+(report "20 checkpoints")
+(setq start (wear))
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(incf counter)
+(save-image)
+(report "20 save-images")
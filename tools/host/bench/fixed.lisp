@@ -0,0 +1,27 @@
+; Accuracy and speed of Q16.16 fixed-point arithmetic against floats, for [user-044]. Prints
+; the largest error of +, * and / on 5000 random pairs of operands in [-2, 2] (divisors in
+; [2.5, 6.5]), compared with the same operation on floats, and the milliseconds for a
+; 1000000-step multiply-accumulate loop with each type. The host has an FPU, so the times only
+; compare the interpreter overhead; on the Duo floats go through the soft-float library.
+;
+;   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+;   python3 tools/upload.py --exec build/host/ulisp_big tools/host/bench/fixed.lisp
+
+(defun rnd () (- (/ (random 40000) 10000.0) 2))
+
+(defun worst (op a-range b-offset n)
+  (let ((worst 0.0))
+    (dotimes (i n)
+      (let* ((a (fixed (funcall a-range))) (b (fixed (+ b-offset (funcall a-range))))
+             (e (abs (- (float (funcall op a b)) (funcall op (float a) (float b))))))
+        (when (> e worst) (setq worst e))))
+    worst))
+
+(format t "max error: + ~a, * ~a, / ~a~%" (worst '+ rnd 0 5000) (worst '* rnd 0 5000) (worst '/ rnd 4.5 5000))
+
+(defun macq (n) (let ((acc #q0) (x #q0.5) (k #q0.75)) (dotimes (i n) (setq acc (+ acc (* x k)))) acc))
+(defun macf (n) (let ((acc 0.0) (x 0.5) (k 0.75)) (dotimes (i n) (setq acc (+ acc (* x k)))) acc))
+(defun tm (f n) (let ((s (millis))) (funcall f n) (- (millis) s)))
+
+(format t "multiply-accumulate: fixed ~a ms, float ~a ms~%" (tm macq 1000000) (tm macf 1000000))
+(format t "multiply-accumulate: fixed ~a ms, float ~a ms~%" (tm macq 1000000) (tm macf 1000000))
@@ -0,0 +1,21 @@
+; Lookups in a hash table against an association list, for [user-041] hash tables. For 10, 100
+; and 1000 entries with integer keys, prints the milliseconds for 400000 lookups with assoc and
+; with gethash, and for the loop alone.
+;
+;   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+;   python3 tools/upload.py --exec build/host/ulisp_big tools/host/bench/hashtable.lisp
+
+(defun alist (n) (let (l) (dotimes (i n) (push (cons i i) l)) l))
+(defun table (n) (let ((h (make-hash-table))) (dotimes (i n) (setf (gethash i h) i)) h))
+(defun tm (f) (let ((m (millis))) (funcall f) (- (millis) m)))
+
+(defun bench (n)
+  (let ((a (alist n)) (h (table n)))
+    (format t "~a entries: loop ~a ms, assoc ~a ms, gethash ~a ms~%" n
+      (tm (lambda () (dotimes (i 400000) (mod i n))))
+      (tm (lambda () (dotimes (i 400000) (assoc (mod i n) a))))
+      (tm (lambda () (dotimes (i 400000) (gethash (mod i n) h)))))))
+
+(bench 10)
+(bench 100)
+(bench 1000)
@@ -0,0 +1,70 @@
+; Serial writes made by pprintall, for [user-039] buffered serial output. Defines an image of
+; 30 functions and 30 variables, about 5.7 KB of pprintall output, then prints it. With
+; COUNTWRITES set, the host build reports its Serial.write calls when it exits, so the writes
+; of pprintall are the difference between a run of this file and one without its last line:
+;
+;   COUNTWRITES=1 python3 tools/upload.py --exec build/host/ulisp tools/host/bench/pprintall.lisp
+;   sed '$d' tools/host/bench/pprintall.lisp > /tmp/base.lisp
+;   COUNTWRITES=1 python3 tools/upload.py --exec build/host/ulisp /tmp/base.lisp
+
+(defun fn0 (x y) (let ((a (* x 0)) (b (list x y 0))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 0)) b))))
+(defvar var0 '("string 0" 0.5 #\a (nested (list 0))))
+(defun fn1 (x y) (let ((a (* x 1)) (b (list x y 1))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 1)) b))))
+(defvar var1 '("string 1" 1.5 #\a (nested (list 1))))
+(defun fn2 (x y) (let ((a (* x 2)) (b (list x y 2))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 2)) b))))
+(defvar var2 '("string 2" 2.5 #\a (nested (list 2))))
+(defun fn3 (x y) (let ((a (* x 3)) (b (list x y 3))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 3)) b))))
+(defvar var3 '("string 3" 3.5 #\a (nested (list 3))))
+(defun fn4 (x y) (let ((a (* x 4)) (b (list x y 4))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 4)) b))))
+(defvar var4 '("string 4" 4.5 #\a (nested (list 4))))
+(defun fn5 (x y) (let ((a (* x 5)) (b (list x y 5))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 5)) b))))
+(defvar var5 '("string 5" 5.5 #\a (nested (list 5))))
+(defun fn6 (x y) (let ((a (* x 6)) (b (list x y 6))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 6)) b))))
+(defvar var6 '("string 6" 6.5 #\a (nested (list 6))))
+(defun fn7 (x y) (let ((a (* x 7)) (b (list x y 7))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 7)) b))))
+(defvar var7 '("string 7" 7.5 #\a (nested (list 7))))
+(defun fn8 (x y) (let ((a (* x 8)) (b (list x y 8))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 8)) b))))
+(defvar var8 '("string 8" 8.5 #\a (nested (list 8))))
+(defun fn9 (x y) (let ((a (* x 9)) (b (list x y 9))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 9)) b))))
+(defvar var9 '("string 9" 9.5 #\a (nested (list 9))))
+(defun fn10 (x y) (let ((a (* x 10)) (b (list x y 10))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 10)) b))))
+(defvar var10 '("string 10" 10.5 #\a (nested (list 10))))
+(defun fn11 (x y) (let ((a (* x 11)) (b (list x y 11))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 11)) b))))
+(defvar var11 '("string 11" 11.5 #\a (nested (list 11))))
+(defun fn12 (x y) (let ((a (* x 12)) (b (list x y 12))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 12)) b))))
+(defvar var12 '("string 12" 12.5 #\a (nested (list 12))))
+(defun fn13 (x y) (let ((a (* x 13)) (b (list x y 13))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 13)) b))))
+(defvar var13 '("string 13" 13.5 #\a (nested (list 13))))
+(defun fn14 (x y) (let ((a (* x 14)) (b (list x y 14))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 14)) b))))
+(defvar var14 '("string 14" 14.5 #\a (nested (list 14))))
+(defun fn15 (x y) (let ((a (* x 15)) (b (list x y 15))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 15)) b))))
+(defvar var15 '("string 15" 15.5 #\a (nested (list 15))))
+(defun fn16 (x y) (let ((a (* x 16)) (b (list x y 16))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 16)) b))))
+(defvar var16 '("string 16" 16.5 #\a (nested (list 16))))
+(defun fn17 (x y) (let ((a (* x 17)) (b (list x y 17))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 17)) b))))
+(defvar var17 '("string 17" 17.5 #\a (nested (list 17))))
+(defun fn18 (x y) (let ((a (* x 18)) (b (list x y 18))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 18)) b))))
+(defvar var18 '("string 18" 18.5 #\a (nested (list 18))))
+(defun fn19 (x y) (let ((a (* x 19)) (b (list x y 19))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 19)) b))))
+(defvar var19 '("string 19" 19.5 #\a (nested (list 19))))
+(defun fn20 (x y) (let ((a (* x 20)) (b (list x y 20))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 20)) b))))
+(defvar var20 '("string 20" 20.5 #\a (nested (list 20))))
+(defun fn21 (x y) (let ((a (* x 21)) (b (list x y 21))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 21)) b))))
+(defvar var21 '("string 21" 21.5 #\a (nested (list 21))))
+(defun fn22 (x y) (let ((a (* x 22)) (b (list x y 22))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 22)) b))))
+(defvar var22 '("string 22" 22.5 #\a (nested (list 22))))
+(defun fn23 (x y) (let ((a (* x 23)) (b (list x y 23))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 23)) b))))
+(defvar var23 '("string 23" 23.5 #\a (nested (list 23))))
+(defun fn24 (x y) (let ((a (* x 24)) (b (list x y 24))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 24)) b))))
+(defvar var24 '("string 24" 24.5 #\a (nested (list 24))))
+(defun fn25 (x y) (let ((a (* x 25)) (b (list x y 25))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 25)) b))))
+(defvar var25 '("string 25" 25.5 #\a (nested (list 25))))
+(defun fn26 (x y) (let ((a (* x 26)) (b (list x y 26))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 26)) b))))
+(defvar var26 '("string 26" 26.5 #\a (nested (list 26))))
+(defun fn27 (x y) (let ((a (* x 27)) (b (list x y 27))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 27)) b))))
+(defvar var27 '("string 27" 27.5 #\a (nested (list 27))))
+(defun fn28 (x y) (let ((a (* x 28)) (b (list x y 28))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 28)) b))))
+(defvar var28 '("string 28" 28.5 #\a (nested (list 28))))
+(defun fn29 (x y) (let ((a (* x 29)) (b (list x y 29))) (if (> a y) (cons a b) (mapcar (lambda (z) (+ z 29)) b))))
+(defvar var29 '("string 29" 29.5 #\a (nested (list 29))))
+(pprintall)
@@ -0,0 +1,22 @@
+; Cells allocated and time taken by reduce and count-if against the (apply '+ (mapcar f xs))
+; idiom, for [user-046] sequence functions. For a 1000-element list, each line gives the cells
+; one call allocates, including about 18 cells of measurement overhead, and the milliseconds
+; for 1000 calls.
+;
+;   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+;   python3 tools/upload.py --exec build/host/ulisp_big tools/host/bench/reduce.lisp
+
+(defvar xs nil)
+(dotimes (i 1000) (push i xs))
+(defun sq (x) (* x x))
+
+(defun cells (f) (let ((r (room))) (funcall f) (- r (room))))
+(defun tm (f) (let ((s (millis))) (dotimes (z 1000) (funcall f)) (- (millis) s)))
+(defun bench (what f) (format t "~a: ~a cells, ~a ms~%" what (cells f) (tm f)))
+
+(bench "(apply '+ (mapcar '1+ xs))" (lambda () (apply '+ (mapcar '1+ xs))))
+(bench "(reduce '+ xs :key '1+)" (lambda () (reduce '+ xs :key '1+)))
+(bench "(apply '+ (mapcar sq xs))" (lambda () (apply '+ (mapcar sq xs))))
+(bench "(reduce '+ xs :key sq)" (lambda () (reduce '+ xs :key sq)))
+(bench "(apply '+ (mapcar (lambda (x) (if (evenp x) 1 0)) xs))" (lambda () (apply '+ (mapcar (lambda (x) (if (evenp x) 1 0)) xs))))
+(bench "(count-if 'evenp xs)" (lambda () (count-if 'evenp xs)))
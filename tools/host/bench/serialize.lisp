@@ -0,0 +1,26 @@
+; Size and speed of serialize and deserialize against prin1-to-string and read-from-string,
+; for [user-037] binary serialization. Each line gives the bytes of the binary and the text
+; encoding, then the milliseconds for 200 writes and 200 reads of each.
+;
+;   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+;   python3 tools/upload.py --exec build/host/ulisp_big tools/host/bench/serialize.lisp
+
+(defvar floats nil)
+(dotimes (i 200) (push (* i 1.37) floats))
+(defvar ints nil)
+(dotimes (i 200) (push (* i 97) ints))
+(defvar rows nil)
+(dotimes (i 50) (push (list 'name "label" i 'state) rows))
+
+(defun tm (f) (let ((m (millis))) (dotimes (i 200) (funcall f)) (- (millis) m)))
+
+(defun bench (what x)
+  (let ((bs (serialize x)) (ps (prin1-to-string x)))
+    (format t "~a: ~a vs ~a bytes; write ~a vs ~a ms; read ~a vs ~a ms~%" what
+      (length bs) (length ps)
+      (tm (lambda () (serialize x))) (tm (lambda () (prin1-to-string x)))
+      (tm (lambda () (deserialize bs))) (tm (lambda () (read-from-string ps))))))
+
+(bench "200 floats" floats)
+(bench "200 integers" ints)
+(bench "50 symbol/string rows" rows)
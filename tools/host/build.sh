@@ -0,0 +1,44 @@
+#!/bin/sh
+# Builds the firmware as a Linux program, build/host/ulisp, with the REPL on standard input and
+# output and the serial flash in build/host/flash.bin. The copy of the firmware is patched so
+# that a cell holds two 64-bit pointers, without vt100 editing and without '~' escape polling.
+#
+#   tools/host/build.sh
+#   WORKSPACESIZE=60000 OUT=build/host/ulisp_big tools/host/build.sh
+#   NOROMLIBRARY=1 OUT=build/host/ulisp_norom tools/host/build.sh
+
+set -e
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+BUILD=$ROOT/build/host
+OUT=${OUT:-$BUILD/ulisp}
+SRC=$BUILD/src
+
+mkdir -p "$BUILD"
+rm -rf "$SRC"
+cp -r "$ROOT/firmware" "$SRC"
+
+patch () {
+  grep -q "$2" "$SRC/$1" || { echo "build.sh: can't find '$2' in $1" >&2; exit 1; }
+  sed -i "s|$2|$3|" "$SRC/$1"
+}
+patch ulisp/ulisp.h "^      unsigned int type;" "      uintptr_t type;"
+patch ulisp/ulisp.h "^        float single_float;" "        float single_float;\n        intptr_t host_pad_;"
+patch ulisp/ulisp.h "^#define vt100" ""
+if [ -n "$NOROMLIBRARY" ]; then patch ulisp/ulisp.h "^#define romlibrary" ""; fi
+# A number, character or float only sets the low 32 bits of its cell's cdr, and eq() compares whole
+# cdrs, so with 64-bit pointers the stale upper half of a reused cell would make equal numbers differ.
+# myalloc() clears the cdr here; the Duo's 32-bit cells don't need it, so the device doesn't do it
+patch ulisp/core/ulisp-stm32.cpp "^  Freelist = cdr(Freelist);" "  Freelist = cdr(Freelist); cdr(temp) = NULL;"
+patch ulisp/core/ulisp-stm32.cpp "^  if (Serial.read() == '~') error2(0, PSTR(\"escape!\"));" ""
+if [ -n "$WORKSPACESIZE" ]; then
+  patch ulisp/core/ulisp-stm32.cpp "^#define WORKSPACESIZE [0-9]*" "#define WORKSPACESIZE $WORKSPACESIZE"
+fi
+
+# peek and poke cast integers to pointers, which only warns on a 64-bit host
+FLAGS="-funsigned-char -fno-pie -O1 -Wall -Wno-unused-parameter -Wno-int-to-pointer-cast -DHOST_BUILD -DSERIALFLASHFILE=\"$BUILD/flash.bin\" -I$ROOT/tools/host/stub -I$SRC $CXXFLAGS"
+g++ $FLAGS -c "$SRC/ulisp/core/ulisp-stm32.cpp" -o "$BUILD/core.o"
+g++ $FLAGS -c "$SRC/ulisp/library.cpp" -o "$BUILD/library.o"
+g++ $FLAGS -c "$ROOT/tools/host/main.cpp" -o "$BUILD/main.o"
+# Binding symbols at load time keeps the dynamic linker off the small task stacks
+g++ "$BUILD/core.o" "$BUILD/library.o" "$BUILD/main.o" -o "$OUT" -no-pie -Wl,-z,now -lm -lpthread
+echo "$OUT"
@@ -0,0 +1,44 @@
+// The Linux host version of firmware/ulisp.cpp, with the REPL on standard input and output
+
+#include "Particle.h"
+#include "SPI.h"
+#include "Wire.h"
+
+HostSerial Serial, Serial1;
+HostTime Time;
+HostParticle Particle;
+SPIClass SPI;
+TwoWire Wire;
+
+#include "ulisp/ulisp.h"
+#include <pthread.h>
+
+void (*HostIsr[64])(void);
+volatile int HostLevel[64];
+
+// HOST_EVENTS="pin count interval delay" toggles the pin count times, interval microseconds
+// apart, after delay milliseconds, calling the interrupt routine attached to it each time
+
+static void *injector (void *) {
+  int pin, count, interval, wait;
+  if (sscanf(getenv("HOST_EVENTS"), "%d %d %d %d", &pin, &count, &interval, &wait) != 4 || pin < 0 || pin >= 64) return 0;
+  usleep(wait*1000);
+  for (int i=0; i<count; i++) {
+    HostLevel[pin] = !HostLevel[pin];
+    if (HostIsr[pin]) HostIsr[pin]();
+    usleep(interval);
+  }
+  return 0;
+}
+
+int main () {
+  setvbuf(stdout, 0, _IONBF, 0);
+  ulisp_setup();
+  pthread_t thread;
+  if (getenv("HOST_EVENTS")) pthread_create(&thread, 0, injector, 0);
+  for (;;) {
+    ULISP_SETUP_EXCEPTION_HANDLING
+    ulisp_reset();
+    repl(NULL);
+  }
+}
@@ -0,0 +1,151 @@
+// Just enough of the Particle API to build the firmware on a Linux host - see tools/host/build.sh
+
+#ifndef HOST_PARTICLE_H
+#define HOST_PARTICLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <algorithm>
+
+using std::abs;
+typedef bool boolean;
+typedef int PinMode;
+
+#define PROGMEM
+#define PSTR(s) (s)
+typedef const char *PGM_P;
+
+#define SYSTEM_MODE(x)
+#define SYSTEM_THREAD(x)
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define INPUT_PULLDOWN 3
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define bitRead(v,b) (((v)>>(b))&1)
+
+// Time
+
+static inline unsigned long micros () { struct timeval tv; gettimeofday(&tv, 0); return (unsigned long)(tv.tv_sec*1000000ULL + tv.tv_usec); }
+static inline unsigned long millis () { return micros()/1000; }
+static inline void delay (unsigned long ms) { usleep(ms*1000); }
+static inline void delayMicroseconds (unsigned int us) { usleep(us); }
+static inline void yield () { }
+
+// Pins - analogread returns ten times the pin number
+
+static inline void pinMode (int, int) { }
+static inline void digitalWrite (int, int) { }
+static inline int digitalRead (int) { return 0; }
+static inline int analogRead (int pin) { return pin*10; }
+static inline void analogWrite (int, int) { }
+static inline void shiftOut (int, int, int, uint8_t) { }
+static inline uint8_t shiftIn (int, int, int) { return 0; }
+static inline void tone (int, int) { }
+static inline void noTone (int) { }
+static inline long random (long n) { return n ? rand()%n : 0; }
+static inline void randomSeed (unsigned long seed) { srand(seed); }
+
+// Interrupts - main.cpp calls the attached ISRs from a thread to fake edges
+
+typedef int InterruptMode;
+extern void (*HostIsr[64])(void);
+extern volatile int HostLevel[64];
+static inline bool attachInterrupt (uint16_t pin, void (*isr)(void), InterruptMode) { if (pin >= 64) return false; HostIsr[pin] = isr; return true; }
+static inline void detachInterrupt (uint16_t pin) { HostIsr[pin] = 0; }
+static inline int pinReadFast (int pin) { return HostLevel[pin]; }
+static inline void noInterrupts () { }
+static inline void interrupts () { }
+
+class String {
+ public:
+  std::string s;
+  String () { }
+  String (const char *c) : s(c) { }
+  String (char c) : s(1, c) { }
+  void concat (const String &other) { s += other.s; }
+  void concat (const char *other) { s += other; }
+  void replace (const char *from, const char *to) {
+    std::string result;
+    size_t n = strlen(from);
+    for (size_t i=0; i<s.size();) {
+      if (s.compare(i, n, from) == 0) { result += to; i += n; } else result += s[i++];
+    }
+    s = result;
+  }
+  const char *c_str () const { return s.c_str(); }
+};
+
+// Serial is standard input and output; the host exits at the end of its input. With COUNTWRITES
+// set, it prints the number of write calls on exit
+
+class HostSerial {
+ public:
+  long writes = 0;
+  ~HostSerial () { if (getenv("COUNTWRITES") && writes) fprintf(stderr, "serial writes: %ld\n", writes); }
+  void begin (long) { }
+  void end () { }
+  void flush () { fflush(stdout); }
+  bool isConnected () { return true; }
+  operator bool () { return true; }
+  int available () {
+    struct pollfd p = {0, POLLIN, 0};
+    if (poll(&p, 1, 0) > 0) {
+      if ((p.revents & POLLHUP) && !(p.revents & POLLIN)) exit(0);
+      return 1;
+    }
+    return 0;
+  }
+  int read () {
+    if (!available()) return -1;
+    unsigned char c;
+    if (::read(0, &c, 1) <= 0) { fflush(stdout); exit(0); }
+    return c;
+  }
+  size_t write (uint8_t c) { writes++; putchar(c); return 1; }
+  size_t write (const uint8_t *buffer, size_t n) { writes++; fwrite(buffer, 1, n, stdout); return n; }
+  size_t readBytes (char *buffer, size_t n) { size_t i = 0; while (i < n && available()) buffer[i++] = read(); return i; }
+};
+extern HostSerial Serial, Serial1;
+
+class HostTime {
+ public:
+  time_t local () { return ::time(0); }
+  time_t now () { return ::time(0); }
+  int hour (time_t t = ::time(0)) { return gmtime(&t)->tm_hour; }
+  int minute (time_t t = ::time(0)) { return gmtime(&t)->tm_min; }
+  int second (time_t t = ::time(0)) { return gmtime(&t)->tm_sec; }
+  bool isValid () { return true; }
+  void zone (float) { }
+};
+extern HostTime Time;
+
+class HostParticle {
+ public:
+  void process () { }
+  bool publish (const String &, const String &) { return true; }
+  template <class F> bool function (const char *, F) { return true; }
+};
+extern HostParticle Particle;
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+#include "Particle.h"
+
+struct SPISettings {
+  SPISettings (unsigned long, int, int) { }
+};
+
+class SPIClass {
+ public:
+  void begin () { }
+  void beginTransaction (SPISettings) { }
+  void endTransaction () { }
+  uint8_t transfer (uint8_t) { return 0; }
+  void transfer (void *, void *, size_t, void *) { }
+};
+extern SPIClass SPI;
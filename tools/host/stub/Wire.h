@@ -0,0 +1,14 @@
+#pragma once
+#include "Particle.h"
+
+class TwoWire {
+ public:
+  void begin () { }
+  int read () { return 0; }
+  size_t write (uint8_t) { return 1; }
+  size_t write (const uint8_t *, size_t n) { return n; }
+  void beginTransmission (int) { }
+  int endTransmission (bool = true) { return 0; }
+  int requestFrom (int, int) { return 0; }
+};
+extern TwoWire Wire;
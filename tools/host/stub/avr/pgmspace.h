@@ -0,0 +1 @@
+// PROGMEM and PSTR are defined in Particle.h
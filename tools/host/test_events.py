@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Checks interrupt event delivery on the host build, build/host/ulisp.
+
+The host's main.cpp toggles a pin from another thread when HOST_EVENTS is set,
+calling the routine that attach-interrupt installed, which queues the event
+with pushevent() just as a pin interrupt does on the Duo.
+
+    tools/host/build.sh && python3 tools/host/test_events.py
+
+ordering: 200 edges, 500us apart, while the REPL waits for input. The handler
+must see all of them in order, with alternate levels and increasing times,
+and interrupt-stats must report (200 0 0).
+
+overflow: 1000 edges, 20us apart, during (delay 1500), when no handlers run.
+The queue fills up, so some events are dropped, and interrupt-stats must
+account for every edge as either delivered or dropped.
+
+fuel: handlers that run while a with-fuel form is being evaluated use their
+own fuel, not the form's.
+
+garbage: the garbage that handlers make is collected before the code they
+interrupted continues.
+
+ULISP names another binary to test.
+"""
+
+import os
+import re
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+ULISP = os.environ.get("ULISP", os.path.join(ROOT, "build", "host", "ulisp"))
+PIN = 5
+
+
+def session(events, lines, wait):
+    """Runs the REPL with HOST_EVENTS set, typing each (line, pause) pair, and returns its output."""
+    env = dict(os.environ, HOST_EVENTS=events)
+    proc = subprocess.Popen([ULISP], stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env)
+    time.sleep(0.3)
+    for line, pause in lines:
+        proc.stdin.write(line.encode() + b"\n")
+        proc.stdin.flush()
+        time.sleep(pause)
+    time.sleep(wait)
+    out, _ = proc.communicate(timeout=10)
+    return out.decode(errors="replace")
+
+
+def stats(out):
+    found = re.findall(r"^\((\d+) (\d+) (\d+)\)\s*$", out, re.M)
+    if not found:
+        raise AssertionError("no interrupt-stats in output:\n" + out)
+    return tuple(int(n) for n in found[-1])
+
+
+def test_ordering():
+    count = 200
+    out = session("%d %d 500 1000" % (PIN, count), [
+        ("(defvar *events* nil)", 0.1),
+        ("(attach-interrupt %d 0 (lambda (pin level time) (push (list level time) *events*)))" % PIN, 1.5),
+        ("(dolist (e (reverse *events*)) (format t \"event ~a ~a~%\" (first e) (second e)))", 0.5),
+        ("(interrupt-stats)", 0.1),
+    ], 0.2)
+    seen = [(int(l), int(t)) for l, t in re.findall(r"^event (\d+) (-?\d+)", out, re.M)]
+    assert len(seen) == count, "%d of %d events delivered" % (len(seen), count)
+    for i, (level, t) in enumerate(seen):
+        assert level == (i + 1) % 2, "event %d has level %d" % (i, level)
+        if i:
+            # Times are micros() truncated to a fixnum, so compare them modulo 2^32
+            assert (t - seen[i-1][1]) % 2**32 < 2**31, "event %d is earlier than the one before" % i
+    assert stats(out) == (count, 0, 0), "interrupt-stats %s" % (stats(out),)
+
+
+def test_overflow():
+    count = 1000
+    out = session("%d %d 20 500" % (PIN, count), [
+        ("(attach-interrupt %d 0 (lambda (pin level time) nil))" % PIN, 0.1),
+        ("(delay 1500)", 2.0),
+        ("(interrupt-stats)", 0.1),
+    ], 0.2)
+    delivered, dropped, queued = stats(out)
+    assert dropped > 0, "no events dropped: %s" % (stats(out),)
+    assert delivered + dropped + queued == count, "events lost: %s" % (stats(out),)
+
+
+def test_fuel():
+    out = session("%d 40 1000 800" % PIN, [
+        ("(defvar *steps* 0)", 0.1),
+        ("(attach-interrupt %d 0 (lambda (pin level time) (dotimes (i 50) (incf *steps*))))" % PIN, 0.1),
+        ("(with-fuel 1000 (delay 500) (dotimes (i 100) (+ 1 2)) (list 'result *steps*))", 1.0),
+    ], 0.2)
+    # The handlers take several thousand steps, which mustn't come out of the 1000 given to the form
+    assert "(result 2000)" in out, "with-fuel form failed:\n" + out
+
+
+def test_garbage():
+    out = session("%d 40 1000 800" % PIN, [
+        ("(defvar *steps* 0)", 0.1),
+        ("(attach-interrupt %d 0 (lambda (pin level time) (dotimes (i 50) (incf *steps*))))" % PIN, 0.1),
+        ("(progn (delay 500) (dotimes (i 2500)) 'done)", 1.0),
+    ], 0.2)
+    # An empty dotimes allocates its counters without calling eval, so it needs the handlers' garbage collected
+    assert "\ndone" in out.replace("\r", ""), "form failed:\n" + out
+
+
+def main():
+    if not os.path.exists(ULISP):
+        sys.exit("%s not found - run tools/host/build.sh first" % ULISP)
+    failed = 0
+    for test in (test_ordering, test_overflow, test_fuel, test_garbage):
+        try:
+            test()
+            print("ok  ", test.__name__)
+        except AssertionError as e:
+            failed += 1
+            print("FAIL", test.__name__, "-", e)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
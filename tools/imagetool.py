@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""Inspect and compare uLisp images saved to the serial flash.
+
+The input is a dump of the image area, starting at the image header - for example
+the file named by SERIALFLASHFILE in a host build. The checkpoint log is replayed
+as load-image does.
+
+    python3 tools/imagetool.py info flash.bin
+    python3 tools/imagetool.py globals flash.bin
+    python3 tools/imagetool.py diff old.bin new.bin
+"""
+
+import os
+import struct
+import sys
+import zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from romlibrary import builtins
+
+IMAGEMAGIC = 0x70734C75
+IMAGEVERSION = 7
+LOGMAGIC = 0x676F4C75
+IMAGEROM = 0x80000000
+FLASHPAGE = 256
+FLASHSECTOR = 4096
+LOGPAGES = 96
+MAXSYMBOL = 4096000000
+TYPES = {2: "symbol", 4: "code", 6: "number", 8: "stream", 10: "character", 12: "float", 14: "fixed", 16: "ring", 18: "array",
+         20: "hash-table", 22: "struct", 24: "generator", 26: "string"}
+
+HEADER = struct.Struct("<IHHIIIIIIIIIIIII")
+HEADERFIELDS = ("magic", "version", "builtins", "length", "crc", "imagesize", "symboltablesize", "codesize", "ringsize",
+                "autorun", "globalenv", "gcstack", "symboltop", "romhash", "generation", "logoffset")
+RECORD = struct.Struct("<IIIIIIIII%dH" % LOGPAGES)
+ROOTS = ("imagesize", "autorun", "globalenv", "gcstack", "symboltop")
+
+
+class Image:
+    def __init__(self, path):
+        self.flash = open(path, "rb").read()
+        self.header = dict(zip(HEADERFIELDS, HEADER.unpack_from(self.flash, 0)))
+        h = self.header
+        if h["magic"] != IMAGEMAGIC:
+            raise SystemExit("%s: no saved image" % path)
+        if h["version"] != IMAGEVERSION:
+            raise SystemExit("%s: image version %d not supported" % (path, h["version"]))
+        data = self.flash[FLASHPAGE:FLASHPAGE + h["length"]]
+        if zlib.crc32(data) != h["crc"]:
+            raise SystemExit("%s: image checksum error" % path)
+        self.stream = bytearray(data)
+        self.records = []
+        self.replay()
+        self.symbols = bytes(self.stream[:h["symboltablesize"]]).split(b"\0")
+        cells = self.stream[h["symboltablesize"] + h["codesize"] + h["ringsize"]:]
+        self.cells = [struct.unpack_from("<II", cells, i * 8) for i in range(self.roots["imagesize"])]
+        self.names = builtins()
+
+    def record(self, addr):
+        if addr + FLASHPAGE > len(self.flash):
+            return None
+        fields = RECORD.unpack_from(self.flash, addr)
+        magic, generation, crc, pages = fields[:4]
+        if magic != LOGMAGIC or generation != self.header["generation"] or pages > LOGPAGES:
+            return None
+        data = self.flash[addr + FLASHPAGE:addr + (pages + 1) * FLASHPAGE]
+        head = bytearray(self.flash[addr:addr + RECORD.size])
+        head[8:12] = bytes(4)
+        if zlib.crc32(bytes(head), zlib.crc32(data)) != crc:
+            return None
+        return fields, data
+
+    def replay(self):
+        base = self.header["logoffset"]
+        addr = base
+        self.roots = {name: self.header[name] for name in ROOTS}
+        while True:
+            found = self.record(addr)
+            if found is None:
+                sector = base + (addr - base + FLASHSECTOR - 1) // FLASHSECTOR * FLASHSECTOR
+                found = None if sector == addr else self.record(sector)
+                if found is None:
+                    break
+                addr = sector
+            fields, data = found
+            pages = fields[9:9 + fields[3]]
+            for n, page in enumerate(pages):
+                end = (page + 1) * FLASHPAGE
+                if end > len(self.stream):
+                    self.stream.extend(bytes(end - len(self.stream)))
+                self.stream[page * FLASHPAGE:end] = data[n * FLASHPAGE:(n + 1) * FLASHPAGE]
+            self.roots = dict(zip(ROOTS, fields[4:9]))
+            self.records.append((addr, list(pages)))
+            addr = addr + (fields[3] + 1) * FLASHPAGE
+
+    def symbolname(self, name):
+        if name < len(self.names):
+            return self.names[name]
+        if name >= MAXSYMBOL:
+            return self.symbols[name - MAXSYMBOL].decode("latin-1")
+        chars = ""
+        for i in range(6):
+            n = name // 40 ** (5 - i) % 40
+            chars += "\0abcdefghijklmnopqrstuvwxyz$*-0123456789"[n]
+        return chars.rstrip("\0")
+
+    def cell(self, ref):
+        return self.cells[(ref >> 2) - 1]
+
+    def string(self, ref):
+        chars = ""
+        while ref:
+            car, cdr = self.cell(ref)
+            for shift in (24, 16, 8, 0):
+                c = cdr >> shift & 0xFF
+                if c:
+                    chars += chr(c)
+            ref = car & ~3
+        return chars
+
+    def printed(self, ref, depth=0):
+        if ref == 0:
+            return "nil"
+        if ref & IMAGEROM:
+            return "#<library>"
+        if depth > 40:
+            return "..."
+        car, cdr = self.cell(ref)
+        if car & 1:
+            items = []
+            while True:
+                items.append(self.printed(car & ~3, depth + 1))
+                if cdr == 0:
+                    return "(" + " ".join(items) + ")"
+                if cdr & IMAGEROM or not self.cell(cdr)[0] & 1 or len(items) > 200:
+                    return "(" + " ".join(items) + " . " + self.printed(cdr, depth + 1) + ")"
+                car, cdr = self.cell(cdr)
+        kind = TYPES.get(car, "?")
+        if kind == "symbol":
+            return self.symbolname(cdr)
+        if kind == "number":
+            return str(struct.unpack("<i", struct.pack("<I", cdr))[0])
+        if kind == "float":
+            return repr(struct.unpack("<f", struct.pack("<I", cdr))[0])
+        if kind == "fixed":
+            return "#q" + repr(struct.unpack("<i", struct.pack("<I", cdr))[0] / 65536)
+        if kind == "character":
+            return "#\\" + chr(cdr)
+        if kind == "string":
+            return '"' + self.string(cdr) + '"'
+        return "#<%s>" % kind
+
+    def globals(self):
+        bindings = []
+        ref = self.roots["globalenv"]
+        while ref and not ref & IMAGEROM:
+            car, cdr = self.cell(ref)
+            pair = self.cell(car & ~3)
+            bindings.append((self.printed(pair[0] & ~3), self.printed(pair[1])))
+            ref = cdr
+        return bindings
+
+
+def info(image):
+    for name in HEADERFIELDS:
+        value = image.header[name]
+        print("%-16s %s" % (name, hex(value) if name in ("magic", "crc", "romhash") else value))
+    print("%-16s %d" % ("log records", len(image.records)))
+    for addr, pages in image.records:
+        print("  at %#x: pages %s" % (addr, " ".join(map(str, pages)) or "-"))
+    for name in ROOTS:
+        print("%-16s %d" % ("latest " + name, image.roots[name]))
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in ("info", "globals", "diff"):
+        raise SystemExit(__doc__)
+    image = Image(sys.argv[2])
+    if sys.argv[1] == "info":
+        info(image)
+    elif sys.argv[1] == "globals":
+        for name, value in image.globals():
+            print("%s = %s" % (name, value))
+    else:
+        old, new = dict(image.globals()), dict(Image(sys.argv[3]).globals())
+        for name in sorted(set(old) | set(new)):
+            if name not in new:
+                print("- %s = %s" % (name, old[name]))
+            elif name not in old:
+                print("+ %s = %s" % (name, new[name]))
+            elif old[name] != new[name]:
+                print("- %s = %s\n+ %s = %s" % (name, old[name], name, new[name]))
+
+
+if __name__ == "__main__":
+    main()
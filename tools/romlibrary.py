@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+"""Build firmware/ulisp/core/ulisp-rom-library.h from firmware/ulisp/library.lisp.
+
+The header holds the library as a read-only cell image: the defuns and constant
+defvars become a GlobalEnv list in flash, and any other top-level forms are kept
+as a list that loadfromlibrary() evaluates at startup. Rerun this after changing
+library.lisp or the builtin function table:
+
+    python3 tools/romlibrary.py
+"""
+
+import os
+import re
+import struct
+import sys
+import zlib
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "firmware", "ulisp")
+CORE = os.path.join(ROOT, "core", "ulisp-stm32.cpp")
+FFI = os.path.join(ROOT, "library.cpp")
+SOURCE = os.path.join(ROOT, "library.lisp")
+OUTPUT = os.path.join(ROOT, "core", "ulisp-rom-library.h")
+
+MAXSYMBOL = 4096000000
+CONTROLCODES = ("null soh stx etx eot enq ack bell backspace tab newline vt page return so si dle dc1 dc2 "
+                "dc3 dc4 nak syn etb can em sub escape fs gs rs us space").split()
+TYPES = {"SYMBOL": 2, "NUMBER": 6, "CHARACTER": 10, "FLOAT": 12, "STRING_": 26}
+
+
+def builtins():
+    """Builtin names in lookup_table order, which is the order of enum function."""
+    core, ffi = open(CORE).read(), open(FFI).read()
+    strings = dict(re.findall(r'const char (\w+)\[\] PROGMEM = "((?:[^"\\]|\\.)*)";', core + ffi))
+    table = core[core.index("lookup_table[] PROGMEM = {"):]
+    table = table[:table.index("};")]
+    names = re.findall(r"\{ (\w+), ", table)
+    macro = ffi[ffi.index("#define LOOKUP_TABLE_ENTRIES"):ffi.index("#else")]
+    names += re.findall(r"\{ (\w+), ", macro)
+    return [strings[n].lower() for n in names]
+
+
+class Symbol(str):
+    pass
+
+
+class Reader:
+    def __init__(self, text):
+        self.text, self.pos = text, 0
+
+    def peek(self):
+        return self.text[self.pos] if self.pos < len(self.text) else ""
+
+    def skip(self):
+        while self.pos < len(self.text):
+            c = self.text[self.pos]
+            if c.isspace():
+                self.pos += 1
+            elif c == ";":
+                while self.pos < len(self.text) and self.text[self.pos] != "\n":
+                    self.pos += 1
+            elif self.text.startswith("#|", self.pos):
+                self.pos = self.text.index("|#", self.pos) + 2
+            else:
+                return
+
+    def read(self):
+        self.skip()
+        c = self.peek()
+        if c == "":
+            raise EOFError
+        if c == "(":
+            self.pos += 1
+            items, tail = [], None
+            while True:
+                self.skip()
+                if self.peek() == ")":
+                    self.pos += 1
+                    return (items, tail)
+                if self.peek() == "":
+                    raise SyntaxError("incomplete list")
+                item = self.read()
+                if isinstance(item, Symbol) and item == ".":
+                    tail = self.read()
+                else:
+                    items.append(item)
+        if c == ")":
+            raise SyntaxError("unexpected )")
+        if c == "'":
+            self.pos += 1
+            return ([Symbol("quote"), self.read()], None)
+        if c == '"':
+            self.pos += 1
+            chars = []
+            while self.peek() != '"':
+                if self.peek() == "\\":
+                    self.pos += 1
+                chars.append(self.peek())
+                self.pos += 1
+            self.pos += 1
+            return "".join(chars)
+        start = self.pos
+        while self.pos < len(self.text) and not self.text[self.pos].isspace() and self.text[self.pos] not in "()":
+            self.pos += 1
+        return atom(self.text[start:self.pos])
+
+
+def atom(token):
+    low = token.lower()
+    if low.startswith("#\\"):
+        name = token[2:]
+        if len(name) > 1:
+            name = chr(CONTROLCODES.index(name.lower()))
+        return ("char", name)
+    base = {"#x": 16, "#b": 2, "#o": 8}.get(low[:2])
+    if base:
+        return int(low[2:], base)
+    try:
+        return int(token, 10)
+    except ValueError:
+        pass
+    try:
+        return float(token)
+    except ValueError:
+        return Symbol(token)
+
+
+class Image:
+    def __init__(self, names):
+        self.names = {name: i for i, name in enumerate(names)}
+        self.cells = []
+        self.symbols = {}
+        self.long = []
+
+    def cell(self, car, cdr):
+        self.cells.append((car, cdr))
+        return len(self.cells) - 1
+
+    def name(self, symbol):
+        low = symbol.lower()
+        if low in self.names:
+            return self.names[low]
+        digits = "\0abcdefghijklmnopqrstuvwxyz$*-0123456789"
+        if len(low) <= 6 and all(c in digits[1:] for c in low):
+            x = 0
+            for c in low.ljust(6, "\0"):
+                x = x * 40 + digits.index(c)
+            return x
+        for i, s in enumerate(self.long):
+            if s.lower() == low:
+                return MAXSYMBOL + i
+        self.long.append(str(symbol))
+        return MAXSYMBOL + len(self.long) - 1
+
+    def symbol(self, symbol):
+        n = self.name(symbol)
+        if n not in self.symbols:
+            self.symbols[n] = self.cell(("type", "SYMBOL"), ("int", n))
+        return self.symbols[n]
+
+    def build(self, obj):
+        if isinstance(obj, Symbol):
+            if obj.lower() == "nil":
+                return None
+            return self.symbol(obj)
+        if isinstance(obj, bool) or obj is None:
+            return None
+        if isinstance(obj, int):
+            return self.cell(("type", "NUMBER"), ("int", obj))
+        if isinstance(obj, float):
+            bits = struct.unpack("<I", struct.pack("<f", obj))[0]
+            return self.cell(("type", "FLOAT"), ("int", bits))
+        if isinstance(obj, tuple) and obj[0] == "char":
+            return self.cell(("type", "CHARACTER"), ("int", ord(obj[1])))
+        if isinstance(obj, str):
+            head = self.cell(("type", "STRING_"), None)
+            data = obj.encode("latin-1")
+            prev = None
+            for i in range(0, len(data), 4):
+                chunk = data[i:i+4]
+                packed = 0
+                for j in range(4):
+                    packed = packed << 8 | (chunk[j] if j < len(chunk) else 0)
+                chars = self.cell(None, ("int", packed))
+                if prev is None:
+                    self.cells[head] = (("type", "STRING_"), chars)
+                else:
+                    self.cells[prev] = (chars, self.cells[prev][1])
+                prev = chars
+            return head
+        items, tail = obj
+        result = self.build(tail)
+        for item in reversed(items):
+            result = self.cell(self.build(item), result)
+        return result
+
+    def list(self, refs):
+        result = None
+        for ref in reversed(refs):
+            result = self.cell(ref, result)
+        return result
+
+
+def constant(obj):
+    if isinstance(obj, (int, float, str)) and not isinstance(obj, Symbol):
+        return True
+    if isinstance(obj, Symbol):
+        return obj.lower() in ("nil", "t")
+    if isinstance(obj, tuple) and obj[0] == "char":
+        return True
+    items, tail = obj
+    return len(items) == 2 and tail is None and items[0] == Symbol("quote")
+
+
+def main():
+    text = open(SOURCE).read()
+    text = "\n".join(line for line in text.split("\n") if not line.startswith("#"))
+    reader = Reader(text)
+    names = builtins()
+    image = Image(names)
+    definitions, forms = [], []
+    while True:
+        try:
+            form = reader.read()
+        except EOFError:
+            break
+        items = form[0] if isinstance(form, tuple) and isinstance(form[0], list) else None
+        head = items[0].lower() if items and isinstance(items[0], Symbol) else None
+        if head == "defun" and len(items) >= 3:
+            value = image.cell(image.symbol(Symbol("lambda")), image.build((items[2:], None)))
+            definitions.append((items[1].lower(), image.cell(image.symbol(items[1]), value)))
+        elif head == "defvar" and len(items) <= 3 and (len(items) == 2 or constant(items[2])):
+            value = None
+            if len(items) == 3:
+                value = image.build(items[2][0][1]) if isinstance(items[2], tuple) and items[2][0] and items[2][0][0] == Symbol("quote") else image.build(items[2])
+            definitions.append((items[1].lower(), image.cell(image.symbol(items[1]), value)))
+        else:
+            forms.append(image.build(form))
+    # Later definitions replace earlier ones, and sp_defun pushes onto the front
+    pairs, seen = [], set()
+    for name, pair in reversed(definitions):
+        if name not in seen:
+            seen.add(name)
+            pairs.append(pair)
+    env = image.list(pairs)
+    forms = image.list(forms)
+    symbols = "".join(s + "\0" for s in image.long)
+
+    def ref(r):
+        if r is None:
+            return "NULL"
+        if r[0] == "type":
+            return "(object *)%s" % r[1]
+        if r[0] == "int":
+            return "(object *)(uintptr_t)%s" % (r[1] if r[1] >= 0 else "(unsigned int)%d" % r[1])
+        return "(object *)&LispRom[%d]" % r
+
+    def slot(r):
+        return ref(r) if not isinstance(r, int) else "(object *)&LispRom[%d]" % r
+
+    out = ["// Generated from library.lisp by tools/romlibrary.py - do not edit", ""]
+    out.append("#define ROMCELLS %d" % max(len(image.cells), 1))
+    out.append("#define ROMENV %s" % ("NULL" if env is None else "((object *)&LispRom[%d])" % env))
+    out.append("#define ROMFORMS %s" % ("NULL" if forms is None else "((object *)&LispRom[%d])" % forms))
+    out.append("#define ROMSYMBOLS %d" % len(symbols.encode("latin-1")))
+    # Builtins are saved as their numbers, which the firmware checks against its own ENDFUNCTIONS
+    out.append("#define ROMBUILTINS %d" % len(names))
+    # Saved images refer to ROM cells by number, so they are only valid with the same cells
+    out.append("#define ROMHASH 0x%08X" % (zlib.crc32(repr((image.cells, env, forms, symbols)).encode()) & 0xFFFFFFFF))
+    out.append("")
+    escaped = "".join("\\0" if c == "\0" else c for c in symbols)
+    out.append('const char LispRomSymbols[] PROGMEM = "%s";' % escaped)
+    out.append("")
+    out.append("const object LispRom[ROMCELLS] = {")
+    for car, cdr in image.cells or [(None, None)]:
+        out.append("  { { { %s, %s } } }," % (slot(car), slot(cdr)))
+    out.append("};")
+    open(OUTPUT, "w").write("\n".join(out) + "\n")
+    print("%s: %d cells, %d definitions" % (os.path.normpath(OUTPUT), len(image.cells), len(pairs)))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+"""Upload a Lisp program to the uLisp REPL with the framed upload protocol.
+
+Each frame is acknowledged after the Duo has used it, so there is no
+pasting limit and no echo. Output printed by the program is shown as it
+arrives.
+
+    python3 tools/upload.py /dev/ttyACM0 program.lisp
+    python3 tools/upload.py --binary /dev/ttyACM0 program.lisp
+
+The --binary option sends each form that the encoder understands as a
+serialized form (the encoding of the serialize builtin), so the Duo does
+not need to run the reader on it. Other forms are sent as source.
+
+For a loopback test against a host build of the firmware, --exec runs a
+command and talks to its standard input and output in place of a serial
+port. --corrupt N damages every Nth frame to exercise resending:
+
+    python3 tools/upload.py --corrupt 3 --exec ./ulisp program.lisp
+"""
+
+import argparse
+import os
+import queue
+import re
+import struct
+import subprocess
+import sys
+import threading
+import time
+import zlib
+
+UPLOADSTART, UPLOADACK, UPLOADNAK, UPLOADCAN = 0x01, 0x06, 0x15, 0x18
+UPLOADFRAME = 256
+SOURCE, FORM, END = b"S", b"B", b"E"
+
+
+class SerialPort:
+    def __init__(self, port, baud):
+        import serial
+        self.port = serial.Serial(port, baud, timeout=0.05)
+
+    def write(self, data):
+        self.port.write(data)
+
+    def read(self):
+        return self.port.read(256)
+
+
+class Process:
+    def __init__(self, command):
+        self.process = subprocess.Popen(command, shell=True, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.output = queue.Queue()
+        threading.Thread(target=self.reader, daemon=True).start()
+
+    def reader(self):
+        while True:
+            data = os.read(self.process.stdout.fileno(), 256)
+            if not data:
+                break
+            self.output.put(data)
+
+    def write(self, data):
+        self.process.stdin.write(data)
+        self.process.stdin.flush()
+
+    def read(self):
+        try:
+            return self.output.get(timeout=0.05)
+        except queue.Empty:
+            return b""
+
+
+# Splitting source into forms
+
+TOKEN = re.compile(r'"(?:\\.|[^"\\])*"|#\\.[^\s()]*|;[^\n]*|[()\']|[^\s()\';"]+|\s+', re.S)
+
+
+def tokens(text):
+    pos = 0
+    while pos < len(text):
+        match = TOKEN.match(text, pos)
+        if match is None:
+            raise SystemExit("can't read the source near: %r" % text[pos:pos + 20])
+        pos = match.end()
+        yield match.group()
+
+
+def forms(text):
+    """Yields the source of each top level form, without comments."""
+    form, depth = [], 0
+    for token in tokens(text):
+        if token.startswith(";"):
+            continue
+        if token.isspace():
+            if form:
+                form.append(" " if "\n" not in token else "\n")
+            continue
+        form.append(token)
+        if token == "(":
+            depth += 1
+        elif token == ")":
+            depth -= 1
+        if depth <= 0 and token != "'":
+            yield "".join(form).strip()
+            form, depth = [], 0
+    if form:
+        raise SystemExit("incomplete form at the end of the program")
+
+
+# The binary encoding of the serialize builtin, for a subset of forms
+
+BINNIL, BINCONS, BININT8, BININT16, BININT32, BINFLOAT, BINCHAR, BINSTRING, BINSYMBOL = range(9)
+BINSYMREF, BINSYMBOLS = 12, 32
+CHARACTERS = {"space": 32, "newline": 10, "tab": 9, "return": 13, "escape": 27, "backspace": 8}
+INTEGER = re.compile(r"[+-]?\d+$")
+FLOAT = re.compile(r"[+-]?(\d+\.\d*|\.\d+|\d+(\.\d*)?[eE][+-]?\d+)$")
+
+
+class Unsupported(Exception):
+    pass
+
+
+def parse(items, pos):
+    """Returns the object read from items at pos, and the position after it."""
+    token = items[pos]
+    if token == "(":
+        result, pos = [], pos + 1
+        while items[pos] != ")":
+            if items[pos] == ".":
+                raise Unsupported
+            obj, pos = parse(items, pos)
+            result.append(obj)
+        return result, pos + 1
+    if token == "'":
+        obj, pos = parse(items, pos + 1)
+        return [("symbol", "quote"), obj], pos
+    if token == ")":
+        raise Unsupported
+    return atom(token), pos + 1
+
+
+def atom(token):
+    if token.startswith('"'):
+        return ("string", re.sub(r"\\(.)", r"\1", token[1:-1]))
+    if token.startswith("#\\"):
+        name = token[2:]
+        if len(name) == 1:
+            return ("char", ord(name))
+        if name.lower() in CHARACTERS:
+            return ("char", CHARACTERS[name.lower()])
+        raise Unsupported
+    if token.startswith("#") or "|" in token:
+        raise Unsupported
+    if INTEGER.match(token):
+        value = int(token)
+        if not -2 ** 31 <= value < 2 ** 31:
+            raise Unsupported
+        return value
+    if FLOAT.match(token):
+        return float(token)
+    if token.lower() == "nil":
+        return []
+    return ("symbol", token)
+
+
+def encode(obj, out, symbols):
+    while isinstance(obj, list) and obj:
+        out.append(BINCONS)
+        encode(obj[0], out, symbols)
+        obj = obj[1:]
+    if obj == []:
+        out.append(BINNIL)
+    elif isinstance(obj, int):
+        if 0 <= obj < 128:
+            out.append(0x80 | obj)
+        elif -128 <= obj < 128:
+            out += bytes([BININT8]) + struct.pack("<b", obj)
+        elif -32768 <= obj < 32768:
+            out += bytes([BININT16]) + struct.pack("<h", obj)
+        else:
+            out += bytes([BININT32]) + struct.pack("<i", obj)
+    elif isinstance(obj, float):
+        out += bytes([BINFLOAT]) + struct.pack("<f", obj)
+    elif obj[0] == "char":
+        out += bytes([BINCHAR, obj[1]])
+    elif obj[0] == "string":
+        data = obj[1].encode("latin-1")
+        out.append(BINSTRING)
+        length(len(data), out)
+        out += data
+    elif obj[0] == "symbol":
+        if obj[1] in symbols:
+            out += bytes([BINSYMREF, symbols.index(obj[1])])
+            return
+        if len(symbols) < BINSYMBOLS:
+            symbols.append(obj[1])
+        data = obj[1].encode("latin-1")
+        out.append(BINSYMBOL)
+        length(len(data), out)
+        out += data
+
+
+def length(n, out):
+    while n >= 0x80:
+        out.append(n & 0x7F | 0x80)
+        n >>= 7
+    out.append(n)
+
+
+def serialized(source):
+    """Returns the serialized form, or None if it should be sent as source."""
+    items = [token for token in tokens(source) if not token.isspace()]
+    try:
+        data = bytearray()
+        encode(parse(items, 0)[0], data, [])
+    except (Unsupported, IndexError):
+        return None
+    return bytes(data) if len(data) <= UPLOADFRAME else None
+
+
+def frames(text, binary):
+    """Yields (type, payload), packing source forms into as few frames as possible."""
+    pending = b""
+    for source in forms(text):
+        data = serialized(source) if binary else None
+        if data is not None:
+            if pending:
+                yield SOURCE, pending
+                pending = b""
+            yield FORM, data
+            continue
+        data = source.encode("latin-1") + b"\n"
+        if pending and len(pending) + len(data) > UPLOADFRAME:
+            yield SOURCE, pending
+            pending = b""
+        pending += data
+        while len(pending) > UPLOADFRAME:
+            yield SOURCE, pending[:UPLOADFRAME]
+            pending = pending[UPLOADFRAME:]
+    if pending:
+        yield SOURCE, pending
+
+
+class Uploader:
+    def __init__(self, link, corrupt=0, timeout=30):
+        self.link, self.corrupt, self.timeout = link, corrupt, timeout
+        self.pending = b""
+        self.sent = self.resent = 0
+
+    def reply(self, timeout):
+        """Waits for a control byte, showing any other output."""
+        end = time.time() + timeout
+        while time.time() < end:
+            if not self.pending:
+                self.pending = self.link.read()
+                continue
+            c, self.pending = self.pending[0], self.pending[1:]
+            if c in (UPLOADACK, UPLOADNAK, UPLOADCAN):
+                return c
+            sys.stdout.write(chr(c))
+            sys.stdout.flush()
+        return None
+
+    def drain(self, seconds):
+        end = time.time() + seconds
+        while time.time() < end:
+            data = self.pending or self.link.read()
+            self.pending = b""
+            sys.stdout.write(data.decode("latin-1"))
+        sys.stdout.flush()
+
+    def frame(self, kind, sequence, payload):
+        data = kind + struct.pack("<BH", sequence & 0xFF, len(payload)) + payload
+        data += struct.pack("<I", zlib.crc32(data))
+        while True:
+            self.sent += 1
+            damaged = self.corrupt and self.sent % self.corrupt == 0
+            self.link.write(data[:-1] + bytes([data[-1] ^ 0xFF]) if damaged else data)
+            c = self.reply(self.timeout)
+            if c == UPLOADACK:
+                return
+            if c == UPLOADCAN:
+                self.drain(0.3)
+                raise SystemExit("upload stopped by an error")
+            if c is None:
+                raise SystemExit("no reply from uLisp")
+            self.resent += 1
+
+    def upload(self, text, binary):
+        self.drain(0.5)
+        self.link.write(bytes([UPLOADSTART]) + b"U")
+        if self.reply(2) != UPLOADACK:
+            raise SystemExit("uLisp did not start the upload; is the REPL waiting at a prompt?")
+        sequence = 0
+        for kind, payload in frames(text, binary):
+            self.frame(kind, sequence, payload)
+            sequence += 1
+        self.frame(END, sequence, b"")
+        self.drain(0.3)
+        print("\n%d frames, %d sent again" % (sequence + 1, self.resent), file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("port", nargs="?", help="serial port of the Duo")
+    parser.add_argument("file", help="Lisp source file")
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--binary", action="store_true", help="send forms serialized where possible")
+    parser.add_argument("--exec", dest="command", help="talk to this command instead of a serial port")
+    parser.add_argument("--corrupt", type=int, default=0, metavar="N", help="damage every Nth frame")
+    args = parser.parse_args()
+    if args.command:
+        link = Process(args.command)
+    elif args.port:
+        link = SerialPort(args.port, args.baud)
+    else:
+        parser.error("give a serial port or --exec")
+    text = open(args.file, encoding="latin-1").read()
+    Uploader(link, args.corrupt).upload(text, args.binary)
+
+
+if __name__ == "__main__":
+    main()